@@ -157,21 +157,71 @@ class guppi_status:
 
 GUPPI_DATABUF_KEY = 12987498
 
+# Layout of struct guppi_databuf (guppi_databuf.h, x86_64): byte
+# offsets of the fields read here, and the size of the struct, which
+# is followed by the lock words (futex databufs, 64 bytes per block)
+# and the physical block table.
+GUPPI_DATABUF_VALID_SIZE_OFFSET = 104
+GUPPI_DATABUF_FLAGS_OFFSET = 112
+GUPPI_DATABUF_INFO_SIZE_OFFSET = 392
+GUPPI_DATABUF_ID_OFFSET = 3264
+GUPPI_DATABUF_STRUCT_LEN = 3288
+GUPPI_DATABUF_FUTEX = 0x1
+GUPPI_DATABUF_LOCK_SIZE = 64
+
 class guppi_databuf:
 
     def __init__(self,databuf_id=1):
         self.buf = shm.SharedMemoryHandle(GUPPI_DATABUF_KEY+databuf_id-1)
+        self.pool = {databuf_id: self}
+        self.dtype = n.int8
+        self.read_layout()
+        self.read_all_hdr()
+
+    def read_layout(self):
+        """
+        read_layout():
+            Read the block layout, which guppi_databuf_reconfigure
+            may change between observations.
+        """
         self.data_type = self.buf.read(NumberOfBytes=64, offset=0)
         packed = self.buf.read(NumberOfBytes=3*8+3*4, offset=64)
         self.struct_size, self.block_size, self.header_size = \
                 n.fromstring(packed[0:24], dtype=n.int64)
         self.shmid, self.semid, self.n_block= \
                 n.fromstring(packed[24:36], dtype=n.int32)
+        self.valid_size = n.fromstring(self.buf.read(NumberOfBytes=8, \
+                offset=GUPPI_DATABUF_VALID_SIZE_OFFSET), dtype=n.int64)[0]
+        self.flags = n.fromstring(self.buf.read(NumberOfBytes=4, \
+                offset=GUPPI_DATABUF_FLAGS_OFFSET), dtype=n.int32)[0]
+        self.info_size = n.fromstring(self.buf.read(NumberOfBytes=8, \
+                offset=GUPPI_DATABUF_INFO_SIZE_OFFSET), dtype=n.int64)[0]
+        self.databuf_id = n.fromstring(self.buf.read(NumberOfBytes=4, \
+                offset=GUPPI_DATABUF_ID_OFFSET), dtype=n.int32)[0]
+        self.phys_offset = (GUPPI_DATABUF_STRUCT_LEN + 63) / 64 * 64
+        if (self.flags & GUPPI_DATABUF_FUTEX):
+            self.phys_offset += self.n_block*GUPPI_DATABUF_LOCK_SIZE
+        # Block headers, then the info structs and validity maps
         self.header_offset = self.struct_size 
-        self.data_offset = self.struct_size + self.n_block*self.header_size
-        self.dtype = n.int8
+        self.data_offset = self.struct_size + self.n_block * \
+                (self.header_size + self.info_size + self.valid_size)
         self.read_size = self.block_size
-        self.read_all_hdr()
+
+    def data_location(self,block):
+        """
+        data_location(block):
+            Return the databuf holding the data of the given block
+            and its offset there.  Blocks handed on with
+            guppi_databuf_forward may live in another databuf.
+        """
+        phys = n.fromstring(self.buf.read(NumberOfBytes=4, \
+                offset=self.phys_offset + 4*block), dtype=n.int32)[0]
+        db_id = phys >> 16
+        if db_id not in self.pool:
+            self.pool[db_id] = guppi_databuf(db_id)
+        d = self.pool[db_id]
+        if (d is not self): d.read_layout()
+        return (d, d.data_offset + (phys & 0xffff)*d.block_size)
 
     def read_hdr(self,block):
         if (block<0 or block>=self.n_block):
@@ -187,6 +237,9 @@ class guppi_databuf:
                 self.header_offset + i*self.header_size)))
 
     def data(self,block):
+        self.read_layout()
+        if (len(self.hdr) != self.n_block):
+            self.read_all_hdr()
         if (block<0 or block>=self.n_block):
             raise IndexError, "block %d out of range (n_block=%d)" \
                     % (block, self.n_block)
@@ -198,8 +251,8 @@ class guppi_databuf:
                 self.dype = n.int8
         except KeyError:
             self.dtype = n.int8
-        raw = n.fromstring(self.buf.read(self.block_size, \
-                self.data_offset + block*self.block_size), \
+        (d, offset) = self.data_location(block)
+        raw = n.fromstring(d.buf.read(self.block_size, offset), \
                 dtype=self.dtype)
         try:
             npol = self.hdr[block]["NPOL"]
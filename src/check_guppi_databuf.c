@@ -22,6 +22,10 @@ void usage() {
             "  -i n, --id=n  (1)\n"
             "  -s n, --size=n (32M)\n"
             "  -n n, --nblock=n (24)\n"
+            "  -f, --futex   (with -c) Use futex block locks\n"
+            "  -H, --huge    (with -c) Use huge pages if available\n"
+            "  -r, --resize  Lay out existing databuf as -n blocks of -s MB\n"
+            "                (-s 0 for the largest that fit)\n"
             );
 }
 
@@ -35,15 +39,20 @@ int main(int argc, char *argv[]) {
         {"id",     1, NULL, 'i'},
         {"size",   1, NULL, 's'},
         {"nblock", 1, NULL, 'n'},
+        {"futex",  0, NULL, 'f'},
+        {"huge",   0, NULL, 'H'},
+        {"resize", 0, NULL, 'r'},
         {0,0,0,0}
     };
     int opt,opti;
     int quiet=0;
     int create=0;
+    int resize=0;
     int db_id=1;
     int blocksize = 32;
     int nblock = 24;
-    while ((opt=getopt_long(argc,argv,"hqci:s:n:",long_opts,&opti))!=-1) {
+    int flags = 0;
+    while ((opt=getopt_long(argc,argv,"hqci:s:n:fHr",long_opts,&opti))!=-1) {
         switch (opt) {
             case 'c':
                 create=1;
@@ -60,6 +69,15 @@ int main(int argc, char *argv[]) {
             case 'n':
                 nblock = atoi(optarg);
                 break;
+            case 'f':
+                flags |= GUPPI_DATABUF_FUTEX;
+                break;
+            case 'H':
+                flags |= GUPPI_DATABUF_HUGEPAGE;
+                break;
+            case 'r':
+                resize=1;
+                break;
             case 'h':
             default:
                 usage();
@@ -71,7 +89,7 @@ int main(int argc, char *argv[]) {
     /* Create mem if asked, otherwise attach */
     struct guppi_databuf *db=NULL;
     if (create) { 
-        db = guppi_databuf_create(nblock, blocksize*1024*1024, db_id);
+        db = guppi_databuf_create(nblock, blocksize*1024*1024, db_id, flags);
         if (db==NULL) {
             fprintf(stderr, "Error creating databuf %d (may already exist).\n",
                     db_id);
@@ -87,22 +105,96 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    /* Change layout if asked */
+    if (resize) {
+        if (guppi_databuf_reconfigure(db, nblock, 
+                    (size_t)blocksize*1024*1024, 5)!=GUPPI_OK) {
+            fprintf(stderr, "Error resizing databuf %d.\n", db_id);
+            exit(1);
+        }
+    }
+
     /* Print basic info */
     printf("databuf %d stats:\n", db_id);
     printf("  shmid=%d\n", db->shmid);
     printf("  semid=%d\n", db->semid);
+    printf("  locks=%s\n", 
+            (db->flags & GUPPI_DATABUF_FUTEX) ? "futex" : "semaphore");
+    printf("  pages=%zdk%s\n", db->page_size/1024,
+            (db->flags & GUPPI_DATABUF_HUGEPAGE) ? " (huge)" : "");
     printf("  n_block=%d\n", db->n_block);
     printf("  struct_size=%zd\n", db->struct_size);
     printf("  block_size=%zd\n", db->block_size);
-    printf("  header_size=%zd\n\n", db->header_size);
+    printf("  header_size=%zd\n", db->header_size);
+    printf("  valid_size=%zd\n", db->valid_size);
+    int i;
+    for (i=1; i<GUPPI_DATABUF_MAX_READERS; i++) {
+        if (!(db->reader_mask & (1U<<i))) continue;
+        if (db->optional_mask & (1U<<i))
+            printf("  reader %d (optional) skipped=%llu\n", i, db->nskip[i]);
+        else
+            printf("  reader %d\n", i);
+    }
+    printf("\n");
+
+    /* Time blocks spend in each stage */
+    const char *stage[GUPPI_DATABUF_NHIST] = {"fill", "wait", "proc"};
+    printf("block timing (us)      n      50%%      90%%      99%%\n");
+    for (i=0; i<GUPPI_DATABUF_NHIST; i++)
+        printf("  %-8s %12llu %8.0f %8.0f %8.0f\n", stage[i], 
+                db->hist[i].n,
+                guppi_databuf_hist_pct(&db->hist[i], 0.5),
+                guppi_databuf_hist_pct(&db->hist[i], 0.9),
+                guppi_databuf_hist_pct(&db->hist[i], 0.99));
+
+    /* Ring occupancy history, oldest first */
+    const int nocc = db->nocc < GUPPI_DATABUF_OCC_LEN ? 
+        db->nocc : GUPPI_DATABUF_OCC_LEN;
+    if (nocc) {
+        int count[db->n_block+1], j, k, max=0;
+        memset(count, 0, sizeof(count));
+        for (j=0; j<nocc; j++) {
+            k = db->occ[(db->nocc - nocc + j) % GUPPI_DATABUF_OCC_LEN];
+            if (k>db->n_block) k = db->n_block;
+            count[k]++;
+        }
+        for (k=0; k<=db->n_block; k++) if (count[k]>max) max = count[k];
+        printf("occupancy (blocks filled), last %d blocks:\n", nocc);
+        for (k=0; k<=db->n_block; k++) {
+            if (count[k]==0) continue;
+            printf("  %3d %6d ", k, count[k]);
+            for (j=0; j<(50*count[k]+max-1)/max; j++) printf("#");
+            printf("\n");
+        }
+        printf("  recent: ");
+        for (j=nocc>64 ? nocc-64 : 0; j<nocc; j++) {
+            k = db->occ[(db->nocc - nocc + j) % GUPPI_DATABUF_OCC_LEN];
+            printf("%c", "0123456789"[k*9/db->n_block > 9 ? 9 
+                    : k*9/db->n_block]);
+        }
+        printf("\n");
+    }
+    printf("\n");
 
     /* loop over blocks */
-    int i;
     char buf[81];
     char *hdr, *ptr, *hend;
     for (i=0; i<db->n_block; i++) {
-        printf("block %d status=%d\n", i, 
-                guppi_databuf_block_status(db, i));
+        if (db->reader_mask)
+            printf("block %d status=0x%x\n", i, 
+                    (unsigned)guppi_databuf_block_status(db, i));
+        else
+            printf("block %d status=%d\n", i, 
+                    guppi_databuf_block_status(db, i));
+        struct guppi_databuf_info *info = guppi_databuf_info(db, i);
+        if (info->hdr_seq)
+            printf("info pktidx=%lld npkt=%d ndrop=%d pktsize=%d hdr_seq=%llu\n",
+                    info->pktidx, info->npkt, info->ndrop, info->pktsize,
+                    info->hdr_seq);
+        struct guppi_databuf_valid *v = guppi_databuf_valid(db, i);
+        if (v!=NULL && v->npkt>0)
+            printf("valid %d/%d packets%s\n", v->nvalid, v->npkt,
+                    v->zeroed ? " (zero-filled)" : "");
         hdr = guppi_databuf_header(db, i);
         hend = ksearch(hdr, "END");
         if (hend==NULL) {
@@ -117,6 +117,13 @@ extern "C" {
     char *blsearch (
         const char* hstring,    /* FITS header string */
         const char* keyword);   /* FITS keyword */
+    void sethindex(             /* 1 to index keywords for ksearch, 0 not */
+        int hi);
+    void hindex_update(         /* Note card just written in FITS header */
+        const char* hstring,    /* FITS header string */
+        const char* card);      /* Card written */
+    void hindex_drop(           /* Forget index for rearranged FITS header */
+        const char* hstring);   /* FITS header string */
 
     char *strsrch (             /* Find string s2 within string s1 */
         const char* s1,         /* String to search */
@@ -323,6 +330,11 @@ extern char *ksearch();
 /* Find beginning of fillable blank line before FITS header keyword */
 extern char *blsearch();
 
+/* Keyword index used by ksearch */
+extern void sethindex();
+extern void hindex_update();
+extern void hindex_drop();
+
 /* Search for substring s2 within string s1 */
 extern char *strsrch ();        /* s1 null-terminated */
 extern char *strnsrch ();       /* s1 ls1 characters long */
@@ -441,4 +453,6 @@ extern char *getutime(); /* Return current UT as an ISO-format string */
  * Nov 29 2006  Drop semicolon at end of C++ ifdef
  *
  * Jan  9 2007  Fix declarations so ANSI prototypes are not just for C++
+ *
+ * Oct 16 2026  Add sethindex(), hindex_update(), and hindex_drop()
  */
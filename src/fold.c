@@ -258,14 +258,20 @@ void unpack_8bit_unsigned(float *out, const unsigned char *in, int n) {
 
 void *fold_8bit_power_thread(void *_args) {
     struct fold_args *args = (struct fold_args *)_args;
-    int rv = fold_8bit_power(args->pc, args->imjd, args->fmjd, args->data,
-            args->nsamp, args->tsamp, args->raw_signed, args->fb);
+    int rv;
+    if (args->valid!=NULL && args->valid->npkt>0)
+        rv = fold_8bit_power_valid(args->pc, args->imjd, args->fmjd, 
+                args->data, args->nsamp, args->tsamp, args->raw_signed, 
+                args->valid, args->fb);
+    else
+        rv = fold_8bit_power(args->pc, args->imjd, args->fmjd, args->data,
+                args->nsamp, args->tsamp, args->raw_signed, args->fb);
     pthread_exit(&rv);
 }
 
-int fold_8bit_power(const struct polyco *pc, int imjd, double fmjd, 
-        const char *data, int nsamp, double tsamp, int raw_signed,
-        struct foldbuf *f) {
+/* Calc phase of first sample and phase step per sample */
+static int fold_phase(const struct polyco *pc, int imjd, double fmjd,
+        int nsamp, double tsamp, double *phase, double *dphase) {
 
     /* Find midtime */
     double fmjd_mid = fmjd + nsamp*tsamp/2.0/86400.0;
@@ -278,35 +284,87 @@ int fold_8bit_power(const struct polyco *pc, int imjd, double fmjd,
      * of the first sample, assuming input fmjd refers to 
      * the rising edge of the first sample given
      */
-    double dphase=0.0;
-    double phase = psr_phase(pc, imjd, fmjd + tsamp/2.0/86400.0, NULL, NULL);
-    phase = fmod(phase, 1.0);
-    if (phase<0.0) { phase += 1.0; }
-    psr_phase(pc, imjd, fmjd_mid, &dphase, NULL);
-    dphase *= tsamp;
+    *dphase=0.0;
+    *phase = psr_phase(pc, imjd, fmjd + tsamp/2.0/86400.0, NULL, NULL);
+    *phase = fmod(*phase, 1.0);
+    if (*phase<0.0) { *phase += 1.0; }
+    psr_phase(pc, imjd, fmjd_mid, dphase, NULL);
+    *dphase *= tsamp;
+    return(0);
+}
 
-    /* Fold em */
+/* Fold samples [i0,i1), starting at the given phase.  All-zero
+ * samples are skipped if check_zero is set.
+ */
+static void fold_8bit_power_range(const char *data, int i0, int i1, 
+        double phase, double dphase, int raw_signed, int check_zero,
+        struct foldbuf *f) {
     int i, ibin;
     float *fptr;
-    for (i=0; i<nsamp; i++) {
+    const int n = f->nchan*f->npol;
+    for (i=i0; i<i1; i++) {
         ibin = (int)(phase * (double)f->nbin);
         if (ibin<0) { ibin+=f->nbin; }
         if (ibin>=f->nbin) { ibin-=f->nbin; }
-        fptr = &f->data[ibin*f->nchan*f->npol];
-        if (zero_check(&data[i*f->nchan*f->npol],f->nchan*f->npol)==0) { 
+        fptr = &f->data[ibin*n];
+        if (check_zero==0 || zero_check(&data[i*n],n)==0) { 
             if (raw_signed)
-                vector_accumulate_8bit(fptr, 
-                        &data[i*f->nchan*f->npol],
-                        f->nchan*f->npol);
+                vector_accumulate_8bit(fptr, &data[i*n], n);
             else 
                 vector_accumulate_8bit_unsigned(fptr, 
-                        (unsigned char *)&data[i*f->nchan*f->npol],
-                        f->nchan*f->npol);
+                        (unsigned char *)&data[i*n], n);
             f->count[ibin]++;
         }
         phase += dphase;
         if (phase>1.0) { phase -= 1.0; }
     }
+}
+
+int fold_8bit_power(const struct polyco *pc, int imjd, double fmjd, 
+        const char *data, int nsamp, double tsamp, int raw_signed,
+        struct foldbuf *f) {
+
+    double phase, dphase;
+    if (fold_phase(pc, imjd, fmjd, nsamp, tsamp, &phase, &dphase)) 
+        return(-1);
+
+    /* Fold em */
+    fold_8bit_power_range(data, 0, nsamp, phase, dphase, raw_signed, 1, f);
+
+    return(0);
+}
+
+int fold_8bit_power_valid(const struct polyco *pc, int imjd, double fmjd,
+        const char *data, int nsamp, double tsamp, int raw_signed,
+        const struct guppi_databuf_valid *valid, struct foldbuf *f) {
+
+    /* No map was filled in for this block, so fall back on
+     * checking the data itself for zero-filled samples.
+     */
+    if (valid->npkt<=0)
+        return(fold_8bit_power(pc, imjd, fmjd, data, nsamp, tsamp, 
+                    raw_signed, f));
+
+    double phase, dphase, ph;
+    if (fold_phase(pc, imjd, fmjd, nsamp, tsamp, &phase, &dphase)) 
+        return(-1);
+
+    /* Fold each run of valid packets, skipping over the gaps */
+    const size_t bytes_per_samp = f->nchan*f->npol;
+    const size_t pkt_size = valid->pkt_size;
+    const int npkt = (nsamp*bytes_per_samp + pkt_size - 1) / pkt_size;
+    int ipkt=0, nrun, i0, i1;
+    while ((ipkt=guppi_databuf_valid_next(valid, ipkt, npkt, &nrun))>=0) {
+        i0 = (ipkt*pkt_size + bytes_per_samp - 1) / bytes_per_samp;
+        i1 = ((ipkt+nrun)*pkt_size) / bytes_per_samp;
+        if (i1>nsamp) i1 = nsamp;
+        if (i1>i0) {
+            ph = fmod(phase + i0*dphase, 1.0);
+            fold_8bit_power_range(data, i0, i1, ph, dphase, raw_signed, 
+                    0, f);
+        }
+        ipkt += nrun;
+    }
 
     return(0);
 }
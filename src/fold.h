@@ -1,6 +1,7 @@
 #ifndef _FOLD_H
 #define _FOLD_H
 #include "polyco.h"
+#include "guppi_databuf.h"
 
 struct foldbuf {
     int nbin;
@@ -29,6 +30,7 @@ struct fold_args {
     int nsamp;
     double tsamp;
     int raw_signed;
+    const struct guppi_databuf_valid *valid; /* NULL = check for zeros */
     struct foldbuf *fb;
 };
 
@@ -38,6 +40,14 @@ int fold_8bit_power(const struct polyco *pc, int imjd, double fmjd,
         const char *data, int nsamp, double tsamp, int raw_signed,
         struct foldbuf *f);
 
+/* Same as fold_8bit_power, but only samples lying entirely within
+ * valid packets are folded, according to the given validity map.
+ * An empty map (npkt==0) folds the whole block with the zero check.
+ */
+int fold_8bit_power_valid(const struct polyco *pc, int imjd, double fmjd,
+        const char *data, int nsamp, double tsamp, int raw_signed,
+        const struct guppi_databuf_valid *valid, struct foldbuf *f);
+
 int accumulate_folds(struct foldbuf *ftot, const struct foldbuf *f);
 
 #endif
@@ -314,6 +314,7 @@ int main(int argc, char *argv[]) {
         fargs[i].nsamp = pf.hdr.nsblk;
         fargs[i].tsamp = pf.hdr.dt;
         fargs[i].raw_signed=raw_signed;
+        fargs[i].valid = NULL;
         malloc_foldbuf(fargs[i].fb);
         clear_foldbuf(fargs[i].fb);
     }
@@ -20,12 +20,41 @@
 #include "guppi_params.h"
 #include "guppi_thread_main.h"
 
+void usage() {
+    fprintf(stderr,
+            "Usage: guppi_daq [options]\n"
+            "Options:\n"
+            "  -h, --help        This message\n"
+            "  -H, --huge        Use huge pages if creating the databuf\n"
+           );
+}
+
 /* Thread declarations */
 void *guppi_net_thread(void *args);
 void *guppi_psrfits_thread(void *args);
 
 int main(int argc, char *argv[]) {
 
+    static struct option long_opts[] = {
+        {"help",   0, NULL, 'h'},
+        {"huge",   0, NULL, 'H'},
+        {0,0,0,0}
+    };
+    int db_flags = 0;
+    int opt, opti;
+    while ((opt=getopt_long(argc,argv,"hH",long_opts,&opti))!=-1) {
+        switch (opt) {
+            case 'H':
+                db_flags |= GUPPI_DATABUF_HUGEPAGE;
+                break;
+            default:
+            case 'h':
+                usage();
+                exit(0);
+                break;
+        }
+    }
+
     /* thread args */
     struct guppi_thread_args net_args, disk_args;
     guppi_thread_args_init(&net_args);
@@ -44,7 +73,8 @@ int main(int argc, char *argv[]) {
     dbuf = guppi_databuf_attach(net_args.output_buffer);
     /* If attach fails, first try to create the databuf */
     if (dbuf==NULL) 
-        dbuf = guppi_databuf_create(24, 32*1024*1024, net_args.output_buffer);
+        dbuf = guppi_databuf_create(24, 32*1024*1024, net_args.output_buffer,
+                db_flags);
     /* If that also fails, exit */
     if (dbuf==NULL) {
         fprintf(stderr, "Error connecting to guppi_databuf\n");
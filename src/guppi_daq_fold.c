@@ -26,6 +26,10 @@ void usage() {
             "Usage: guppi_daq_fold [options] sender_hostname\n"
             "Options:\n"
             "  -h, --help        This message\n"
+            "  -n, --null        Discard folded data (no psrfits output)\n"
+            "  -m, --monitor     Also run a monitor thread on the raw data,\n"
+            "                    as an optional reader that never holds\n"
+            "                    up the net thread (needs futex databuf)\n"
            );
 }
 
@@ -40,15 +44,19 @@ int main(int argc, char *argv[]) {
     static struct option long_opts[] = {
         {"help",   0, NULL, 'h'},
         {"null",   0, NULL, 'n'},
+        {"monitor",0, NULL, 'm'},
         {0,0,0,0}
     };
-    int use_null_thread = 0;
+    int use_null_thread = 0, use_monitor = 0;
     int opt, opti;
-    while ((opt=getopt_long(argc,argv,"hn",long_opts,&opti))!=-1) {
+    while ((opt=getopt_long(argc,argv,"hnm",long_opts,&opti))!=-1) {
         switch (opt) {
             case 'n':
                 use_null_thread = 1;
                 break;
+            case 'm':
+                use_monitor = 1;
+                break;
             default:
             case 'h':
                 usage();
@@ -58,14 +66,16 @@ int main(int argc, char *argv[]) {
     }
 
     /* Data buffer ids */
-    struct guppi_thread_args net_args, fold_args, disk_args;
+    struct guppi_thread_args net_args, fold_args, disk_args, mon_args;
     guppi_thread_args_init(&net_args);
     guppi_thread_args_init(&fold_args);
     guppi_thread_args_init(&disk_args);
+    guppi_thread_args_init(&mon_args);
     net_args.output_buffer = 1;
     fold_args.input_buffer = net_args.output_buffer;
     fold_args.output_buffer = 2;
     disk_args.input_buffer = fold_args.output_buffer;
+    mon_args.input_buffer = net_args.output_buffer;
     //fold_args.priority = 10;
     //net_args.priority = -10;
 
@@ -85,6 +95,17 @@ int main(int argc, char *argv[]) {
     }
     guppi_databuf_clear(dbuf_net);
 
+    /* Fold and monitor threads share the net buffer */
+    if (use_monitor) {
+        fold_args.reader = guppi_databuf_add_reader(dbuf_net, 0);
+        mon_args.reader = guppi_databuf_add_reader(dbuf_net, 1);
+        if (fold_args.reader<0 || mon_args.reader<0) {
+            fprintf(stderr, "Error registering databuf readers "
+                    "(create it with check_guppi_databuf -c -f)\n");
+            exit(1);
+        }
+    }
+
     dbuf_fold = guppi_databuf_attach(fold_args.output_buffer);
     if (dbuf_fold==NULL) {
         fprintf(stderr, "Error connecting to guppi_databuf\n");
@@ -130,6 +151,17 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    /* Launch monitor thread */
+    pthread_t mon_thread_id=0;
+    if (use_monitor) {
+        rv = pthread_create(&mon_thread_id, NULL, guppi_null_thread,
+                (void *)&mon_args);
+        if (rv) { 
+            fprintf(stderr, "Error creating monitor thread.\n");
+            perror("pthread_create");
+            exit(1);
+        }
+    }
 
     /* Alt loop, wait for run=0 */
     while (run) {
@@ -150,10 +182,19 @@ int main(int argc, char *argv[]) {
     printf("Joined fold thread\n"); fflush(stdout);
     pthread_join(disk_thread_id,NULL);
     printf("Joined disk thread\n"); fflush(stdout);
+    if (use_monitor) {
+        pthread_cancel(mon_thread_id);
+        pthread_kill(mon_thread_id,SIGINT);
+        pthread_join(mon_thread_id,NULL);
+        printf("Joined monitor thread\n"); fflush(stdout);
+        guppi_databuf_remove_reader(dbuf_net, mon_args.reader);
+        guppi_databuf_remove_reader(dbuf_net, fold_args.reader);
+    }
 
     guppi_thread_args_destroy(&net_args);
     guppi_thread_args_destroy(&fold_args);
     guppi_thread_args_destroy(&disk_args);
+    guppi_thread_args_destroy(&mon_args);
 
     exit(0);
 }
@@ -26,6 +26,7 @@
 #include "guppi_params.h"
 
 #include "guppi_thread_main.h"
+#include "guppi_threads.h"
 
 #define GUPPI_DAQ_CONTROL "/tmp/guppi_daq_control"
 
@@ -116,6 +117,44 @@ void stop_threads(struct guppi_thread_args *args, pthread_t *ids,
     for (i=0; i<nthread; i++) ids[i] = 0;
 }
 
+/* Clear a databuf and lay it out as asked in the status buffer:
+ * <prefix>NBLK blocks of <prefix>BLKSZ bytes, with BLKSZ 0 or missing
+ * meaning as large as will fit.  The layout in use is written back.
+ * Only to be called between observations.  A new layout waits up to
+ * 5 s for readers to let go of their blocks, holding up the command
+ * loop meanwhile.  Returns GUPPI_OK or the clear/reconfigure error.
+ */
+int config_databuf(struct guppi_status *st, struct guppi_databuf *d,
+        const char *prefix) {
+    char key_nblk[9], key_blksz[9];
+    int nblk=0, blksz=0, have_nblk, rv;
+    sprintf(key_nblk, "%sNBLK", prefix);
+    sprintf(key_blksz, "%sBLKSZ", prefix);
+    guppi_status_lock_safe(st);
+    have_nblk = hgeti4(st->buf, key_nblk, &nblk);
+    hgeti4(st->buf, key_blksz, &blksz);
+    guppi_status_unlock_safe(st);
+
+    rv = guppi_databuf_clear(d);
+    if (rv!=GUPPI_OK) {
+        printf("  %s databuf not cleared\n", prefix);
+    } else if (have_nblk && nblk>0 && (nblk!=d->n_block 
+                || (blksz>0 && blksz!=d->block_size))) {
+        rv = guppi_databuf_reconfigure(d, nblk, blksz, 5);
+        if (rv==GUPPI_OK)
+            printf("  %s databuf now %d blocks of %zd bytes\n", prefix,
+                    d->n_block, d->block_size);
+        else
+            printf("  %s databuf not changed\n", prefix);
+    }
+
+    guppi_status_lock_safe(st);
+    hputi4(st->buf, key_nblk, d->n_block);
+    hputi4(st->buf, key_blksz, d->block_size);
+    guppi_status_unlock_safe(st);
+    return(rv);
+}
+
 int main(int argc, char *argv[]) {
 
     static struct option long_opts[] = {
@@ -169,6 +208,12 @@ int main(int argc, char *argv[]) {
     }
     guppi_databuf_clear(dbuf_fold);
 
+    /* Wake up on block fills too, to keep the buffer levels in
+     * the status buffer current.
+     */
+    int net_notify = guppi_databuf_notify_fd(dbuf_net);
+    int fold_notify = guppi_databuf_notify_fd(dbuf_fold);
+
     /* Thread setup */
 #define MAX_THREAD 8
     int i;
@@ -190,7 +235,7 @@ int main(int argc, char *argv[]) {
     signal(SIGTERM, srv_quit);
 
     /* Loop over recv'd commands, process them */
-    int cmd_wait=1;
+    int cmd_wait=1, config_ok=1;
     while (cmd_wait && srv_run) {
 
         // Check to see if threads have exited, if so, stop them
@@ -210,28 +255,46 @@ int main(int argc, char *argv[]) {
         if (ctmp!=NULL) { *ctmp = '\0'; } else { timestr[0]='\0'; }
         guppi_status_lock(&stat);
         hputs(stat.buf, "DAQPULSE", timestr);
-        hputs(stat.buf, "DAQSTATE", nthread_cur==0 ? "stopped" : "running");
+        hputs(stat.buf, "DAQSTATE", nthread_cur>0 ? "running" : 
+                config_ok ? "stopped" : "cfgerror");
         guppi_status_unlock(&stat);
 
         // Flush any status/error/etc for logfiles
         fflush(stdout);
         fflush(stderr);
 
-        // Wait for data on fifo
-        struct pollfd pfd;
-        pfd.fd = command_fifo;
-        pfd.events = POLLIN;
-        rv = poll(&pfd, 1, 1000);
+        // Wait for data on fifo, or databuf activity
+        struct pollfd pfd[3];
+        pfd[0].fd = command_fifo;
+        pfd[1].fd = net_notify;
+        pfd[2].fd = fold_notify;
+        for (i=0; i<3; i++) pfd[i].events = POLLIN;
+        rv = poll(pfd, 3, 1000);
         if (rv==0) { continue; }
         else if (rv<0) {
             if (errno!=EINTR) perror("poll");
             continue;
         }
 
+        // Update buffer levels
+        if ((pfd[1].revents | pfd[2].revents) & POLLIN) {
+            unsigned long long nevent;
+            if (pfd[1].revents & POLLIN) 
+                rv = read(net_notify, &nevent, sizeof(nevent));
+            if (pfd[2].revents & POLLIN) 
+                rv = read(fold_notify, &nevent, sizeof(nevent));
+            guppi_status_lock(&stat);
+            hputi4(stat.buf, "NETBUFFL", guppi_databuf_total_status(dbuf_net));
+            hputi4(stat.buf, "FLDBUFFL", 
+                    guppi_databuf_total_status(dbuf_fold));
+            guppi_status_unlock(&stat);
+        }
+        if (pfd[0].revents==0) { continue; }
+
         // If we got POLLHUP, it means the other side closed its
         // connection.  Close and reopen the FIFO to clear this
         // condition.  Is there a better/recommended way to do this?
-        if (pfd.revents==POLLHUP) { 
+        if (pfd[0].revents==POLLHUP) { 
             close(command_fifo);
             command_fifo = open(GUPPI_DAQ_CONTROL, O_RDONLY | O_NONBLOCK);
             if (command_fifo<0) {
@@ -288,13 +351,17 @@ int main(int argc, char *argv[]) {
                 }
                 printf("  obs_mode = %s\n", obs_mode);
 
-                // Clear out data bufs
-                guppi_databuf_clear(dbuf_net);
-                guppi_databuf_clear(dbuf_fold);
+                // Clear out data bufs, and change their layout if
+                // asked to
+                config_ok = config_databuf(&stat, dbuf_net, "NET")==GUPPI_OK;
+                config_ok &= 
+                    config_databuf(&stat, dbuf_fold, "FLD")==GUPPI_OK;
 
                 // Do it
                 run = 1;
-                if (strncasecmp(obs_mode, "SEARCH", 7)==0) {
+                if (!config_ok) {
+                    printf("  databufs not ready, not starting\n");
+                } else if (strncasecmp(obs_mode, "SEARCH", 7)==0) {
                     init_search_mode(args, &nthread_cur);
                     start_search_mode(args, thread_id);
                 } else if (strncasecmp(obs_mode, "FOLD", 5)==0) {
@@ -314,6 +381,18 @@ int main(int argc, char *argv[]) {
 
         } 
         
+        else if (strncasecmp(cmd,"CONFIG",MAX_CMD_LEN)==0) {
+            // Change databuf layouts now, between observations
+            printf("Configure databufs\n");
+            if (nthread_cur>0) {
+                printf("  observations running!\n");
+            } else {
+                config_ok = config_databuf(&stat, dbuf_net, "NET")==GUPPI_OK;
+                config_ok &= 
+                    config_databuf(&stat, dbuf_fold, "FLD")==GUPPI_OK;
+            }
+        }
+
         else if (strncasecmp(cmd,"STOP",MAX_CMD_LEN)==0) {
             // Stop observations
             printf("Stop observations\n");
@@ -331,8 +410,11 @@ int main(int argc, char *argv[]) {
     /* Stop any running threads */
     run = 0;
     stop_threads(args, thread_id, nthread_cur);
+    guppi_databuf_pool_release(0);
 
     if (command_fifo>0) close(command_fifo);
+    if (net_notify>=0) guppi_databuf_notify_close(net_notify);
+    if (fold_notify>=0) guppi_databuf_notify_close(fold_notify);
 
     guppi_status_lock(&stat);
     hputs(stat.buf, "DAQSTATE", "exiting");
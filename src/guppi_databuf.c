@@ -3,6 +3,7 @@
  * Routines for creating and accessing main data transfer
  * buffer in shared memory.
  */
+#define _GNU_SOURCE 1
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,27 +11,371 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/mempolicy.h>
+#include <linux/futex.h>
+#include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "fitshead.h"
 #include "guppi_status.h"
 #include "guppi_databuf.h"
 #include "guppi_error.h"
 
+/* Lock words of a GUPPI_DATABUF_FUTEX databuf */
+static struct guppi_databuf_lock *guppi_databuf_locks(
+        struct guppi_databuf *d) {
+    const size_t off = (sizeof(struct guppi_databuf) + 63) / 64 * 64;
+    return((struct guppi_databuf_lock *)((char *)d + off));
+}
+
+/* Physical block table, after the lock words */
+static int *guppi_databuf_phys(struct guppi_databuf *d) {
+    size_t off = (sizeof(struct guppi_databuf) + 63) / 64 * 64;
+    if (d->flags & GUPPI_DATABUF_FUTEX)
+        off += d->n_block * sizeof(struct guppi_databuf_lock);
+    return((int *)((char *)d + off));
+}
+
+/* This process's attachments to databufs holding pool blocks */
+#define GUPPI_DATABUF_MAX_POOL 16
+static struct guppi_databuf *guppi_pool_map[GUPPI_DATABUF_MAX_POOL];
+static pthread_mutex_t guppi_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct guppi_databuf *guppi_databuf_pool(int databuf_id) {
+    int i;
+    struct guppi_databuf *d = NULL;
+    pthread_mutex_lock(&guppi_pool_mutex);
+    for (i=0; i<GUPPI_DATABUF_MAX_POOL && guppi_pool_map[i]!=NULL; i++)
+        if (guppi_pool_map[i]->databuf_id==databuf_id) {
+            d = guppi_pool_map[i];
+            break;
+        }
+    if (d==NULL && i<GUPPI_DATABUF_MAX_POOL) {
+        d = guppi_databuf_attach(databuf_id);
+        guppi_pool_map[i] = d;
+    }
+    pthread_mutex_unlock(&guppi_pool_mutex);
+    return(d);
+}
+
+int guppi_databuf_pool_release(int databuf_id) {
+    int i, n=0, rv=GUPPI_OK;
+    pthread_mutex_lock(&guppi_pool_mutex);
+    for (i=0; i<GUPPI_DATABUF_MAX_POOL && guppi_pool_map[i]!=NULL; i++) {
+        if (databuf_id==0 || guppi_pool_map[i]->databuf_id==databuf_id) {
+            if (guppi_databuf_detach(guppi_pool_map[i])!=GUPPI_OK)
+                rv = GUPPI_ERR_SYS;
+        } else 
+            guppi_pool_map[n++] = guppi_pool_map[i];
+    }
+    /* Keep the list packed, lookups stop at the first gap */
+    for (i=n; i<GUPPI_DATABUF_MAX_POOL; i++) guppi_pool_map[i] = NULL;
+    pthread_mutex_unlock(&guppi_pool_mutex);
+    return(rv);
+}
+
+static int guppi_futex(int *addr, int op, int val, 
+        const struct timespec *timeout) {
+    return(syscall(SYS_futex, addr, op, val, timeout, NULL, 0));
+}
+
+/* Wake anyone waiting on a block */
+static void guppi_databuf_lock_wake(struct guppi_databuf_lock *l) {
+    if (__atomic_load_n(&l->waiters, __ATOMIC_SEQ_CST))
+        guppi_futex(&l->state, FUTEX_WAKE, 0x7fffffff, NULL);
+}
+
+/* Set a block's state, waking anyone waiting on it */
+static void guppi_databuf_lock_set(struct guppi_databuf_lock *l, int state) {
+    __atomic_store_n(&l->state, state, __ATOMIC_SEQ_CST);
+    guppi_databuf_lock_wake(l);
+}
+
+/* Wait up to 250ms for any of the mask bits of a block's state to
+ * be set (set=1), or for all of them to be clear (set=0).
+ */
+static int guppi_databuf_lock_wait(struct guppi_databuf_lock *l, 
+        unsigned mask, int set) {
+    struct timespec timeout;
+    int rv, cur;
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = 250000000;
+    while (((cur=__atomic_load_n(&l->state, __ATOMIC_SEQ_CST)) 
+                & mask ? 1 : 0) != set) {
+        __atomic_add_fetch(&l->waiters, 1, __ATOMIC_SEQ_CST);
+        rv = guppi_futex(&l->state, FUTEX_WAIT, cur, &timeout);
+        __atomic_sub_fetch(&l->waiters, 1, __ATOMIC_SEQ_CST);
+        if (rv==-1) {
+            if (errno==ETIMEDOUT) return(GUPPI_TIMEOUT);
+            if (errno==EINTR) return(GUPPI_ERR_SYS);
+            if (errno!=EAGAIN) {
+                guppi_error("guppi_databuf_lock_wait", "futex error");
+                perror("futex");
+                return(GUPPI_ERR_SYS);
+            }
+        }
+    }
+    return(0);
+}
+
+/* Default huge page size from /proc/meminfo, 0 if unknown */
+static size_t guppi_hugepage_size() {
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f==NULL) return(0);
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f)!=NULL) 
+        if (sscanf(line, "Hugepagesize: %zu kB", &kb)==1) break;
+    fclose(f);
+    return(kb*1024);
+}
+
+/* Let notify threads know a block changed state */
+static void guppi_databuf_event(struct guppi_databuf *d) {
+    __atomic_add_fetch(&d->event_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&d->event_waiters, __ATOMIC_SEQ_CST))
+        guppi_futex(&d->event_seq, FUTEX_WAKE, 0x7fffffff, NULL);
+}
+
+/* Notification fds, each with a thread passing databuf events on */
+#define GUPPI_DATABUF_MAX_NOTIFY 16
+struct guppi_databuf_notify {
+    struct guppi_databuf *d;
+    int fd;
+    volatile int run;
+    pthread_t thread;
+};
+static struct guppi_databuf_notify guppi_notify[GUPPI_DATABUF_MAX_NOTIFY];
+static pthread_mutex_t guppi_notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *guppi_databuf_notify_thread(void *_n) {
+    struct guppi_databuf_notify *n = (struct guppi_databuf_notify *)_n;
+    struct guppi_databuf *d = n->d;
+    const unsigned long long one = 1;
+    struct timespec timeout;
+    int seq = __atomic_load_n(&d->event_seq, __ATOMIC_SEQ_CST), cur;
+    /* The timeout only bounds how long notify_close takes */
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = 250000000;
+    while (n->run) {
+        __atomic_add_fetch(&d->event_waiters, 1, __ATOMIC_SEQ_CST);
+        guppi_futex(&d->event_seq, FUTEX_WAIT, seq, &timeout);
+        __atomic_sub_fetch(&d->event_waiters, 1, __ATOMIC_SEQ_CST);
+        cur = __atomic_load_n(&d->event_seq, __ATOMIC_SEQ_CST);
+        if (cur!=seq) {
+            seq = cur;
+            if (write(n->fd, &one, sizeof(one))<0 && errno!=EAGAIN) break;
+        }
+    }
+    return(NULL);
+}
+
+int guppi_databuf_notify_fd(struct guppi_databuf *d) {
+    int i;
+    pthread_mutex_lock(&guppi_notify_mutex);
+    for (i=0; i<GUPPI_DATABUF_MAX_NOTIFY; i++) 
+        if (guppi_notify[i].d==NULL) break;
+    if (i==GUPPI_DATABUF_MAX_NOTIFY) {
+        pthread_mutex_unlock(&guppi_notify_mutex);
+        guppi_error("guppi_databuf_notify_fd", "Too many notify fds");
+        return(-1);
+    }
+    struct guppi_databuf_notify *n = &guppi_notify[i];
+    n->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (n->fd<0) {
+        pthread_mutex_unlock(&guppi_notify_mutex);
+        guppi_error("guppi_databuf_notify_fd", "eventfd error");
+        return(-1);
+    }
+    n->d = d;
+    n->run = 1;
+    if (pthread_create(&n->thread, NULL, guppi_databuf_notify_thread, n)) {
+        guppi_error("guppi_databuf_notify_fd", "pthread_create error");
+        close(n->fd);
+        n->d = NULL;
+        pthread_mutex_unlock(&guppi_notify_mutex);
+        return(-1);
+    }
+    pthread_mutex_unlock(&guppi_notify_mutex);
+    return(n->fd);
+}
+
+void guppi_databuf_notify_close(int fd) {
+    int i;
+    pthread_mutex_lock(&guppi_notify_mutex);
+    for (i=0; i<GUPPI_DATABUF_MAX_NOTIFY; i++) {
+        struct guppi_databuf_notify *n = &guppi_notify[i];
+        if (n->d==NULL || n->fd!=fd) continue;
+        n->run = 0;
+        pthread_join(n->thread, NULL);
+        close(n->fd);
+        n->d = NULL;
+    }
+    pthread_mutex_unlock(&guppi_notify_mutex);
+}
+
+/* Block timing stages */
+#define GUPPI_DATABUF_T_START 0
+#define GUPPI_DATABUF_T_FILLED 1
+#define GUPPI_DATABUF_T_READ 2
+#define GUPPI_DATABUF_T_FREE 3
+
+static void guppi_databuf_hist_add(struct guppi_databuf_hist *h, 
+        long long ns) {
+    int i;
+    long long us = ns / 1000;
+    int b = us>0 ? 64 - __builtin_clzll(us) : 0;
+    if (b>=GUPPI_DATABUF_HIST_NBIN) b = GUPPI_DATABUF_HIST_NBIN - 1;
+    h->bin[b]++;
+    if (++h->n >= GUPPI_DATABUF_HIST_MAX) {
+        h->n = 0;
+        for (i=0; i<GUPPI_DATABUF_HIST_NBIN; i++) {
+            h->bin[i] /= 2;
+            h->n += h->bin[i];
+        }
+    }
+}
+
+/* Fill generation changes, by the producer only */
+static void guppi_databuf_gen_start(struct guppi_databuf *d, int block_id) {
+    struct guppi_databuf_info *info = guppi_databuf_info(d, block_id);
+    const unsigned long long gen = 
+        __atomic_load_n(&info->gen, __ATOMIC_RELAXED);
+    if (!(gen & 1)) __atomic_store_n(&info->gen, gen + 1, __ATOMIC_SEQ_CST);
+}
+
+static void guppi_databuf_gen_filled(struct guppi_databuf *d, 
+        int block_id) {
+    struct guppi_databuf_info *info = guppi_databuf_info(d, block_id);
+    const unsigned long long gen = 
+        __atomic_load_n(&info->gen, __ATOMIC_RELAXED);
+    __atomic_store_n(&info->gen, (gen | 1) + 1, __ATOMIC_RELEASE);
+}
+
+/* Note the time a block reached a stage.  Updates from different
+ * processes can race; the odd lost sample doesn't matter here.
+ * A block counts as free once its required readers are done, and
+ * each stage is only noted once per fill cycle.
+ */
+static void guppi_databuf_mark(struct guppi_databuf *d, int block_id,
+        int stage) {
+    struct guppi_databuf_info *info = guppi_databuf_info(d, block_id);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const long long now = (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+    switch (stage) {
+        case GUPPI_DATABUF_T_START:
+            info->t_start = now;
+            break;
+        case GUPPI_DATABUF_T_FILLED:
+            if (info->t_start>info->t_filled)
+                guppi_databuf_hist_add(&d->hist[GUPPI_DATABUF_HIST_FILL],
+                        now - info->t_start);
+            info->t_filled = now;
+            d->occ[d->nocc % GUPPI_DATABUF_OCC_LEN] = 
+                guppi_databuf_total_status(d) + 1;
+            d->nocc++;
+            break;
+        case GUPPI_DATABUF_T_READ:
+            if (info->t_read>info->t_filled) break;
+            info->t_read = now;
+            guppi_databuf_hist_add(&d->hist[GUPPI_DATABUF_HIST_WAIT],
+                    now - info->t_filled);
+            break;
+        case GUPPI_DATABUF_T_FREE:
+            if (info->t_free>info->t_filled) break;
+            if (info->t_read>info->t_filled)
+                guppi_databuf_hist_add(&d->hist[GUPPI_DATABUF_HIST_PROC],
+                        now - info->t_read);
+            info->t_free = now;
+            break;
+    }
+}
+
+double guppi_databuf_hist_pct(const struct guppi_databuf_hist *h, 
+        double frac) {
+    unsigned long long tot=0, sum=0;
+    int i;
+    for (i=0; i<GUPPI_DATABUF_HIST_NBIN; i++) tot += h->bin[i];
+    if (tot==0) return(0.0);
+    for (i=0; i<GUPPI_DATABUF_HIST_NBIN; i++) {
+        sum += h->bin[i];
+        if (sum >= frac*tot) break;
+    }
+    return((double)(1ULL<<i));
+}
+
+/* Segment size needed for a layout, and the sizes of its parts */
+static size_t guppi_databuf_calc_size(int n_block, size_t block_size,
+        int flags, size_t *struct_size, size_t *valid_size) {
+    const size_t header_size = GUPPI_STATUS_SIZE;
+    size_t ssize = (sizeof(struct guppi_databuf) + 63) / 64 * 64;
+    if (flags & GUPPI_DATABUF_FUTEX)
+        ssize += n_block * sizeof(struct guppi_databuf_lock);
+    ssize += n_block * sizeof(int);
+    ssize = 8192 * (1 + ssize/8192); /* round up */
+    const size_t info_size = (sizeof(struct guppi_databuf_info) + 63) / 64 * 64;
+    const size_t vsize = sizeof(struct guppi_databuf_valid)
+        + sizeof(unsigned long long) 
+        * (block_size / GUPPI_DATABUF_MIN_PKT_SIZE / 64 + 1);
+    if (struct_size!=NULL) *struct_size = ssize;
+    if (valid_size!=NULL) *valid_size = vsize;
+    return((block_size+header_size+info_size+vsize) * n_block + ssize);
+}
+
+/* Empty headers, and each slot using its own block */
+static void guppi_databuf_init_blocks(struct guppi_databuf *d) {
+    int i;
+    char end_key[81];
+    memset(end_key, ' ', 80);
+    strncpy(end_key, "END", 3);
+    end_key[80]='\0';
+    for (i=0; i<d->n_block; i++) { 
+        memcpy(guppi_databuf_header(d,i), end_key, 80); 
+        guppi_databuf_phys(d)[i] = GUPPI_DATABUF_PHYS(d->databuf_id, i);
+    }
+}
+
 struct guppi_databuf *guppi_databuf_create(int n_block, size_t block_size,
-        int databuf_id) {
+        int databuf_id, int flags) {
 
     /* Calc databuf size */
     const size_t header_size = GUPPI_STATUS_SIZE;
-    size_t struct_size = sizeof(struct guppi_databuf);
-    struct_size = 8192 * (1 + struct_size/8192); /* round up */
-    size_t databuf_size = (block_size+header_size) * n_block + struct_size;
+    const size_t info_size = (sizeof(struct guppi_databuf_info) + 63) / 64 * 64;
+    size_t struct_size, valid_size;
+    size_t databuf_size = guppi_databuf_calc_size(n_block, block_size, flags,
+            &struct_size, &valid_size);
 
-    /* Get shared memory block, error if it already exists */
-    int shmid;
-    shmid = shmget(GUPPI_DATABUF_KEY + databuf_id - 1, 
-            databuf_size, 0666 | IPC_CREAT | IPC_EXCL);
+    /* Get shared memory block, error if it already exists.  Try
+     * huge pages first if asked, falling back to normal pages.
+     */
+    int shmid=-1;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    if (flags & GUPPI_DATABUF_HUGEPAGE) {
+        const size_t huge = guppi_hugepage_size();
+        errno = 0;
+        if (huge) {
+            const size_t huge_size = (databuf_size + huge - 1) / huge * huge;
+            shmid = shmget(GUPPI_DATABUF_KEY + databuf_id - 1, huge_size,
+                    0666 | IPC_CREAT | IPC_EXCL | SHM_HUGETLB);
+            if (shmid!=-1) {
+                databuf_size = huge_size;
+                page_size = huge;
+            }
+        }
+        if (shmid==-1 && errno!=EEXIST) {
+            guppi_warn("guppi_databuf_create", 
+                    "Huge pages not available, using normal pages.");
+            flags &= ~GUPPI_DATABUF_HUGEPAGE;
+        }
+    }
+    if (shmid==-1 && !(flags & GUPPI_DATABUF_HUGEPAGE))
+        shmid = shmget(GUPPI_DATABUF_KEY + databuf_id - 1, 
+                databuf_size, 0666 | IPC_CREAT | IPC_EXCL);
     if (shmid==-1) {
         guppi_error("guppi_databuf_create", "shmget error");
         return(NULL);
@@ -55,21 +400,22 @@ struct guppi_databuf *guppi_databuf_create(int n_block, size_t block_size,
     memset(d, 0, databuf_size);
 
     /* Fill params into databuf */
-    int i;
-    char end_key[81];
-    memset(end_key, ' ', 80);
-    strncpy(end_key, "END", 3);
-    end_key[80]='\0';
     d->shmid = shmid;
     d->semid = 0;
     d->n_block = n_block;
     d->struct_size = struct_size;
     d->block_size = block_size;
     d->header_size = header_size;
+    d->info_size = info_size;
+    d->valid_size = valid_size;
+    d->flags = flags;
+    d->page_size = page_size;
+    d->databuf_id = databuf_id;
     sprintf(d->data_type, "unknown");
-    for (i=0; i<n_block; i++) { 
-        memcpy(guppi_databuf_header(d,i), end_key, 80); 
-    }
+    guppi_databuf_init_blocks(d);
+
+    /* Futex locks start out free (zeroed above) */
+    if (flags & GUPPI_DATABUF_FUTEX) return(d);
 
     /* Get semaphores set up */
     d->semid = semget(GUPPI_DATABUF_KEY + databuf_id - 1, 
@@ -98,21 +444,151 @@ int guppi_databuf_detach(struct guppi_databuf *d) {
     return(GUPPI_OK);
 }
 
-void guppi_databuf_clear(struct guppi_databuf *d) {
+int guppi_databuf_set_node(struct guppi_databuf *d, int node) {
+    struct shmid_ds ds;
+    if (shmctl(d->shmid, IPC_STAT, &ds)<0) {
+        guppi_error("guppi_databuf_set_node", "shmctl error");
+        return(GUPPI_ERR_SYS);
+    }
+    unsigned long mask[16];
+    if (node<0 || node >= 8*sizeof(mask)) return(GUPPI_ERR_PARAM);
+    memset(mask, 0, sizeof(mask));
+    mask[node/(8*sizeof(long))] |= 1UL << (node%(8*sizeof(long)));
+    const size_t page = d->page_size ? d->page_size : sysconf(_SC_PAGESIZE);
+    size_t len = (ds.shm_segsz + page - 1) / page * page;
+    if (syscall(SYS_mbind, d, len, MPOL_PREFERRED, mask, 8*sizeof(mask),
+                MPOL_MF_MOVE)<0) {
+        guppi_warn("guppi_databuf_set_node", "mbind error");
+        return(GUPPI_ERR_SYS);
+    }
+    return(GUPPI_OK);
+}
+
+int guppi_databuf_reconfigure(struct guppi_databuf *d, int n_block, 
+        size_t block_size, int timeout) {
+    int i;
+
+    if (n_block<1 || n_block>0xffff) {
+        guppi_error("guppi_databuf_reconfigure", "Bad number of blocks");
+        return(GUPPI_ERR_PARAM);
+    }
+
+    /* The new layout has to fit in the existing segment */
+    struct shmid_ds ds;
+    if (shmctl(d->shmid, IPC_STAT, &ds)<0) {
+        guppi_error("guppi_databuf_reconfigure", "shmctl error");
+        return(GUPPI_ERR_SYS);
+    }
+    const size_t page = d->page_size ? d->page_size : sysconf(_SC_PAGESIZE);
+    if (block_size==0) {
+        const size_t fixed = guppi_databuf_calc_size(n_block, 0, d->flags,
+                NULL, NULL);
+        if (fixed < ds.shm_segsz)
+            block_size = (ds.shm_segsz - fixed) / n_block / page * page;
+        while (block_size>0 && guppi_databuf_calc_size(n_block, block_size, 
+                    d->flags, NULL, NULL) > ds.shm_segsz)
+            block_size -= page;
+    }
+    size_t struct_size, valid_size;
+    if (block_size==0 || guppi_databuf_calc_size(n_block, block_size, 
+                d->flags, &struct_size, &valid_size) > ds.shm_segsz) {
+        guppi_error("guppi_databuf_reconfigure", 
+                "Layout does not fit in databuf, it must be recreated");
+        return(GUPPI_ERR_PARAM);
+    }
+
+    /* Blocks lent to other databufs would be lost */
+    for (i=0; i<d->n_block; i++) {
+        if (guppi_databuf_phys(d)[i]!=GUPPI_DATABUF_PHYS(d->databuf_id, i)) {
+            guppi_error("guppi_databuf_reconfigure", 
+                    "Blocks are shared with another databuf");
+            return(GUPPI_ERR_PARAM);
+        }
+    }
+
+    /* Wait for every block to be let go of, optional readers too */
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = 10000000;
+    int nwait = 100*timeout;
+    for (i=0; i<d->n_block; i++) {
+        while (guppi_databuf_block_status(d, i)!=0) {
+            if (nwait--<=0) {
+                guppi_error("guppi_databuf_reconfigure", 
+                        "Timed out waiting for blocks to be freed");
+                return(GUPPI_TIMEOUT);
+            }
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    /* Semaphore sets can't be resized, so replace it */
+    if (!(d->flags & GUPPI_DATABUF_FUTEX) && n_block!=d->n_block) {
+        semctl(d->semid, 0, IPC_RMID);
+        d->semid = semget(GUPPI_DATABUF_KEY + d->databuf_id - 1, 
+                n_block, 0666 | IPC_CREAT);
+        if (d->semid==-1) {
+            guppi_error("guppi_databuf_reconfigure", "semget error");
+            return(GUPPI_ERR_SYS);
+        }
+        union semun arg;
+        arg.array = (unsigned short *)malloc(sizeof(unsigned short)*n_block);
+        memset(arg.array, 0, sizeof(unsigned short)*n_block);
+        semctl(d->semid, 0, SETALL, arg);
+        free(arg.array);
+    }
+
+    /* layout_seq is odd while the new layout is written */
+    __atomic_add_fetch(&d->layout_seq, 1, __ATOMIC_SEQ_CST);
+    d->n_block = n_block;
+    d->struct_size = struct_size;
+    d->block_size = block_size;
+    d->valid_size = valid_size;
+    const size_t start = (sizeof(struct guppi_databuf) + 63) / 64 * 64;
+    memset((char *)d + start, 0, struct_size - start
+            + n_block*(d->header_size + d->info_size + valid_size));
+    guppi_databuf_init_blocks(d);
+    memset(d->hist, 0, sizeof(d->hist));
+    memset(d->occ, 0, sizeof(d->occ));
+    d->nocc = 0;
+    __atomic_add_fetch(&d->layout_seq, 1, __ATOMIC_SEQ_CST);
+    guppi_databuf_event(d);
+
+    return(GUPPI_OK);
+}
+
+int guppi_databuf_clear(struct guppi_databuf *d) {
+    int i, rv=GUPPI_OK;
 
     /* Zero out semaphores */
-    union semun arg;
-    arg.array = (unsigned short *)malloc(sizeof(unsigned short)*d->n_block);
-    memset(arg.array, 0, sizeof(unsigned short)*d->n_block);
-    semctl(d->semid, 0, SETALL, arg);
-    free(arg.array);
+    if (d->flags & GUPPI_DATABUF_FUTEX) {
+        for (i=0; i<d->n_block; i++)
+            guppi_databuf_lock_set(&guppi_databuf_locks(d)[i], 0);
+    } else {
+        union semun arg;
+        arg.array = (unsigned short *)malloc(sizeof(unsigned short)*d->n_block);
+        memset(arg.array, 0, sizeof(unsigned short)*d->n_block);
+        if (semctl(d->semid, 0, SETALL, arg)==-1) {
+            guppi_error("guppi_databuf_clear", "semctl error");
+            rv = GUPPI_ERR_SYS;
+        }
+        free(arg.array);
+    }
+
+    /* Reset timing stats */
+    memset(d->hist, 0, sizeof(d->hist));
+    memset(d->occ, 0, sizeof(d->occ));
+    d->nocc = 0;
 
     /* Clear all headers */
-    int i;
     for (i=0; i<d->n_block; i++) {
         guppi_fitsbuf_clear(guppi_databuf_header(d, i));
+        memset(guppi_databuf_info(d, i), 0, d->info_size);
+        if (d->valid_size) 
+            memset(guppi_databuf_valid(d, i), 0, d->valid_size);
     }
 
+    return(rv);
 }
 
 void guppi_fitsbuf_clear(char *buf) {
@@ -125,13 +601,251 @@ void guppi_fitsbuf_clear(char *buf) {
     strncpy(buf, "END", 3);
 }
 
+size_t guppi_fitsbuf_len(const char *buf) {
+    const char *end = ksearch((char *)buf, "END");
+    if (end==NULL) return(0);
+    return(end - buf + 80);
+}
+
+/* Keywords the threads update while running to report progress.
+ * They aren't observation parameters, so changes to them don't count
+ * as a header change.  A name also matches itself followed by digits
+ * (per-receiver and per-stream counters).
+ */
+static const char *guppi_fitsbuf_monitor[] = {
+    "NETSTAT", "DISKSTAT", "FOLDSTAT", "NULLSTAT", "CURBLOCK", "CURFOLD",
+    "DAQPULSE", "DAQSTATE", "NETBUFFL", "FLDBUFFL",
+    "DROPAVG", "DROPTOT", "DROPBLK", "KDROPBLK", "KDROPTOT",
+    "NETPPSC", "NETMISPR", "NETLATE", "NETRXQ", "NETCPU", "NETWAKE",
+    "NETTFITN", "NETPKTDT", "NETTRES", "NETTJIT", "NETTJMAX", "NETTBIN",
+    "NETCLKER", "RPLNPKT", "RPLNLOSS", "RPLNREOR", "RPLDONE",
+    "RXPKT", "RXLATE", "RXBOG", "RXKDR",
+    "STRPKT", "STRDBLK", "STRDTOT", "STRLATE", "STRBOG", "STRKDR",
+    NULL
+};
+
+int guppi_fitsbuf_monitor_key(const char *card) {
+    int i, n, j;
+    for (i=0; guppi_fitsbuf_monitor[i]!=NULL; i++) {
+        n = strlen(guppi_fitsbuf_monitor[i]);
+        if (strncmp(card, guppi_fitsbuf_monitor[i], n)) continue;
+        for (j=n; j<8 && card[j]>='0' && card[j]<='9'; j++);
+        if (j==8 || card[j]==' ' || card[j]=='=') return(1);
+    }
+    return(0);
+}
+
+int guppi_fitsbuf_update(char *dst, const char *src) {
+    const size_t len = guppi_fitsbuf_len(src);
+    size_t off;
+    int changed=0;
+    if (len==0) return(0);
+    if (len!=guppi_fitsbuf_len(dst)) changed = 1;
+    for (off=0; off<len && !changed; off+=80) {
+        if (memcmp(dst+off, src+off, 80)==0) continue;
+        if (!guppi_fitsbuf_monitor_key(src+off) 
+                || strncmp(dst+off, src+off, 8)) 
+            changed = 1;
+    }
+    memcpy(dst, src, len);
+    return(changed);
+}
+
 char *guppi_databuf_header(struct guppi_databuf *d, int block_id) {
     return((char *)d + d->struct_size + block_id*d->header_size);
 }
 
 char *guppi_databuf_data(struct guppi_databuf *d, int block_id) {
-    return((char *)d + d->struct_size + d->n_block*d->header_size
-            + block_id*d->block_size);
+    const int phys = guppi_databuf_phys(d)[block_id];
+    if (phys>>16 != d->databuf_id) {
+        d = guppi_databuf_pool(phys>>16);
+        if (d==NULL) return(NULL);
+    }
+    return((char *)d + d->struct_size 
+            + d->n_block*(d->header_size + d->info_size + d->valid_size)
+            + (phys & 0xffff)*d->block_size);
+}
+
+int guppi_databuf_forward(struct guppi_databuf *src, int src_blk,
+        struct guppi_databuf *dst, int dst_blk) {
+    if (src->block_size!=dst->block_size) {
+        guppi_error("guppi_databuf_forward", "Block sizes differ");
+        return(GUPPI_ERR_PARAM);
+    }
+
+    /* Header, info and validity map belong to the slot, so copy */
+    struct guppi_databuf_info *si = guppi_databuf_info(src, src_blk);
+    struct guppi_databuf_info *di = guppi_databuf_info(dst, dst_blk);
+    guppi_databuf_header_copy(dst, dst_blk, 
+            guppi_databuf_header(src, src_blk), 
+            si->hdr_seq==0 || si->hdr_seq!=dst->hdr_src_seq);
+    dst->hdr_src_seq = si->hdr_seq;
+    di->pktidx = si->pktidx;
+    di->pktsize = si->pktsize;
+    di->npkt = si->npkt;
+    di->ndrop = si->ndrop;
+    di->rx_time = si->rx_time;
+    struct guppi_databuf_valid *sv = guppi_databuf_valid(src, src_blk);
+    struct guppi_databuf_valid *dv = guppi_databuf_valid(dst, dst_blk);
+    if (sv!=NULL && dv!=NULL)
+        memcpy(dv, sv, src->valid_size < dst->valid_size ? 
+                src->valid_size : dst->valid_size);
+
+    /* Swap the data blocks */
+    int *sp = &guppi_databuf_phys(src)[src_blk];
+    int *dp = &guppi_databuf_phys(dst)[dst_blk];
+    const int tmp = *dp;
+    *dp = *sp;
+    *sp = tmp;
+    return(GUPPI_OK);
+}
+
+struct guppi_databuf_info *guppi_databuf_info(struct guppi_databuf *d,
+        int block_id) {
+    return((struct guppi_databuf_info *)((char *)d + d->struct_size
+                + d->n_block*d->header_size + block_id*d->info_size));
+}
+
+int guppi_databuf_header_copy(struct guppi_databuf *d, int block_id,
+        const char *hdr, int changed) {
+    struct guppi_databuf_info *info = guppi_databuf_info(d, block_id);
+    if (changed || d->hdr_seq==0) d->hdr_seq++;
+    if (info->hdr_seq==d->hdr_seq) return(0);
+    char *out = guppi_databuf_header(d, block_id);
+    size_t len = guppi_fitsbuf_len(hdr);
+    if (len==0) {
+        /* No telling how long the text is, so copy none of it */
+        guppi_warn("guppi_databuf_header_copy", "Header has no END");
+        guppi_fitsbuf_clear(out);
+        info->hdr_seq = 0;
+        return(0);
+    }
+    if (len > d->header_size) {
+        /* Keep what fits, ending with END */
+        len = d->header_size / 80 * 80;
+        memcpy(out, hdr, len - 80);
+        memset(out + len - 80, ' ', 80);
+        memcpy(out + len - 80, "END", 3);
+    } else 
+        memcpy(out, hdr, len);
+    info->hdr_seq = d->hdr_seq;
+    return(1);
+}
+
+struct guppi_databuf_valid *guppi_databuf_valid(struct guppi_databuf *d, 
+        int block_id) {
+    if (d->valid_size==0) return(NULL);
+    return((struct guppi_databuf_valid *)((char *)d + d->struct_size 
+                + d->n_block*(d->header_size + d->info_size) 
+                + block_id*d->valid_size));
+}
+
+int guppi_databuf_valid_max(struct guppi_databuf *d) {
+    if (d->valid_size==0) return(0);
+    return(64 * ((d->valid_size - sizeof(struct guppi_databuf_valid))
+                / sizeof(unsigned long long)));
+}
+
+void guppi_databuf_valid_reset(struct guppi_databuf_valid *v, int npkt, 
+        int pkt_size) {
+    v->npkt = npkt;
+    v->pkt_size = pkt_size;
+    v->nvalid = 0;
+    v->zeroed = 0;
+    memset(v->bits, 0, sizeof(unsigned long long) * (npkt/64 + 1));
+}
+
+int guppi_databuf_valid_next(const struct guppi_databuf_valid *v, 
+        int ipkt, int npkt, int *nrun) {
+
+    /* No map, or nothing missing */
+    if (v==NULL || v->npkt==0 || v->nvalid==v->npkt) {
+        if (ipkt>=npkt) return(-1);
+        *nrun = npkt - ipkt;
+        return(ipkt);
+    }
+    if (npkt > v->npkt) npkt = v->npkt;
+
+    /* Skip to first set bit, then to the next clear bit, a
+     * word at a time.
+     */
+    int i = ipkt, start;
+    unsigned long long w;
+    while (i<npkt) {
+        w = v->bits[i/64] >> (i%64);
+        if (w) { i += __builtin_ctzll(w); break; }
+        i += 64 - i%64;
+    }
+    if (i>=npkt) return(-1);
+    start = i;
+    while (i<npkt) {
+        w = ~v->bits[i/64] >> (i%64);
+        if (w) { i += __builtin_ctzll(w); break; }
+        i += 64 - i%64;
+    }
+    if (i>npkt) i = npkt;
+    *nrun = i - start;
+    return(start);
+}
+
+void guppi_databuf_valid_zero(struct guppi_databuf *d, int block_id) {
+    struct guppi_databuf_valid *v = guppi_databuf_valid(d, block_id);
+    if (v==NULL || v->npkt==0 || v->zeroed) return;
+    char *data = guppi_databuf_data(d, block_id);
+    int i=0, start, nrun=0;
+    while (i<v->npkt) {
+        start = guppi_databuf_valid_next(v, i, v->npkt, &nrun);
+        if (start<0) start = v->npkt;
+        if (start>i)
+            memset(data + (size_t)i*v->pkt_size, 0, 
+                    (size_t)(start-i)*v->pkt_size);
+        if (start>=v->npkt) break;
+        i = start + nrun;
+    }
+    v->zeroed = 1;
+}
+
+int guppi_databuf_sole_reader(struct guppi_databuf *d, int block_id, 
+        int reader) {
+    if (!(d->flags & GUPPI_DATABUF_FUTEX)) return(1);
+    const unsigned state = __atomic_load_n(
+            &guppi_databuf_locks(d)[block_id].state, __ATOMIC_SEQ_CST);
+    return((state & ~(1U<<reader))==0);
+}
+
+char *guppi_databuf_data_zeroed(struct guppi_databuf *d, int block_id,
+        int reader, char **copy) {
+    char *data = guppi_databuf_data(d, block_id);
+    struct guppi_databuf_valid *v = guppi_databuf_valid(d, block_id);
+    if (data==NULL || v==NULL || v->npkt==0 || v->zeroed) return(data);
+    if (guppi_databuf_sole_reader(d, block_id, reader)) {
+        guppi_databuf_valid_zero(d, block_id);
+        return(data);
+    }
+    /* Others still read the block, zero-fill a copy of it */
+    char *out = (char *)realloc(*copy, d->block_size);
+    if (out==NULL) {
+        guppi_error("guppi_databuf_data_zeroed", "realloc error");
+        return(NULL);
+    }
+    *copy = out;
+    int i=0, start, nrun=0;
+    while (i<v->npkt) {
+        start = guppi_databuf_valid_next(v, i, v->npkt, &nrun);
+        if (start<0) start = v->npkt;
+        if (start>i)
+            memset(out + (size_t)i*v->pkt_size, 0, 
+                    (size_t)(start-i)*v->pkt_size);
+        if (start>=v->npkt) break;
+        memcpy(out + (size_t)start*v->pkt_size, 
+                data + (size_t)start*v->pkt_size, (size_t)nrun*v->pkt_size);
+        i = start + nrun;
+    }
+    if ((size_t)v->npkt*v->pkt_size < d->block_size)
+        memcpy(out + (size_t)v->npkt*v->pkt_size, 
+                data + (size_t)v->npkt*v->pkt_size,
+                d->block_size - (size_t)v->npkt*v->pkt_size);
+    return(out);
 }
 
 struct guppi_databuf *guppi_databuf_attach(int databuf_id) {
@@ -159,25 +873,46 @@ struct guppi_databuf *guppi_databuf_attach(int databuf_id) {
 }
 
 int guppi_databuf_block_status(struct guppi_databuf *d, int block_id) {
+    if (d->flags & GUPPI_DATABUF_FUTEX)
+        return(__atomic_load_n(&guppi_databuf_locks(d)[block_id].state,
+                    __ATOMIC_SEQ_CST));
     return(semctl(d->semid, block_id, GETVAL));
 }
 
 int guppi_databuf_total_status(struct guppi_databuf *d) {
+    int i,tot=0;
+
+    if (d->flags & GUPPI_DATABUF_FUTEX) {
+        struct guppi_databuf_lock *l = guppi_databuf_locks(d);
+        for (i=0; i<d->n_block; i++) 
+            tot += __atomic_load_n(&l[i].state, __ATOMIC_RELAXED) ? 1 : 0;
+        return(tot);
+    }
 
     /* Get all values at once */
+    unsigned short vals[d->n_block];
     union semun arg;
-    arg.array = (unsigned short *)malloc(sizeof(unsigned short)*d->n_block);
+    arg.array = vals;
     memset(arg.array, 0, sizeof(unsigned short)*d->n_block);
     semctl(d->semid, 0, GETALL, arg);
-    int i,tot=0;
     for (i=0; i<d->n_block; i++) tot+=arg.array[i];
-    free(arg.array);
     return(tot);
 
 }
 
 int guppi_databuf_wait_free(struct guppi_databuf *d, int block_id) {
+    /* Optional readers don't count as holding the block */
     int rv;
+    if (block_id<0 || block_id>=d->n_block) return(GUPPI_ERR_PARAM);
+    if (d->flags & GUPPI_DATABUF_FUTEX) {
+        rv = guppi_databuf_lock_wait(&guppi_databuf_locks(d)[block_id], 
+                ~__atomic_load_n(&d->optional_mask, __ATOMIC_SEQ_CST), 0);
+        if (rv==0) {
+            guppi_databuf_gen_start(d, block_id);
+            guppi_databuf_mark(d, block_id, GUPPI_DATABUF_T_START);
+        }
+        return(rv);
+    }
     struct sembuf op;
     op.sem_num = block_id;
     op.sem_op = 0;
@@ -193,9 +928,24 @@ int guppi_databuf_wait_free(struct guppi_databuf *d, int block_id) {
         perror("semop");
         return(GUPPI_ERR_SYS);
     }
+    guppi_databuf_gen_start(d, block_id);
+    guppi_databuf_mark(d, block_id, GUPPI_DATABUF_T_START);
     return(0);
 }
 
+unsigned long long guppi_databuf_gen(struct guppi_databuf *d, 
+        int block_id) {
+    return(__atomic_load_n(&guppi_databuf_info(d, block_id)->gen, 
+                __ATOMIC_ACQUIRE));
+}
+
+int guppi_databuf_gen_changed(struct guppi_databuf *d, int block_id,
+        unsigned long long gen) {
+    /* Reads of the block must not move past the check */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return((gen & 1) || guppi_databuf_gen(d, block_id)!=gen);
+}
+
 int guppi_databuf_wait_filled(struct guppi_databuf *d, int block_id) {
     /* This needs to wait for the semval of the given block
      * to become > 0, but NOT immediately decrement it to 0.
@@ -203,8 +953,16 @@ int guppi_databuf_wait_filled(struct guppi_databuf *d, int block_id) {
      * (afaik) the whole array happens atomically:
      * step 1: wait for val=1 then decrement (semop=-1)
      * step 2: increment by 1 (semop=1)
+     * Futex locks can just wait for the state word to change.
      */
     int rv;
+    if (block_id<0 || block_id>=d->n_block) return(GUPPI_ERR_PARAM);
+    if (d->flags & GUPPI_DATABUF_FUTEX) {
+        rv = guppi_databuf_lock_wait(&guppi_databuf_locks(d)[block_id], 
+                1U, 1);
+        if (rv==0) guppi_databuf_mark(d, block_id, GUPPI_DATABUF_T_READ);
+        return(rv);
+    }
     struct sembuf op[2];
     op[0].sem_num = op[1].sem_num = block_id;
     op[0].sem_flg = op[1].sem_flg = 0;
@@ -222,6 +980,7 @@ int guppi_databuf_wait_filled(struct guppi_databuf *d, int block_id) {
         perror("semop");
         return(GUPPI_ERR_SYS);
     }
+    guppi_databuf_mark(d, block_id, GUPPI_DATABUF_T_READ);
     return(0);
 }
 
@@ -230,6 +989,17 @@ int guppi_databuf_set_free(struct guppi_databuf *d, int block_id) {
      * state of the specified databuf.  So we use semctl (not semop) to set
      * the value to zero.
      */
+    if (d->flags & GUPPI_DATABUF_FUTEX) {
+        /* Leave any optional readers' holds alone */
+        struct guppi_databuf_lock *l = &guppi_databuf_locks(d)[block_id];
+        if (!(__atomic_and_fetch(&l->state, ~1U, __ATOMIC_SEQ_CST) & 
+                    ~__atomic_load_n(&d->optional_mask, __ATOMIC_SEQ_CST)))
+            guppi_databuf_mark(d, block_id, GUPPI_DATABUF_T_FREE);
+        guppi_databuf_lock_wake(l);
+        guppi_databuf_event(d);
+        return(0);
+    }
+    guppi_databuf_mark(d, block_id, GUPPI_DATABUF_T_FREE);
     int rv;
     union semun arg;
     arg.val = 0;
@@ -238,14 +1008,39 @@ int guppi_databuf_set_free(struct guppi_databuf *d, int block_id) {
         guppi_error("guppi_databuf_set_free", "semctl error");
         return(GUPPI_ERR_SYS);
     }
+    guppi_databuf_event(d);
     return(0);
 }
 
 int guppi_databuf_set_filled(struct guppi_databuf *d, int block_id) {
     /* This function should always succeed regardless of the current
      * state of the specified databuf.  So we use semctl (not semop) to set
-     * the value to one.
+     * the value to one.  With registered readers, the block is handed
+     * to all of them, and any optional reader that had not yet let go
+     * of the old contents has missed them.  If only optional readers
+     * are registered, bit 0 stands for the unregistered consumer.
+     * Timing is noted first, as a consumer can take the block as
+     * soon as it is marked.
      */
+    guppi_databuf_gen_filled(d, block_id);
+    guppi_databuf_mark(d, block_id, GUPPI_DATABUF_T_FILLED);
+    if (d->flags & GUPPI_DATABUF_FUTEX) {
+        struct guppi_databuf_lock *l = &guppi_databuf_locks(d)[block_id];
+        unsigned readers = __atomic_load_n(&d->reader_mask, __ATOMIC_SEQ_CST);
+        if (!(readers & ~__atomic_load_n(&d->optional_mask, __ATOMIC_SEQ_CST)))
+            readers |= 1;
+        unsigned old = __atomic_exchange_n(&l->state, readers, 
+                __ATOMIC_SEQ_CST);
+        old &= __atomic_load_n(&d->optional_mask, __ATOMIC_SEQ_CST);
+        while (old) {
+            __atomic_add_fetch(&d->nskip[__builtin_ctz(old)], 1, 
+                    __ATOMIC_RELAXED);
+            old &= old - 1;
+        }
+        guppi_databuf_lock_wake(l);
+        guppi_databuf_event(d);
+        return(0);
+    }
     int rv;
     union semun arg;
     arg.val = 1;
@@ -254,5 +1049,68 @@ int guppi_databuf_set_filled(struct guppi_databuf *d, int block_id) {
         guppi_error("guppi_databuf_set_filled", "semctl error");
         return(GUPPI_ERR_SYS);
     }
+    guppi_databuf_event(d);
+    return(0);
+}
+
+int guppi_databuf_add_reader(struct guppi_databuf *d, int optional) {
+    if (!(d->flags & GUPPI_DATABUF_FUTEX)) {
+        guppi_error("guppi_databuf_add_reader", 
+                "Multiple readers need a futex databuf");
+        return(GUPPI_ERR_PARAM);
+    }
+    unsigned mask = __atomic_load_n(&d->reader_mask, __ATOMIC_SEQ_CST);
+    int id;
+    do {
+        for (id=1; id<GUPPI_DATABUF_MAX_READERS; id++) 
+            if (!(mask & (1U<<id))) break;
+        if (id==GUPPI_DATABUF_MAX_READERS) {
+            guppi_error("guppi_databuf_add_reader", "Too many readers");
+            return(GUPPI_ERR_GEN);
+        }
+    } while (!__atomic_compare_exchange_n(&d->reader_mask, &mask, 
+                mask | (1U<<id), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    d->nskip[id] = 0;
+    if (optional) 
+        __atomic_or_fetch(&d->optional_mask, 1U<<id, __ATOMIC_SEQ_CST);
+    return(id);
+}
+
+int guppi_databuf_remove_reader(struct guppi_databuf *d, int reader) {
+    if (reader<=0 || reader>=GUPPI_DATABUF_MAX_READERS) 
+        return(GUPPI_ERR_PARAM);
+    if (!(d->flags & GUPPI_DATABUF_FUTEX)) return(GUPPI_ERR_PARAM);
+    const unsigned bit = 1U << reader;
+    __atomic_and_fetch(&d->reader_mask, ~bit, __ATOMIC_SEQ_CST);
+    __atomic_and_fetch(&d->optional_mask, ~bit, __ATOMIC_SEQ_CST);
+    int i;
+    for (i=0; i<d->n_block; i++) 
+        guppi_databuf_set_free_reader(d, i, reader);
+    return(GUPPI_OK);
+}
+
+int guppi_databuf_wait_filled_reader(struct guppi_databuf *d, int block_id,
+        int reader) {
+    if (reader==0) return(guppi_databuf_wait_filled(d, block_id));
+    if (!(d->flags & GUPPI_DATABUF_FUTEX)) return(GUPPI_ERR_PARAM);
+    if (block_id<0 || block_id>=d->n_block) return(GUPPI_ERR_PARAM);
+    int rv = guppi_databuf_lock_wait(&guppi_databuf_locks(d)[block_id], 
+            1U<<reader, 1);
+    if (rv==0) guppi_databuf_mark(d, block_id, GUPPI_DATABUF_T_READ);
+    return(rv);
+}
+
+int guppi_databuf_set_free_reader(struct guppi_databuf *d, int block_id,
+        int reader) {
+    if (reader==0) return(guppi_databuf_set_free(d, block_id));
+    if (!(d->flags & GUPPI_DATABUF_FUTEX)) return(GUPPI_ERR_PARAM);
+    struct guppi_databuf_lock *l = &guppi_databuf_locks(d)[block_id];
+    const unsigned state = 
+        __atomic_and_fetch(&l->state, ~(1U<<reader), __ATOMIC_SEQ_CST);
+    const int freed = state==0;
+    if (!(state & ~__atomic_load_n(&d->optional_mask, __ATOMIC_SEQ_CST)))
+        guppi_databuf_mark(d, block_id, GUPPI_DATABUF_T_FREE);
+    guppi_databuf_lock_wake(l);
+    if (freed) guppi_databuf_event(d);
     return(0);
 }
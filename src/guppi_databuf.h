@@ -9,6 +9,24 @@
 
 #include <sys/ipc.h>
 #include <sys/sem.h>
+#include <time.h>
+
+/* Rolling histogram of block stage times.  Bin 0 counts times under
+ * 1 us, bin i>0 times from 2^(i-1) to 2^i us.  Once n reaches
+ * GUPPI_DATABUF_HIST_MAX all counts are halved, so old samples fade
+ * out.
+ */
+#define GUPPI_DATABUF_HIST_NBIN 32
+#define GUPPI_DATABUF_HIST_MAX 65536
+struct guppi_databuf_hist {
+    unsigned long long n;   /* Samples in histogram */
+    unsigned long long bin[GUPPI_DATABUF_HIST_NBIN];
+};
+#define GUPPI_DATABUF_HIST_FILL 0 /* wait_free to set_filled */
+#define GUPPI_DATABUF_HIST_WAIT 1 /* set_filled to first wait_filled */
+#define GUPPI_DATABUF_HIST_PROC 2 /* first wait_filled to set_free */
+#define GUPPI_DATABUF_NHIST 3
+#define GUPPI_DATABUF_OCC_LEN 1024 /* Occupancy history length */
 
 struct guppi_databuf {
     char data_type[64]; /* Type of data in buffer */
@@ -16,8 +34,118 @@ struct guppi_databuf {
     size_t block_size;  /* Size of each data block (bytes) */
     size_t header_size; /* Size of each block header (bytes) */
     int shmid;          /* ID of this shared mem segment */
-    int semid;          /* ID of locking semaphore set */
+    int semid;          /* ID of locking semaphore set, 0 if none */
     int n_block;        /* Number of data blocks in buffer */
+    size_t valid_size;  /* Size of each block validity map (bytes) */
+    int flags;          /* GUPPI_DATABUF_* creation flags */
+    unsigned reader_mask;   /* Registered readers (futex only) */
+    unsigned optional_mask; /* Readers the producer doesn't wait on */
+    unsigned long long nskip[32]; /* Blocks each optional reader missed */
+    size_t page_size;   /* Size of pages backing the segment (bytes) */
+    size_t info_size;   /* Size of each block info struct (bytes) */
+    unsigned long long hdr_seq; /* Version of the last header text */
+    struct guppi_databuf_hist hist[GUPPI_DATABUF_NHIST]; /* Block timing */
+    unsigned long long nocc; /* Occupancy samples taken */
+    unsigned short occ[GUPPI_DATABUF_OCC_LEN]; /* Blocks filled at each
+                                                  set_filled, ring */
+    int event_seq;      /* Bumped on every fill or free */
+    int event_waiters;  /* Notify threads sleeping on event_seq */
+    int databuf_id;     /* Id this databuf was created with */
+    unsigned long long hdr_src_seq; /* Source header of last forward */
+    int layout_seq;     /* Bumped by reconfigure, odd while under way */
+};
+
+/* Creation flags.  With GUPPI_DATABUF_FUTEX, block state is kept
+ * in atomic words in the shared segment (see struct 
+ * guppi_databuf_lock) and waiters sleep on a futex, instead of
+ * using a SysV semaphore set.  Threads use the same calls either
+ * way.
+ */
+#define GUPPI_DATABUF_FUTEX 0x1
+
+/* With GUPPI_DATABUF_HUGEPAGE, the segment is allocated from huge
+ * pages (SHM_HUGETLB), cutting TLB misses in loops that stride across
+ * whole blocks.  If no huge pages are available, normal pages are
+ * used instead and the flag is cleared.  page_size in the struct
+ * gives the page size actually used.
+ */
+#define GUPPI_DATABUF_HUGEPAGE 0x2
+
+/* Per-block lock state for GUPPI_DATABUF_FUTEX databufs, one per
+ * cache line, stored after the guppi_databuf struct.
+ */
+struct guppi_databuf_lock {
+    int state;          /* 0 = free, else readers still holding it */
+    int waiters;        /* Threads sleeping on state */
+    char pad[56];
+};
+
+/* Multi-consumer fan-out, for GUPPI_DATABUF_FUTEX databufs only.
+ * Each consumer of a databuf registers as a reader and gets an id
+ * from 1 to GUPPI_DATABUF_MAX_READERS-1.  While any readers are
+ * registered, set_filled marks a block as held by all of them, and
+ * the block becomes free only once every reader has released it
+ * with guppi_databuf_set_free_reader.
+ *
+ * An optional reader (eg, a monitor) never holds up the producer:
+ * wait_free ignores its hold, so if it falls behind blocks are
+ * refilled under it and counted in nskip[id].  Data in a block an
+ * optional reader is looking at may change at any time.
+ *
+ * Reader id 0 is the single consumer of the original interface;
+ * the _reader calls with id 0 are the same as the plain ones.  It
+ * can run alongside optional readers (it holds bit 0 of the state)
+ * but not alongside other required ones.
+ */
+#define GUPPI_DATABUF_MAX_READERS 32
+
+/* Shared block pool.  Each databuf slot has an entry in a table
+ * after the lock words giving the physical block it currently
+ * uses, as (databuf id << 16) | block.  Slots start out using their
+ * own databuf's blocks, and guppi_databuf_forward swaps blocks
+ * between databufs, so chained databufs with the same block size
+ * act as one pool.  Databufs that have swapped blocks must be
+ * deleted and recreated together.
+ */
+#define GUPPI_DATABUF_PHYS(id, blk) (((id)<<16) | (blk))
+
+/* Per-block packet validity map, stored between the block headers
+ * and the data.  Bit i of bits[] is set if packet i of the block
+ * holds real data.  npkt==0 means no map was filled in for this
+ * block, and all data should be treated as valid.  If zeroed is
+ * not set, invalid packets contain whatever was there before.
+ */
+#define GUPPI_DATABUF_MIN_PKT_SIZE 256 /* Sets max packets per map */
+struct guppi_databuf_valid {
+    int npkt;           /* Number of packets in block */
+    int pkt_size;       /* Data bytes per packet */
+    int nvalid;         /* Number of valid packets */
+    int zeroed;         /* Invalid packets have been zero-filled */
+    unsigned long long bits[];
+};
+
+/* Per-block binary header, stored between the FITS-style block
+ * headers and the validity maps.  The producer fills this in along
+ * with the PKTIDX, PKTSIZE, NPKT and NDROP cards, so consumers can
+ * get them without searching the header text.  hdr_seq identifies
+ * the header text the block was given (see
+ * guppi_databuf_header_copy); two blocks with the same non-zero
+ * hdr_seq got the same text, apart from the per-block cards.
+ */
+struct guppi_databuf_info {
+    long long pktidx;   /* Index of first packet in block */
+    int pktsize;        /* Data bytes per packet */
+    int npkt;           /* Packets in block */
+    int ndrop;          /* Packets missing from block */
+    int pad;
+    struct timespec rx_time; /* Arrival of first packet, 0 if unknown */
+    unsigned long long hdr_seq; /* Header text version, 0 if unknown */
+    long long t_start;  /* Producer got block (CLOCK_MONOTONIC ns) */
+    long long t_filled; /* Block marked filled */
+    long long t_read;   /* First consumer got block */
+    long long t_free;   /* Block released by required consumers */
+    unsigned long long gen; /* Fill generation, odd while being filled
+                               (see guppi_databuf_gen) */
 };
 
 #define GUPPI_DATABUF_KEY 12987498
@@ -33,10 +161,11 @@ union semun {
 /* Create a new shared mem area with given params.  Returns 
  * pointer to the new area on success, or NULL on error.  Returns
  * error if an existing shmem area exists with the given shmid (or
- * if other errors occured trying to allocate it).
+ * if other errors occured trying to allocate it).  flags is a
+ * combination of GUPPI_DATABUF_* flags, 0 for the defaults.
  */
 struct guppi_databuf *guppi_databuf_create(int n_block, size_t block_size,
-        int databuf_id);
+        int databuf_id, int flags);
 
 /* Return a pointer to a existing shmem segment with given id.
  * Returns error if segment does not exist 
@@ -46,25 +175,147 @@ struct guppi_databuf *guppi_databuf_attach(int databuf_id);
 /* Detach from shared mem segment */
 int guppi_databuf_detach(struct guppi_databuf *d);
 
+/* Ask for the databuf memory to live on the given NUMA node.
+ * Pages already in use only by this process are moved there.
+ */
+int guppi_databuf_set_node(struct guppi_databuf *d, int node);
+
 /* Clear out either the whole databuf (set all sems to 0, 
  * clear all header blocks) or a single FITS-style
- * header block.
+ * header block.  guppi_databuf_clear returns GUPPI_OK, or
+ * GUPPI_ERR_SYS if the semaphores could not be reset.
  */
-void guppi_databuf_clear(struct guppi_databuf *d);
+int guppi_databuf_clear(struct guppi_databuf *d);
 void guppi_fitsbuf_clear(char *buf);
 
+/* Length in bytes of a FITS-style buffer through its END card */
+size_t guppi_fitsbuf_len(const char *buf);
+
+/* Copy the text of src into dst, returning 1 if it differs in
+ * anything other than monitoring keywords (thread states, drop and
+ * receive counters, ...) that change every block.  Only cards
+ * through END are compared or copied.
+ */
+int guppi_fitsbuf_update(char *dst, const char *src);
+
+/* Whether a card holds one of the monitoring keywords */
+int guppi_fitsbuf_monitor_key(const char *card);
+
 /* These return pointers to the header or data area for 
  * the given block_id.
  */
 char *guppi_databuf_header(struct guppi_databuf *d, int block_id);
 char *guppi_databuf_data(struct guppi_databuf *d, int block_id);
 
+/* Hand block src_blk of src on to dst_blk of dst without copying
+ * the data.  The caller must hold src_blk (wait_filled) and have
+ * dst_blk free (wait_free).  The data, header, info and validity
+ * map move to dst_blk, and src_blk gets dst_blk's old (unused) data
+ * block.  Block states are not changed: the caller then marks
+ * dst_blk filled and src_blk free as usual.  Both databufs must
+ * have the same block size.
+ */
+int guppi_databuf_forward(struct guppi_databuf *src, int src_blk,
+        struct guppi_databuf *dst, int dst_blk);
+
+/* Detach this process's attachment to databuf_id made to reach its
+ * pool blocks, or all such attachments if databuf_id is 0.  Only to
+ * be called once no data pointer into those blocks is in use, e.g.
+ * before the databufs are deleted or at exit.
+ */
+int guppi_databuf_pool_release(int databuf_id);
+
+/* Returns pointer to the binary info for the given block_id */
+struct guppi_databuf_info *guppi_databuf_info(struct guppi_databuf *d,
+        int block_id);
+
+/* Fill generation of a block, for optional readers, which the
+ * producer does not wait for and so can refill a block under them.
+ * It is made odd when the producer gets the block (wait_free) and
+ * moved on to the next even value when it is marked filled.  Take
+ * the generation once the block is filled, read the block, then
+ * check it with guppi_databuf_gen_changed: if that returns 1 the
+ * block was being refilled and what was read may be torn.
+ */
+unsigned long long guppi_databuf_gen(struct guppi_databuf *d, int block_id);
+int guppi_databuf_gen_changed(struct guppi_databuf *d, int block_id,
+        unsigned long long gen);
+
+/* Set a block's header text from hdr.  changed says whether hdr
+ * differs from the text given for the previous block; if not, and
+ * the block still holds that text from its last use, nothing is
+ * copied.  Text beyond the block's header size is cut off, and an
+ * hdr with no END card leaves the block with an empty header (and
+ * hdr_seq 0).  Returns 1 if the text was copied.
+ */
+int guppi_databuf_header_copy(struct guppi_databuf *d, int block_id,
+        const char *hdr, int changed);
+
+/* Returns pointer to the validity map for the given block_id,
+ * or NULL if this databuf has none.  guppi_databuf_valid_max
+ * gives the number of packets a map can describe.
+ */
+struct guppi_databuf_valid *guppi_databuf_valid(struct guppi_databuf *d, 
+        int block_id);
+int guppi_databuf_valid_max(struct guppi_databuf *d);
+
+/* Start a new (all invalid) map for a block */
+void guppi_databuf_valid_reset(struct guppi_databuf_valid *v, int npkt, 
+        int pkt_size);
+
+/* Find the next run of valid packets starting at or after ipkt.
+ * Returns the index of the first packet of the run, and its length
+ * in *nrun, or -1 if there are no more valid packets.  A NULL or
+ * empty map gives a single run covering npkt packets.
+ */
+int guppi_databuf_valid_next(const struct guppi_databuf_valid *v, 
+        int ipkt, int npkt, int *nrun);
+
+/* Zero-fill any invalid packets in the block, if it has not
+ * already been done.
+ */
+void guppi_databuf_valid_zero(struct guppi_databuf *d, int block_id);
+
+/* Returns 1 if reader is the only one still holding the block, so
+ * it may change the contents in place.
+ */
+int guppi_databuf_sole_reader(struct guppi_databuf *d, int block_id, 
+        int reader);
+
+/* Block data with invalid packets zeroed, for the given reader.  The
+ * block is zero-filled in place only if no other reader holds it;
+ * otherwise a zero-filled copy is made in *copy (realloc'd as needed,
+ * freed by the caller) and returned.  Returns NULL on error.
+ */
+char *guppi_databuf_data_zeroed(struct guppi_databuf *d, int block_id,
+        int reader, char **copy);
+
 /* Returns lock status for given block_id, or total for
  * whole array.
  */
 int guppi_databuf_block_status(struct guppi_databuf *d, int block_id);
 int guppi_databuf_total_status(struct guppi_databuf *d);
 
+/* Block timing.  The wait/set calls note when each block reaches
+ * each stage in its info struct, and add the time spent in each
+ * stage to the databuf's histograms.  set_filled also samples the
+ * ring occupancy.  guppi_databuf_hist_pct returns the time (us)
+ * below which the given fraction of samples fall, to within a
+ * factor of 2, or 0 if the histogram is empty.
+ */
+double guppi_databuf_hist_pct(const struct guppi_databuf_hist *h, 
+        double frac);
+
+/* Notification fd.  Returns an eventfd that becomes readable each
+ * time a block of the databuf is marked filled or free, by any
+ * process, or -1 on error.  It can be used with poll/epoll to wait
+ * on several databufs and other fds at once.  Read it to clear it,
+ * then check the blocks with guppi_databuf_block_status or the wait
+ * calls.  Each fd has a helper thread, stopped by notify_close.
+ */
+int guppi_databuf_notify_fd(struct guppi_databuf *d);
+void guppi_databuf_notify_close(int fd);
+
 /* Databuf locking functions.  Each block in the buffer
  * can be marked as free or filled.  The "wait" functions
  * block until the specified state happens.  The "set" functions
@@ -76,5 +327,29 @@ int guppi_databuf_set_filled(struct guppi_databuf *d, int block_id);
 int guppi_databuf_wait_free(struct guppi_databuf *d, int block_id);
 int guppi_databuf_set_free(struct guppi_databuf *d, int block_id);
 
+/* Change the number and size of blocks in place, within the
+ * existing shared memory segment.  block_size 0 means the largest
+ * blocks that fit.  Waits up to timeout seconds for all blocks to
+ * be freed, then lays the databuf out again with every block free
+ * and empty headers, and bumps layout_seq.  Producers and required
+ * readers must be stopped first; optional readers should watch
+ * layout_seq.  Returns GUPPI_ERR_PARAM if the layout doesn't fit,
+ * in which case the databuf has to be deleted and created again.
+ */
+int guppi_databuf_reconfigure(struct guppi_databuf *d, int n_block, 
+        size_t block_size, int timeout);
+
+/* Register a reader, returning its id, or GUPPI_ERR_* on error.
+ * Remove it again when done, releasing any blocks it still holds.
+ */
+int guppi_databuf_add_reader(struct guppi_databuf *d, int optional);
+int guppi_databuf_remove_reader(struct guppi_databuf *d, int reader);
+
+/* Wait for / release a block as the given reader */
+int guppi_databuf_wait_filled_reader(struct guppi_databuf *d, int block_id,
+        int reader);
+int guppi_databuf_set_free_reader(struct guppi_databuf *d, int block_id,
+        int reader);
+
 
 #endif
@@ -0,0 +1,220 @@
+/* guppi_dbtap.c
+ *
+ * Databuf tap file read/write.  See guppi_dbtap.h.
+ */
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "guppi_dbtap.h"
+#include "guppi_error.h"
+
+static size_t dbtap_round(size_t n) {
+    return((n + GUPPI_DBTAP_ALIGN - 1) / GUPPI_DBTAP_ALIGN
+            * GUPPI_DBTAP_ALIGN);
+}
+
+/* Open fname with O_DIRECT if asked, falling back to buffered i/o
+ * on filesystems that don't allow it.
+ */
+static int dbtap_open_file(const char *fname, int flags, int direct) {
+    int fd = -1;
+    if (direct) {
+        fd = open(fname, flags | O_DIRECT, 0644);
+        if (fd<0 && errno==EINVAL)
+            guppi_warn("guppi_dbtap_open",
+                    "O_DIRECT not supported, using buffered i/o");
+    }
+    if (fd<0) fd = open(fname, flags, 0644);
+    return(fd);
+}
+
+/* Set up the record buffer for the sizes in t->fh */
+static int dbtap_alloc(struct guppi_dbtap *t) {
+    size_t off = dbtap_round(sizeof(struct guppi_dbtap_rec));
+    const size_t hdr_off = off;
+    off += dbtap_round(t->fh.header_size);
+    const size_t valid_off = off;
+    off += dbtap_round(t->fh.valid_size);
+    const size_t data_off = off;
+    off += dbtap_round(t->fh.block_size);
+    if (t->fh.rec_size==0) t->fh.rec_size = off;
+    if (t->fh.rec_size!=off) {
+        guppi_error("guppi_dbtap_open", "Inconsistent record size");
+        return(GUPPI_ERR_PARAM);
+    }
+    if (posix_memalign((void **)&t->buf, GUPPI_DBTAP_ALIGN, off)) {
+        guppi_error("guppi_dbtap_open", "Error allocating record buffer");
+        return(GUPPI_ERR_SYS);
+    }
+    memset(t->buf, 0, off);
+    t->rec = (struct guppi_dbtap_rec *)t->buf;
+    t->hdr = t->buf + hdr_off;
+    t->valid = t->buf + valid_off;
+    t->data = t->buf + data_off;
+    return(GUPPI_OK);
+}
+
+/* Full-size write or read, retrying short transfers */
+static int dbtap_io(int fd, char *buf, size_t len, int wr) {
+    while (len>0) {
+        ssize_t rv = wr ? write(fd, buf, len) : read(fd, buf, len);
+        if (rv<0 && errno==EINTR) continue;
+        if (rv<0) return(GUPPI_ERR_SYS);
+        if (rv==0) return(GUPPI_TIMEOUT);
+        buf += rv;
+        len -= rv;
+    }
+    return(GUPPI_OK);
+}
+
+int guppi_dbtap_create(struct guppi_dbtap *t, const char *fname,
+        struct guppi_databuf *d, int direct) {
+    memset(t, 0, sizeof(struct guppi_dbtap));
+    t->fd = -1;
+    memcpy(t->fh.magic, GUPPI_DBTAP_MAGIC, 8);
+    t->fh.version = GUPPI_DBTAP_VERSION;
+    t->fh.databuf_id = d->databuf_id;
+    t->fh.n_block = d->n_block;
+    t->fh.block_size = d->block_size;
+    t->fh.header_size = d->header_size;
+    t->fh.valid_size = d->valid_size;
+    memcpy(t->fh.data_type, d->data_type, sizeof(t->fh.data_type));
+    int rv = dbtap_alloc(t);
+    if (rv!=GUPPI_OK) return(rv);
+
+    t->fd = dbtap_open_file(fname, O_WRONLY | O_CREAT | O_TRUNC, direct);
+    if (t->fd<0) {
+        guppi_error("guppi_dbtap_create", "Error opening tap file");
+        free(t->buf);
+        return(GUPPI_ERR_SYS);
+    }
+
+    /* File header goes in the first (padded) record slot's space */
+    memcpy(t->buf, &t->fh, sizeof(struct guppi_dbtap_filehdr));
+    rv = dbtap_io(t->fd, t->buf, GUPPI_DBTAP_ALIGN, 1);
+    memset(t->buf, 0, GUPPI_DBTAP_ALIGN);
+    if (rv!=GUPPI_OK) {
+        guppi_error("guppi_dbtap_create", "Error writing tap file header");
+        guppi_dbtap_close(t);
+        return(rv);
+    }
+    return(GUPPI_OK);
+}
+
+void guppi_dbtap_copy(struct guppi_dbtap *t, struct guppi_databuf *d,
+        int block_id) {
+    memcpy(t->rec->magic, GUPPI_DBTAP_RECMAGIC, 8);
+    t->rec->seq = t->nrec;
+    t->rec->block_id = block_id;
+    clock_gettime(CLOCK_REALTIME, &t->rec->tap_time);
+    t->rec->info = *guppi_databuf_info(d, block_id);
+    memcpy(t->hdr, guppi_databuf_header(d, block_id), t->fh.header_size);
+    if (t->fh.valid_size)
+        memcpy(t->valid, guppi_databuf_valid(d, block_id),
+                t->fh.valid_size);
+    memcpy(t->data, guppi_databuf_data(d, block_id), t->fh.block_size);
+}
+
+int guppi_dbtap_write(struct guppi_dbtap *t) {
+    int rv = dbtap_io(t->fd, t->buf, t->fh.rec_size, 1);
+    if (rv!=GUPPI_OK) {
+        guppi_error("guppi_dbtap_write", "Error writing tap file");
+        return(GUPPI_ERR_SYS);
+    }
+    t->nrec++;
+    return(GUPPI_OK);
+}
+
+int guppi_dbtap_open(struct guppi_dbtap *t, const char *fname, int direct) {
+    memset(t, 0, sizeof(struct guppi_dbtap));
+    t->fd = dbtap_open_file(fname, O_RDONLY, direct);
+    if (t->fd<0) {
+        guppi_error("guppi_dbtap_open", "Error opening tap file");
+        return(GUPPI_ERR_SYS);
+    }
+    char *fbuf;
+    if (posix_memalign((void **)&fbuf, GUPPI_DBTAP_ALIGN,
+                GUPPI_DBTAP_ALIGN)) {
+        close(t->fd);
+        return(GUPPI_ERR_SYS);
+    }
+    int rv = dbtap_io(t->fd, fbuf, GUPPI_DBTAP_ALIGN, 0);
+    memcpy(&t->fh, fbuf, sizeof(struct guppi_dbtap_filehdr));
+    free(fbuf);
+    if (rv!=GUPPI_OK || memcmp(t->fh.magic, GUPPI_DBTAP_MAGIC, 8)) {
+        guppi_error("guppi_dbtap_open", "Not a databuf tap file");
+        close(t->fd);
+        return(GUPPI_ERR_PARAM);
+    }
+    if (t->fh.version!=GUPPI_DBTAP_VERSION) {
+        guppi_error("guppi_dbtap_open", "Unknown tap file version");
+        close(t->fd);
+        return(GUPPI_ERR_PARAM);
+    }
+    rv = dbtap_alloc(t);
+    if (rv!=GUPPI_OK) close(t->fd);
+    return(rv);
+}
+
+int guppi_dbtap_read(struct guppi_dbtap *t) {
+    int rv = dbtap_io(t->fd, t->buf, t->fh.rec_size, 0);
+    if (rv==GUPPI_TIMEOUT) return(rv);
+    if (rv!=GUPPI_OK) {
+        guppi_error("guppi_dbtap_read", "Error reading tap file");
+        return(rv);
+    }
+    if (memcmp(t->rec->magic, GUPPI_DBTAP_RECMAGIC, 8)) {
+        guppi_error("guppi_dbtap_read", "Bad tap file record");
+        return(GUPPI_ERR_PARAM);
+    }
+    t->nrec++;
+    return(GUPPI_OK);
+}
+
+int guppi_dbtap_rewind(struct guppi_dbtap *t) {
+    if (lseek(t->fd, GUPPI_DBTAP_ALIGN, SEEK_SET)<0) {
+        guppi_error("guppi_dbtap_rewind", "Error seeking tap file");
+        return(GUPPI_ERR_SYS);
+    }
+    return(GUPPI_OK);
+}
+
+int guppi_dbtap_fill(struct guppi_dbtap *t, struct guppi_databuf *d,
+        int block_id, int changed) {
+    if (d->block_size < t->fh.block_size
+            || d->header_size < t->fh.header_size) {
+        guppi_error("guppi_dbtap_fill", "Databuf blocks too small");
+        return(GUPPI_ERR_PARAM);
+    }
+    guppi_databuf_header_copy(d, block_id, t->hdr, changed);
+    struct guppi_databuf_info *info = guppi_databuf_info(d, block_id);
+    info->pktidx = t->rec->info.pktidx;
+    info->pktsize = t->rec->info.pktsize;
+    info->npkt = t->rec->info.npkt;
+    info->ndrop = t->rec->info.ndrop;
+    info->rx_time = t->rec->info.rx_time;
+    struct guppi_databuf_valid *v = guppi_databuf_valid(d, block_id);
+    if (v!=NULL) {
+        /* Nothing of the block's last map may show through */
+        memset(v, 0, d->valid_size);
+        if (t->fh.valid_size)
+            memcpy(v, t->valid, t->fh.valid_size < d->valid_size ?
+                    t->fh.valid_size : d->valid_size);
+    }
+    memcpy(guppi_databuf_data(d, block_id), t->data, t->fh.block_size);
+    return(GUPPI_OK);
+}
+
+void guppi_dbtap_close(struct guppi_dbtap *t) {
+    if (t->fd>=0) close(t->fd);
+    t->fd = -1;
+    free(t->buf);
+    t->buf = NULL;
+}
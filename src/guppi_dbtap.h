@@ -0,0 +1,92 @@
+/* guppi_dbtap.h
+ *
+ * Databuf tap files.  A tap file holds a sequence of databuf blocks,
+ * each with its header text, binary info and validity map, exactly
+ * as a consumer saw them.  tap_guppi_databuf writes them from a live
+ * databuf and replay_guppi_databuf feeds them back into a databuf,
+ * so downstream stages can be run on recorded production data.
+ *
+ * The file starts with a guppi_dbtap_filehdr, then one fixed-size
+ * record per block: a guppi_dbtap_rec, the header text, the validity
+ * map and the block data, each padded to GUPPI_DBTAP_ALIGN bytes so
+ * records can be written and read with O_DIRECT.
+ */
+#ifndef _GUPPI_DBTAP_H
+#define _GUPPI_DBTAP_H
+
+#include <time.h>
+
+#include "guppi_databuf.h"
+
+#define GUPPI_DBTAP_MAGIC "GUPPITAP"
+#define GUPPI_DBTAP_RECMAGIC "GUPPIREC"
+#define GUPPI_DBTAP_VERSION 1
+#define GUPPI_DBTAP_ALIGN 4096
+
+struct guppi_dbtap_filehdr {
+    char magic[8];
+    int version;
+    int databuf_id;     /* Databuf the blocks were taken from */
+    int n_block;
+    int pad;
+    unsigned long long block_size;
+    unsigned long long header_size;
+    unsigned long long valid_size;
+    unsigned long long rec_size; /* Bytes per record, padding included */
+    char data_type[64];
+};
+
+struct guppi_dbtap_rec {
+    char magic[8];
+    unsigned long long seq;     /* Record number in file */
+    int block_id;               /* Block in the source databuf */
+    int pad;
+    struct timespec tap_time;   /* When the block was read */
+    struct guppi_databuf_info info;
+};
+
+struct guppi_dbtap {
+    int fd;
+    struct guppi_dbtap_filehdr fh;
+    char *buf;                  /* Aligned buffer, one record */
+    struct guppi_dbtap_rec *rec;
+    char *hdr, *valid, *data;   /* Parts of the record in buf */
+    unsigned long long nrec;    /* Records written or read */
+};
+
+/* Create a tap file for blocks of databuf d.  direct asks for
+ * O_DIRECT writes (falling back to buffered if not supported).
+ */
+int guppi_dbtap_create(struct guppi_dbtap *t, const char *fname,
+        struct guppi_databuf *d, int direct);
+
+/* Copy block block_id of d into the record buffer.  The caller
+ * holds the block; it can be released once this returns.
+ */
+void guppi_dbtap_copy(struct guppi_dbtap *t, struct guppi_databuf *d,
+        int block_id);
+
+/* Append the record buffer to the file */
+int guppi_dbtap_write(struct guppi_dbtap *t);
+
+/* Open a tap file for reading */
+int guppi_dbtap_open(struct guppi_dbtap *t, const char *fname, int direct);
+
+/* Read the next record into the record buffer.  Returns GUPPI_OK,
+ * GUPPI_TIMEOUT at the end of the file or an error.
+ */
+int guppi_dbtap_read(struct guppi_dbtap *t);
+
+/* Go back to the first record */
+int guppi_dbtap_rewind(struct guppi_dbtap *t);
+
+/* Fill block block_id of d from the record buffer.  The caller must
+ * have waited for the block to be free.  changed says whether the
+ * header text differs from the previous record filled into d.
+ */
+int guppi_dbtap_fill(struct guppi_dbtap *t, struct guppi_databuf *d,
+        int block_id, int changed);
+
+void guppi_dbtap_close(struct guppi_dbtap *t);
+
+#endif
@@ -35,6 +35,12 @@ extern void guppi_read_subint_params(char *buf,
                                      struct guppi_params *g,
                                      struct psrfits *p);
 
+/* Same, skipping the parse if the header text has not changed */
+extern void guppi_read_block_params(struct guppi_databuf *d, int block_id,
+                                    unsigned long long *hdr_seq,
+                                    struct guppi_params *g,
+                                    struct psrfits *p);
+
 static const int nthread = 6;
 static void join_all_threads(pthread_t *ids) {
     int i;
@@ -48,16 +54,10 @@ void guppi_fold_thread(void *_args) {
     /* Get arguments */
     struct guppi_thread_args *args = (struct guppi_thread_args *)_args;
 
-    /* Set cpu affinity */
-    cpu_set_t cpuset;
-    sched_getaffinity(0, sizeof(cpu_set_t), &cpuset);
-    CPU_CLR(2, &cpuset);
-    CPU_CLR(3, &cpuset);
-    int rv = sched_setaffinity(0, sizeof(cpu_set_t), &cpuset);
-    if (rv<0) { 
-        guppi_error("guppi_fold_thread", "Error setting cpu affinity.");
-        perror("sched_setaffinity");
-    }
+    /* Set cpu affinity, FOLDCPUS/FOLDNODE.  Default is to stay off
+     * the net thread's CPUs.
+     */
+    int rv = guppi_thread_set_affinity(args, "FOLD", "!2-3");
 
     /* Set priority */
     rv = setpriority(PRIO_PROCESS, 0, args->priority);
@@ -104,6 +104,7 @@ void guppi_fold_thread(void *_args) {
         pthread_exit(NULL);
     }
     pthread_cleanup_push((void *)guppi_databuf_detach, db_in);
+    if (args->numa_node>=0) guppi_databuf_set_node(db_in, args->numa_node);
     db_out = guppi_databuf_attach(args->output_buffer);
     if (db_out==NULL) {
         sprintf(errmsg,
@@ -129,7 +130,16 @@ void guppi_fold_thread(void *_args) {
     fb.data = NULL;
     fb.count = NULL;
 
-    /* Sub-thread management */
+    /* Sub-thread management.  Sub-threads run on the fold thread's
+     * CPUs unless FSUBCPUS says otherwise.
+     */
+    char sub_cpus[64] = "";
+    pthread_attr_t sub_attr;
+    pthread_attr_init(&sub_attr);
+    guppi_status_lock_safe(&st);
+    hgets(st.buf, "FSUBCPUS", sizeof(sub_cpus), sub_cpus);
+    guppi_status_unlock_safe(&st);
+    guppi_thread_attr_cpus(&sub_attr, sub_cpus);
     pthread_t thread_id[nthread];
     int input_block_list[nthread];
     struct fold_args fargs[nthread];
@@ -147,6 +157,7 @@ void guppi_fold_thread(void *_args) {
         fargs[i].nsamp = 0;
         fargs[i].tsamp = 0.0;
         fargs[i].raw_signed = 1;
+        fargs[i].valid = NULL;
     }
     pthread_cleanup_push((void *)join_all_threads, thread_id);
 
@@ -157,6 +168,8 @@ void guppi_fold_thread(void *_args) {
     double tsubint=0.0, offset=0.0, suboffs=0.0;
     int cur_thread=0;
     char *hdr_in=NULL, *hdr_out=NULL;
+    unsigned long long hdr_seq=0, hdr_out_seq=0;
+    struct guppi_databuf_info *info_in=NULL, *info_out=NULL;
     signal(SIGINT,cc);
     while (run) {
 
@@ -166,7 +179,8 @@ void guppi_fold_thread(void *_args) {
         guppi_status_unlock_safe(&st);
 
         /* Wait for buf to have data */
-        rv = guppi_databuf_wait_filled(db_in, curblock_in);
+        rv = guppi_databuf_wait_filled_reader(db_in, curblock_in,
+                args->reader);
         if (rv!=0) continue;
 
         /* Note current block(s) */
@@ -182,10 +196,11 @@ void guppi_fold_thread(void *_args) {
 
         /* Read param struct for this block */
         hdr_in = guppi_databuf_header(db_in, curblock_in);
+        info_in = guppi_databuf_info(db_in, curblock_in);
         if (first) 
             guppi_read_obs_params(hdr_in, &gp, &pf);
         else
-            guppi_read_subint_params(hdr_in, &gp, &pf);
+            guppi_read_block_params(db_in, curblock_in, &hdr_seq, &gp, &pf);
 
         /* Refresh params, dump any previous subint on a 0 packet */
         if (gp.packetindex==0)  {
@@ -215,8 +230,10 @@ void guppi_fold_thread(void *_args) {
 
             /* Set up first output header */
             hdr_out = guppi_databuf_header(db_out, curblock_out);
-            memcpy(hdr_out, guppi_databuf_header(db_in, curblock_in),
-                    GUPPI_STATUS_SIZE);
+            info_out = guppi_databuf_info(db_out, curblock_out);
+            guppi_databuf_header_copy(db_out, curblock_out, hdr_in,
+                    info_in->hdr_seq==0 || info_in->hdr_seq!=hdr_out_seq);
+            hdr_out_seq = info_in->hdr_seq;
             hputi4(hdr_out, "NBIN", fb.nbin);
             if (strncmp(pf.hdr.obs_mode,"CAL",3))
                 hputs(hdr_out, "OBS_MODE", "PSR");
@@ -267,7 +284,8 @@ void guppi_fold_thread(void *_args) {
 
                 /* Mark input block as free */
                 if (input_block_list[i]>=0) 
-                    guppi_databuf_set_free(db_in, input_block_list[i]);
+                    guppi_databuf_set_free_reader(db_in, input_block_list[i],
+                            args->reader);
                 
                 /* Combine result into total int */
                 rv = accumulate_folds(&fb, fargs[i].fb);
@@ -335,8 +353,10 @@ void guppi_fold_thread(void *_args) {
             curblock_out = (curblock_out + 1) % db_out->n_block;
             guppi_databuf_wait_free(db_out, curblock_out);
             hdr_out = guppi_databuf_header(db_out, curblock_out);
-            memcpy(hdr_out, guppi_databuf_header(db_in, curblock_in),
-                    GUPPI_STATUS_SIZE);
+            info_out = guppi_databuf_info(db_out, curblock_out);
+            guppi_databuf_header_copy(db_out, curblock_out, hdr_in,
+                    info_in->hdr_seq==0 || info_in->hdr_seq!=hdr_out_seq);
+            hdr_out_seq = info_in->hdr_seq;
             if (strncmp(pf.hdr.obs_mode,"CAL",3))
                 hputs(hdr_out, "OBS_MODE", "PSR");
             hputi4(hdr_out, "NBIN", fb.nbin);
@@ -443,7 +463,8 @@ void guppi_fold_thread(void *_args) {
             / pf.hdr.nchan / pf.hdr.npol;
         fargs[cur_thread].tsamp = pf.hdr.dt;
         fargs[cur_thread].raw_signed = 1;
-        rv = pthread_create(&thread_id[cur_thread], NULL, 
+        fargs[cur_thread].valid = guppi_databuf_valid(db_in, curblock_in);
+        rv = pthread_create(&thread_id[cur_thread], &sub_attr, 
                 fold_8bit_power_thread, &fargs[cur_thread]);
         if (rv!=0) 
             guppi_error("guppi_fold_thread", "error launching fold subthread");
@@ -461,6 +482,10 @@ void guppi_fold_thread(void *_args) {
         hputi4(hdr_out, "NDROP", ndrop);
         hputr8(hdr_out, "TSUBINT", tsubint);
         hputr8(hdr_out, "OFFS_SUB", suboffs / (double)nblock_int);
+        if (nblock_int==1) info_out->pktidx = gp.packetindex;
+        info_out->pktsize = gp.packetsize;
+        info_out->npkt = npacket;
+        info_out->ndrop = ndrop;
 
         /* Mark in as free.. not yet! */
         //guppi_databuf_set_free(db_in, curblock_in);
@@ -475,6 +500,7 @@ void guppi_fold_thread(void *_args) {
 
     pthread_exit(NULL);
 
+    pthread_attr_destroy(&sub_attr);
     pthread_cleanup_pop(0); /* Closes join_all_threads */
     pthread_cleanup_pop(0); /* Closes set_exit_status */
     pthread_cleanup_pop(0); /* Closes set_finished */
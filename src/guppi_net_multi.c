@@ -0,0 +1,614 @@
+/* guppi_net_multi.c
+ *
+ * Multi-threaded packet receive.  See guppi_net_multi.h.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "fitshead.h"
+#include "guppi_error.h"
+#include "guppi_status.h"
+#include "guppi_databuf.h"
+#include "guppi_udp.h"
+#include "guppi_time.h"
+#include "guppi_net_multi.h"
+
+#define STATUS_KEY "NETSTAT"  /* Define before guppi_threads.h */
+#include "guppi_threads.h"
+
+/* Copy one packet into its slot.  Waits for the block to be
+ * opened if the receiver has run ahead of the manager.  Returns
+ * nonzero if the block has already been closed.
+ */
+static int guppi_net_place(struct guppi_net_shared *sh, int gen,
+        unsigned long long seq_num, const struct guppi_udp_packet *p) {
+    const long long blk = seq_num / sh->packets_per_block;
+    struct guppi_net_block *b = &sh->win[blk % sh->nwin];
+    long long open;
+    while (1) {
+        __sync_fetch_and_add(&b->writers, 1);
+        open = b->blk_idx;
+        if (open==blk) break;
+        __sync_fetch_and_sub(&b->writers, 1);
+        if (open>blk || blk<sh->oldest_blk) return(GUPPI_ERR_GEN);
+        if (!sh->run || gen!=sh->obs_gen) return(GUPPI_ERR_GEN);
+        sched_yield();
+    }
+    const unsigned idx = seq_num - blk*sh->packets_per_block;
+    const unsigned long long bit = 1ULL << (idx%64);
+    if ((__sync_fetch_and_or(&b->got[idx/64], bit) & bit)==0) {
+        sh->fmt.copy(&sh->fmt, b->data + idx*sh->packet_data_size, p);
+        __sync_fetch_and_add(&b->npkt, 1);
+    }
+    __sync_fetch_and_sub(&b->writers, 1);
+    return(GUPPI_OK);
+}
+
+/* Feed the arrival time fit with the first packets of each obs,
+ * whichever receivers they come in on.
+ */
+static void guppi_net_clock_add(struct guppi_net_shared *sh, int gen,
+        unsigned long long seq_num, const struct timespec *ts) {
+    if (sh->clk.nmax==0 || ts->tv_sec==0 || sh->clk_full_gen==gen) 
+        return;
+    pthread_mutex_lock(&sh->clk_lock);
+    if (sh->clk_gen!=gen) {
+        guppi_pktclock_reset(&sh->clk);
+        sh->clk_gen = gen;
+    }
+    if (guppi_pktclock_add(&sh->clk, seq_num, ts)) sh->clk_full_gen = gen;
+    pthread_mutex_unlock(&sh->clk_lock);
+}
+
+/* Receiver sub-thread */
+static void *guppi_net_recv_thread(void *_r) {
+    struct guppi_net_receiver *r = (struct guppi_net_receiver *)_r;
+    struct guppi_net_shared *sh = r->sh;
+
+    struct guppi_udp_packet *pkts;
+    pkts = (struct guppi_udp_packet *)malloc(
+            sizeof(struct guppi_udp_packet) * r->up.batch_size);
+    if (pkts==NULL) {
+        guppi_error("guppi_net_recv_thread", "Error allocating packets");
+        r->error = 1;
+        return(NULL);
+    }
+    pthread_cleanup_push((void *)free, pkts);
+
+    int i, n, gen=sh->obs_gen;
+    long long last_seq_num=-1, blk;
+    unsigned long long seq_num;
+    struct guppi_udp_packet *p;
+    while (sh->run) {
+
+        n = guppi_udp_recv_batch(&r->up, pkts, r->up.batch_size);
+        if (n<0) {
+            guppi_error("guppi_net_recv_thread",
+                    "guppi_udp_recv_batch returned error");
+            perror("guppi_udp_recv_batch");
+            r->error = 1;
+            break;
+        }
+        if (n==0) {
+            if (guppi_udp_wait(&r->up)==GUPPI_ERR_SYS) {
+                guppi_error("guppi_net_recv_thread",
+                        "guppi_udp_wait returned error");
+                r->error = 1;
+                break;
+            }
+            continue;
+        }
+
+        for (i=0; i<n; i++) {
+            p = &pkts[i];
+            if (p->packet_size!=r->up.packet_size) {
+                r->nbogus++;
+                continue;
+            }
+            seq_num = sh->fmt.seq_num(&sh->fmt, p);
+
+            /* Manager started a new obs */
+            if (gen!=sh->obs_gen) {
+                gen = sh->obs_gen;
+                last_seq_num = -1;
+            }
+
+            /* Big jump backwards means the sender was reset */
+            if (last_seq_num>=0 && (long long)seq_num < last_seq_num-128) {
+                printf("guppi_net_thread:  Packet sequence number reset\n");
+                __sync_bool_compare_and_swap(&sh->reset_req, 0, 1);
+                while (sh->run && gen==sh->obs_gen) { sched_yield(); }
+                gen = sh->obs_gen;
+                last_seq_num = -1;
+            }
+            if ((long long)seq_num > last_seq_num) last_seq_num = seq_num;
+
+            /* Never go back to a block we have moved past */
+            blk = seq_num / sh->packets_per_block;
+            if (r->cur_gen==gen && blk<r->cur_blk) {
+                r->nlate++;
+                continue;
+            }
+            if (r->cur_gen!=gen || blk>r->cur_blk) {
+                /* All writes to older blocks are done */
+                __sync_synchronize();
+                r->cur_blk = blk;
+                r->cur_gen = gen;
+            }
+
+            /* Let the manager know how far ahead we are */
+            long long newest = sh->newest_blk;
+            while (blk>newest) {
+                if (__sync_bool_compare_and_swap(&sh->newest_blk,
+                            newest, blk)) break;
+                newest = sh->newest_blk;
+            }
+
+            guppi_net_clock_add(sh, gen, seq_num, &p->rx_time);
+            if (guppi_net_place(sh, gen, seq_num, p)==GUPPI_OK)
+                r->npkt++;
+            else
+                r->nlate++;
+        }
+    }
+
+    pthread_cleanup_pop(1); /* Frees pkts */
+    return(NULL);
+}
+
+/* Stop and clean up all receivers */
+static void guppi_net_multi_stop(struct guppi_net_shared *sh) {
+    int i;
+    sh->run = 0;
+    for (i=0; i<sh->nrecv; i++) {
+        if (sh->rx[i].thread_id==0) continue;
+        pthread_cancel(sh->rx[i].thread_id);
+        pthread_join(sh->rx[i].thread_id, NULL);
+        sh->rx[i].thread_id = 0;
+        guppi_udp_close(&sh->rx[i].up);
+    }
+    guppi_pktclock_free(&sh->clk);
+    pthread_mutex_destroy(&sh->clk_lock);
+    free(sh);
+}
+
+/* Total CPU time (sec) used by the receiver threads, and wall
+ * clock time.
+ */
+static void guppi_net_multi_times(struct guppi_net_shared *sh,
+        double *wall, double *cpu) {
+    struct timespec ts;
+    clockid_t cid;
+    int i;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *wall = (double)ts.tv_sec + 1e-9*(double)ts.tv_nsec;
+    *cpu = 0.0;
+    for (i=0; i<sh->nrecv; i++) {
+        if (sh->rx[i].thread_id==0) continue;
+        if (pthread_getcpuclockid(sh->rx[i].thread_id, &cid)) continue;
+        if (clock_gettime(cid, &ts)) continue;
+        *cpu += (double)ts.tv_sec + 1e-9*(double)ts.tv_nsec;
+    }
+}
+
+/* Put per-receiver stats in status buffer */
+static void guppi_net_multi_status(struct guppi_status *st,
+        struct guppi_net_shared *sh) {
+    int i;
+    char key[9];
+    guppi_status_lock_safe(st);
+    for (i=0; i<sh->nrecv; i++) {
+        sprintf(key, "RXPKT%d", i);
+        hputr8(st->buf, key, (double)sh->rx[i].npkt);
+        sprintf(key, "RXLATE%d", i);
+        hputr8(st->buf, key, (double)sh->rx[i].nlate);
+        sprintf(key, "RXBOG%d", i);
+        hputr8(st->buf, key, (double)sh->rx[i].nbogus);
+        sprintf(key, "RXKDR%d", i);
+        hputr8(st->buf, key, (double)sh->rx[i].kdrop);
+    }
+    guppi_status_unlock_safe(st);
+}
+
+/* Set up a window slot for the given block, waiting for the
+ * next databuf block to become free.
+ */
+static int guppi_net_open_block(struct guppi_status *st,
+        struct guppi_databuf *db, struct guppi_net_shared *sh,
+        long long blk, int *next_db_block, const char *status_buf) {
+    struct guppi_net_block *b = &sh->win[blk % sh->nwin];
+    int rv;
+    b->db_block = *next_db_block;
+    *next_db_block = (*next_db_block + 1) % db->n_block;
+    while ((rv=guppi_databuf_wait_free(db, b->db_block)) != GUPPI_OK) {
+        if (rv==GUPPI_TIMEOUT) {
+            guppi_status_lock_safe(st);
+            hputs(st->buf, STATUS_KEY, "blocked");
+            guppi_status_unlock_safe(st);
+            if (!run) return(GUPPI_ERR_SYS);
+            continue;
+        } else {
+            guppi_error("guppi_net_thread",
+                    "error waiting for free databuf");
+            return(GUPPI_ERR_SYS);
+        }
+    }
+    b->header = guppi_databuf_header(db, b->db_block);
+    b->data = guppi_databuf_data(db, b->db_block);
+    guppi_databuf_header_copy(db, b->db_block, status_buf, sh->hdr_changed);
+    sh->hdr_changed = 0;
+    b->valid = guppi_databuf_valid(db, b->db_block);
+    guppi_databuf_valid_reset(b->valid, sh->packets_per_block,
+            sh->packet_data_size);
+    b->got = b->valid->bits;
+    b->npkt = 0;
+    __sync_synchronize();
+    b->blk_idx = blk;
+    return(GUPPI_OK);
+}
+
+/* Take the block out of the window, wait for any receivers still
+ * copying, fill in the gaps if requested and hand it on.  Returns
+ * number of dropped packets.
+ */
+static unsigned guppi_net_close_block(struct guppi_databuf *db,
+        struct guppi_net_shared *sh, long long blk) {
+    struct guppi_net_block *b = &sh->win[blk % sh->nwin];
+    b->blk_idx = -1;
+    __sync_synchronize();
+    while (b->writers>0) { sched_yield(); }
+
+    const unsigned ndrop = sh->packets_per_block - b->npkt;
+    b->valid->nvalid = b->npkt;
+    if (sh->zero_fill) 
+        guppi_databuf_valid_zero(db, b->db_block);
+
+    hputi4(b->header, "PKTIDX", blk*sh->packets_per_block);
+    hputi4(b->header, "PKTSIZE", sh->packet_data_size);
+    hputi4(b->header, "NPKT", sh->packets_per_block);
+    hputi4(b->header, "NDROP", ndrop);
+    struct guppi_databuf_info *info = guppi_databuf_info(db, b->db_block);
+    info->pktidx = blk*sh->packets_per_block;
+    info->pktsize = sh->packet_data_size;
+    info->npkt = sh->packets_per_block;
+    info->ndrop = ndrop;
+    info->rx_time.tv_sec = info->rx_time.tv_nsec = 0;
+    guppi_databuf_set_filled(db, b->db_block);
+    return(ndrop);
+}
+
+void guppi_net_multi(struct guppi_status *st, struct guppi_databuf *db,
+        struct guppi_udp_params *up, char *status_buf,
+        unsigned packets_per_block, size_t packet_data_size,
+        int nrecv, int multiport, int zero_fill,
+        int tfit_n, int stt_round, double spec_per_packet, double tbin) {
+
+    /* Shared state */
+    struct guppi_net_shared *sh;
+    sh = (struct guppi_net_shared *)calloc(1, sizeof(struct guppi_net_shared));
+    if (sh==NULL) {
+        guppi_error("guppi_net_thread", "Error allocating receiver state");
+        pthread_exit(NULL);
+    }
+    pthread_cleanup_push((void *)guppi_net_multi_stop, sh);
+    int i, rv;
+    if (nrecv>GUPPI_NET_MAX_RECV) nrecv = GUPPI_NET_MAX_RECV;
+    sh->run = 1;
+    pthread_mutex_init(&sh->clk_lock, NULL);
+    sh->clk_gen = sh->clk_full_gen = -1;
+    sh->nrecv = nrecv;
+    sh->packets_per_block = packets_per_block;
+    sh->packet_data_size = packet_data_size;
+    sh->zero_fill = zero_fill;
+    sh->hdr_changed = 1;
+    sh->fmt = up->fmt;
+    sh->nwin = GUPPI_NET_WINDOW;
+    if (sh->nwin > db->n_block-1) sh->nwin = db->n_block-1;
+    if (sh->nwin < 1) {
+        guppi_error("guppi_net_thread", 
+                "Multi-receiver mode needs at least 2 databuf blocks");
+        pthread_exit(NULL);
+    }
+    sh->oldest_blk = -1;
+    sh->newest_blk = -1;
+    for (i=0; i<sh->nwin; i++) sh->win[i].blk_idx = -1;
+    if (guppi_pktclock_init(&sh->clk, tfit_n)!=GUPPI_OK)
+        pthread_exit(NULL);
+
+    /* Start receivers, each on its own socket */
+    for (i=0; i<nrecv; i++) {
+        struct guppi_net_receiver *r = &sh->rx[i];
+        r->id = i;
+        r->sh = sh;
+        r->cur_blk = -1;
+        r->up = *up;
+        if (multiport)
+            r->up.port = up->port + i;
+        else
+            r->up.reuseport = 1;
+        rv = guppi_udp_init(&r->up);
+        if (rv!=GUPPI_OK) {
+            guppi_error("guppi_net_thread", "Error opening UDP socket.");
+            pthread_exit(NULL);
+        }
+        rv = pthread_create(&r->thread_id, NULL, guppi_net_recv_thread, r);
+        if (rv) {
+            guppi_error("guppi_net_thread", "Error starting receiver.");
+            r->thread_id = 0;
+            guppi_udp_close(&r->up);
+            pthread_exit(NULL);
+        }
+    }
+    printf("guppi_net_thread: Started %d receivers.\n", nrecv);
+    guppi_status_lock_safe(st);
+    hdel(st->buf, "NETRXERR");
+    hputi4(st->buf, "NETTFIT", sh->clk.nmax);
+    hputi4(st->buf, "NETTRND", stt_round);
+    guppi_status_unlock_safe(st);
+
+    /* Counters */
+    unsigned long long npacket_total=0, ndropped_total=0;
+    unsigned long long kdrop=0, kdrop_last=0, kdrop_obs=0, kd;
+    long rxq, rxq_tot;
+    unsigned long long nwakeup, nwakeup_last=0;
+    double t_wall, t_cpu, t_wall_last, t_cpu_last;
+    guppi_net_multi_times(sh, &t_wall_last, &t_cpu_last);
+    unsigned ndrop;
+    double drop_frac_avg=0.0;
+    const double drop_lpf = 0.25;
+    int stt_imjd=0, stt_smjd=0, tfit_active=0;
+    double stt_offs=0.0;
+    long long stt_blk=-1;
+    struct timespec ts;
+
+    /* Manage the window of open blocks */
+    long long oldest=-1, newest, nskip, blk;
+    int next_db_block=0, new_obs=1, waiting=-1, done, any;
+    while (run) {
+
+        /* A receiver that stopped on an error loses its share of the
+         * packets, so stop, as the single-receiver mode does.
+         */
+        for (i=0; i<sh->nrecv; i++) 
+            if (sh->rx[i].error) break;
+        if (i<sh->nrecv) {
+            guppi_error("guppi_net_thread", "Receiver stopped on error");
+            guppi_status_lock_safe(st);
+            hputi4(st->buf, "NETRXERR", i);
+            hputs(st->buf, STATUS_KEY, "rxerror");
+            guppi_status_unlock_safe(st);
+            pthread_exit(NULL);
+        }
+
+        /* A receiver saw the packet count reset: close out everything
+         * and start over.
+         */
+        if (sh->reset_req) {
+            if (oldest>=0) {
+                for (blk=oldest; blk<oldest+sh->nwin; blk++)
+                    guppi_net_close_block(db, sh, blk);
+            }
+            oldest = -1;
+            sh->oldest_blk = -1;
+            sh->newest_blk = -1;
+            new_obs = 1;
+            __sync_synchronize();
+            sh->obs_gen++;
+            sh->reset_req = 0;
+            continue;
+        }
+
+        /* Wait for first packet */
+        if (oldest<0) {
+            if (sh->newest_blk<0) {
+                if (waiting!=1) {
+                    guppi_status_lock_safe(st);
+                    hputs(st->buf, STATUS_KEY, "waiting");
+                    guppi_status_unlock_safe(st);
+                    waiting=1;
+                }
+                usleep(1000);
+                pthread_testcancel();
+                continue;
+            }
+
+            /* New obs: reset counters, get start time from the
+             * first packet.  As in the single-receiver case this is
+             * refined once the arrival time fit is done.
+             */
+            if (new_obs) {
+                npacket_total=0;
+                ndropped_total=0;
+                kdrop_obs=kdrop;
+                ts.tv_sec = ts.tv_nsec = 0;
+                pthread_mutex_lock(&sh->clk_lock);
+                if (sh->clk_gen==sh->obs_gen && sh->clk.n>0) {
+                    ts.tv_sec = sh->clk.sec0;
+                    ts.tv_nsec = (long)(sh->clk.y[0]*1e9);
+                }
+                pthread_mutex_unlock(&sh->clk_lock);
+                tfit_active = ts.tv_sec!=0;
+                get_start_mjd(&ts, stt_round, !tfit_active,
+                        &stt_imjd, &stt_smjd, &stt_offs);
+                new_obs = 0;
+            }
+            guppi_status_lock_safe(st);
+            hputi4(st->buf, "STT_IMJD", stt_imjd);
+            hputi4(st->buf, "STT_SMJD", stt_smjd);
+            hputr8(st->buf, "STT_OFFS", stt_offs);
+            hputi4(st->buf, "STTVALID", 1);
+            hputs(st->buf, STATUS_KEY, "receiving");
+            sh->hdr_changed |= guppi_fitsbuf_update(status_buf, st->buf);
+            guppi_status_unlock_safe(st);
+            waiting=0;
+
+            oldest = sh->newest_blk;
+            stt_blk = oldest;
+            for (blk=oldest; blk<oldest+sh->nwin; blk++) {
+                rv = guppi_net_open_block(st, db, sh, blk, &next_db_block,
+                        status_buf);
+                if (rv!=GUPPI_OK) pthread_exit(NULL);
+            }
+            sh->oldest_blk = oldest;
+            continue;
+        }
+
+        /* Arrival time fit done: fix up the start time */
+        if (tfit_active && sh->clk_full_gen==sh->obs_gen) {
+            double resid;
+            tfit_active = 0;
+            pthread_mutex_lock(&sh->clk_lock);
+            const struct guppi_pktclock clk = sh->clk;
+            /* A packet arrives once its last sample is taken, so the
+             * data in the first packet starts when the one before it
+             * arrives.
+             */
+            guppi_pktclock_time(&clk, stt_blk*packets_per_block - 1, &ts);
+            pthread_mutex_unlock(&sh->clk_lock);
+            resid = get_start_mjd(&ts, stt_round, 1,
+                    &stt_imjd, &stt_smjd, &stt_offs);
+            guppi_status_lock_safe(st);
+            hputi4(st->buf, "STT_IMJD", stt_imjd);
+            hputi4(st->buf, "STT_SMJD", stt_smjd);
+            hputr8(st->buf, "STT_OFFS", stt_offs);
+            hputi4(st->buf, "NETTFITN", clk.nfit);
+            hputr8(st->buf, "NETPKTDT", clk.dt);
+            hputr8(st->buf, "NETTRES", resid);
+            hputr8(st->buf, "NETTJIT", clk.rms);
+            hputr8(st->buf, "NETTJMAX", clk.max);
+            if (spec_per_packet>0.0) {
+                hputr8(st->buf, "NETTBIN", clk.dt/spec_per_packet);
+                if (tbin>0.0)
+                    hputr8(st->buf, "NETCLKER", 1e6 * 
+                            (clk.dt/spec_per_packet/tbin - 1.0));
+            }
+            sh->hdr_changed |= guppi_fitsbuf_update(status_buf, st->buf);
+            guppi_status_unlock_safe(st);
+
+            /* Fix up the first block's header if it is still open.
+             * Its text no longer matches any other block's.
+             */
+            if (stt_blk>=oldest && stt_blk<oldest+sh->nwin) {
+                struct guppi_net_block *b = &sh->win[stt_blk % sh->nwin];
+                hputi4(b->header, "STT_IMJD", stt_imjd);
+                hputi4(b->header, "STT_SMJD", stt_smjd);
+                hputr8(b->header, "STT_OFFS", stt_offs);
+                guppi_databuf_info(db, b->db_block)->hdr_seq = 0;
+            } else
+                guppi_warn("guppi_net_thread", 
+                        "Start time fit done after first block was filled");
+        }
+
+        /* Receivers have jumped more than a window ahead: close out
+         * the window and reopen it at the newest block.  The blocks
+         * in between are counted as dropped rather than filled one
+         * at a time.
+         */
+        newest = sh->newest_blk;
+        if (newest >= oldest + 2*sh->nwin) {
+            for (blk=oldest; blk<oldest+sh->nwin; blk++) {
+                ndrop = guppi_net_close_block(db, sh, blk);
+                npacket_total += packets_per_block;
+                ndropped_total += ndrop;
+                drop_frac_avg = (1.0-drop_lpf)*drop_frac_avg
+                    + drop_lpf*(double)ndrop/(double)packets_per_block;
+            }
+            nskip = newest - sh->nwin + 1 - blk;
+            npacket_total += nskip*packets_per_block;
+            ndropped_total += nskip*packets_per_block;
+            drop_frac_avg = 1.0 - (1.0-drop_frac_avg)*pow(1.0-drop_lpf, nskip);
+            oldest = newest - sh->nwin + 1;
+            sh->oldest_blk = oldest;
+            for (blk=oldest; blk<=newest; blk++) {
+                rv = guppi_net_open_block(st, db, sh, blk, &next_db_block,
+                        status_buf);
+                if (rv!=GUPPI_OK) pthread_exit(NULL);
+            }
+            continue;
+        }
+
+        /* Oldest block is done once every active receiver has moved
+         * past it, or someone needs its window slot.
+         */
+        done=1; any=0;
+        for (i=0; i<sh->nrecv; i++) {
+            if (sh->rx[i].cur_gen!=sh->obs_gen || sh->rx[i].cur_blk<0)
+                continue;
+            any=1;
+            if (sh->rx[i].cur_blk<=oldest) done=0;
+        }
+        if (!any) done=0;
+        if (sh->newest_blk >= oldest + sh->nwin) done=1;
+        if (!done) {
+            usleep(100);
+            pthread_testcancel();
+            continue;
+        }
+
+        /* Close oldest block, update drop stats */
+        ndrop = guppi_net_close_block(db, sh, oldest);
+        npacket_total += packets_per_block;
+        ndropped_total += ndrop;
+        drop_frac_avg = (1.0-drop_lpf)*drop_frac_avg
+            + drop_lpf*(double)ndrop/(double)packets_per_block;
+        kdrop=0; rxq_tot=0; nwakeup=0;
+        for (i=0; i<sh->nrecv; i++) {
+            guppi_udp_kernel_stats(&sh->rx[i].up, &kd, &rxq);
+            sh->rx[i].kdrop = kd;
+            kdrop += kd;
+            if (rxq>0) rxq_tot += rxq;
+            nwakeup += sh->rx[i].up.nwakeup;
+        }
+        guppi_net_multi_times(sh, &t_wall, &t_cpu);
+        guppi_status_lock_safe(st);
+        hputr8(st->buf, "DROPAVG", drop_frac_avg);
+        hputr8(st->buf, "DROPTOT",
+                npacket_total ?
+                (double)ndropped_total/(double)npacket_total
+                : 0.0);
+        hputr8(st->buf, "DROPBLK",
+                (double)ndrop/(double)packets_per_block);
+        hputr8(st->buf, "KDROPBLK",
+                (double)(kdrop-kdrop_last)/(double)packets_per_block);
+        hputr8(st->buf, "KDROPTOT",
+                npacket_total ?
+                (double)(kdrop-kdrop_obs)/(double)npacket_total
+                : 0.0);
+        hputi4(st->buf, "NETRXQ", rxq_tot);
+        if (t_wall > t_wall_last) {
+            hputr8(st->buf, "NETCPU",
+                    100.0*(t_cpu-t_cpu_last)/(t_wall-t_wall_last));
+            hputr8(st->buf, "NETWAKE",
+                    (double)(nwakeup-nwakeup_last)/(t_wall-t_wall_last));
+        }
+        kdrop_last = kdrop;
+        nwakeup_last = nwakeup;
+        t_wall_last = t_wall;
+        t_cpu_last = t_cpu;
+        sh->hdr_changed |= guppi_fitsbuf_update(status_buf, st->buf);
+        guppi_status_unlock_safe(st);
+        guppi_net_multi_status(st, sh);
+
+        /* Reuse its window slot for the next block */
+        oldest++;
+        sh->oldest_blk = oldest;
+        rv = guppi_net_open_block(st, db, sh, oldest+sh->nwin-1,
+                &next_db_block, status_buf);
+        if (rv!=GUPPI_OK) pthread_exit(NULL);
+
+        pthread_testcancel();
+    }
+
+    pthread_exit(NULL);
+
+    pthread_cleanup_pop(0); /* Closes guppi_net_multi_stop */
+}
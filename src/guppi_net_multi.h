@@ -0,0 +1,87 @@
+/* guppi_net_multi.h
+ *
+ * Multi-threaded packet receive for guppi_net_thread.  A set
+ * of receiver sub-threads, each with its own socket, place packets
+ * straight into a small window of open databuf blocks.  The net
+ * thread itself manages the window, opening new blocks and closing
+ * (marking filled) old ones once every receiver is done with them.
+ */
+#ifndef _GUPPI_NET_MULTI_H
+#define _GUPPI_NET_MULTI_H
+
+#include <pthread.h>
+
+#include "guppi_udp.h"
+#include "guppi_databuf.h"
+#include "guppi_status.h"
+#include "guppi_time.h"
+
+#define GUPPI_NET_MAX_RECV 8
+#define GUPPI_NET_WINDOW 4 /* Max blocks open at one time */
+
+/* One open databuf block.  Receivers bump "writers" around each
+ * packet copy so the manager knows when a closed block is quiet.
+ */
+struct guppi_net_block {
+    volatile long long blk_idx; /* Packet block index held, -1=closed */
+    int db_block;               /* Databuf block id */
+    char *header;               /* Databuf block header */
+    char *data;                 /* Databuf block data */
+    volatile int writers;       /* Receivers copying into block now */
+    volatile int npkt;          /* Packets received into block */
+    struct guppi_databuf_valid *valid; /* Block's validity map */
+    unsigned long long *got;    /* Bitmap of received packets */
+};
+
+struct guppi_net_shared;
+
+/* Per-receiver state */
+struct guppi_net_receiver {
+    int id;
+    pthread_t thread_id;
+    struct guppi_udp_params up;     /* This receiver's socket */
+    struct guppi_net_shared *sh;    /* Shared state */
+    volatile long long cur_blk;     /* Newest block written to */
+    volatile int cur_gen;           /* Obs generation of cur_blk */
+    volatile unsigned long long npkt;   /* Packets placed */
+    volatile unsigned long long nlate;  /* Packets too late to place */
+    volatile unsigned long long nbogus; /* Packets of wrong size */
+    unsigned long long kdrop;           /* Packets dropped by kernel */
+    volatile int error;                 /* Stopped on a receive error */
+};
+
+/* State shared by manager and all receivers */
+struct guppi_net_shared {
+    volatile int run;
+    unsigned packets_per_block;
+    size_t packet_data_size;
+    int zero_fill;                      /* Zero missing packets */
+    struct guppi_pktfmt fmt;            /* Packet format */
+    int nwin;                           /* Blocks in window */
+    struct guppi_net_block win[GUPPI_NET_WINDOW];
+    volatile long long oldest_blk;      /* Oldest open block, -1=none */
+    volatile long long newest_blk;      /* Newest block any rcvr saw */
+    volatile int obs_gen;               /* Bumped on each new obs */
+    volatile int reset_req;             /* Rcvr saw seq num reset */
+    int nrecv;
+    struct guppi_net_receiver rx[GUPPI_NET_MAX_RECV];
+    int hdr_changed;                    /* Status text changed */
+    pthread_mutex_t clk_lock;           /* Guards clk, clk_gen */
+    struct guppi_pktclock clk;          /* Arrival time fit */
+    int clk_gen;                        /* Obs generation clk is for */
+    volatile int clk_full_gen;          /* Generation whose fit is done */
+};
+
+/* Run the net thread in multi-receiver mode.  Never returns;
+ * exits the calling thread when done.  The start time comes from
+ * a fit to the arrival of the first tfit_n packets, as in single-
+ * receiver mode; spec_per_packet and tbin are only used to report
+ * the fitted sample clock.
+ */
+void guppi_net_multi(struct guppi_status *st, struct guppi_databuf *db,
+        struct guppi_udp_params *up, char *status_buf,
+        unsigned packets_per_block, size_t packet_data_size,
+        int nrecv, int multiport, int zero_fill,
+        int tfit_n, int stt_round, double spec_per_packet, double tbin);
+
+#endif
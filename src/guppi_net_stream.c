@@ -0,0 +1,488 @@
+/* guppi_net_stream.c
+ *
+ * Merge several sub-band packet streams into one databuf.  See
+ * guppi_net_stream.h.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "fitshead.h"
+#include "guppi_error.h"
+#include "guppi_status.h"
+#include "guppi_databuf.h"
+#include "guppi_udp.h"
+#include "guppi_time.h"
+#include "guppi_net_stream.h"
+
+#define STATUS_KEY "NETSTAT"  /* Define before guppi_threads.h */
+#include "guppi_threads.h"
+
+/* Everything the merge loop needs */
+struct guppi_net_stream_state {
+    int nstream;
+    struct guppi_net_stream s[GUPPI_NET_MAX_STREAM];
+    struct pollfd pfd[GUPPI_NET_MAX_STREAM];
+    struct guppi_udp_packet *pkts;  /* Batch buffer */
+    int batch_size;
+    struct guppi_pktfmt fmt;        /* Packet format (all streams) */
+    unsigned packets_per_block;     /* Slots per block */
+    size_t slot_size;               /* Block bytes per slot */
+    size_t spec_size;               /* Bytes per full-band spectrum */
+    size_t sub_size;                /* Bytes per sub-band spectrum */
+    unsigned nspec;                 /* Spectra per packet */
+    int zero_fill;
+    int hdr_changed;                /* Status text changed */
+
+    /* Window of open blocks */
+    long long oldest;               /* Oldest open block, -1=none */
+    long long blk_idx[GUPPI_NET_STREAM_WINDOW];
+    int db_block[GUPPI_NET_STREAM_WINDOW];
+    char *header[GUPPI_NET_STREAM_WINDOW];
+    char *data[GUPPI_NET_STREAM_WINDOW];
+    struct guppi_databuf_valid *valid[GUPPI_NET_STREAM_WINDOW];
+    int next_db_block;
+
+    /* Merged drop stats */
+    unsigned long long npacket_total, ndropped_total;
+    double drop_frac_avg;
+};
+
+/* Close all sockets and free everything */
+static void guppi_net_stream_stop(struct guppi_net_stream_state *ss) {
+    int i, w;
+    for (i=0; i<ss->nstream; i++) {
+        if (ss->s[i].up.sock>=0) guppi_udp_close(&ss->s[i].up);
+        for (w=0; w<GUPPI_NET_STREAM_WINDOW; w++)
+            if (ss->s[i].got[w]!=NULL) free(ss->s[i].got[w]);
+    }
+    if (ss->pkts!=NULL) free(ss->pkts);
+    free(ss);
+}
+
+/* Put per-stream stats in status buffer */
+static void guppi_net_stream_status(struct guppi_status *st,
+        struct guppi_net_stream_state *ss) {
+    int i;
+    char key[9];
+    long rxq, rxq_tot=0;
+    for (i=0; i<ss->nstream; i++) {
+        guppi_udp_kernel_stats(&ss->s[i].up, &ss->s[i].kdrop, &rxq);
+        if (rxq>0) rxq_tot += rxq;
+    }
+    guppi_status_lock_safe(st);
+    for (i=0; i<ss->nstream; i++) {
+        struct guppi_net_stream *s = &ss->s[i];
+        sprintf(key, "STRPKT%d", i);
+        hputr8(st->buf, key, (double)s->npkt);
+        sprintf(key, "STRDBLK%d", i);
+        hputr8(st->buf, key,
+                (double)s->ndrop_block/(double)ss->packets_per_block);
+        sprintf(key, "STRDTOT%d", i);
+        hputr8(st->buf, key, s->nslot_obs ?
+                (double)s->ndrop_obs/(double)s->nslot_obs : 0.0);
+        sprintf(key, "STRLATE%d", i);
+        hputr8(st->buf, key, (double)s->nlate);
+        sprintf(key, "STRBOG%d", i);
+        hputr8(st->buf, key, (double)s->nbogus);
+        sprintf(key, "STRKDR%d", i);
+        hputr8(st->buf, key, (double)s->kdrop);
+    }
+    hputi4(st->buf, "NETRXQ", rxq_tot);
+    guppi_status_unlock_safe(st);
+}
+
+/* Set up a window slot for the given block, waiting for the
+ * next databuf block to become free.
+ */
+static int guppi_net_stream_open(struct guppi_status *st,
+        struct guppi_databuf *db, struct guppi_net_stream_state *ss,
+        long long blk, const char *status_buf) {
+    const int w = blk % GUPPI_NET_STREAM_WINDOW;
+    const size_t got_size = sizeof(unsigned long long)
+        * ((ss->packets_per_block + 63) / 64);
+    int i, rv;
+    ss->db_block[w] = ss->next_db_block;
+    ss->next_db_block = (ss->next_db_block + 1) % db->n_block;
+    while ((rv=guppi_databuf_wait_free(db, ss->db_block[w])) != GUPPI_OK) {
+        if (rv==GUPPI_TIMEOUT) {
+            guppi_status_lock_safe(st);
+            hputs(st->buf, STATUS_KEY, "blocked");
+            guppi_status_unlock_safe(st);
+            if (!run) return(GUPPI_ERR_SYS);
+            continue;
+        } else {
+            guppi_error("guppi_net_thread",
+                    "error waiting for free databuf");
+            return(GUPPI_ERR_SYS);
+        }
+    }
+    ss->header[w] = guppi_databuf_header(db, ss->db_block[w]);
+    ss->data[w] = guppi_databuf_data(db, ss->db_block[w]);
+    guppi_databuf_header_copy(db, ss->db_block[w], status_buf, 
+            ss->hdr_changed);
+    ss->hdr_changed = 0;
+    ss->valid[w] = guppi_databuf_valid(db, ss->db_block[w]);
+    guppi_databuf_valid_reset(ss->valid[w], ss->packets_per_block,
+            ss->slot_size);
+    for (i=0; i<ss->nstream; i++)
+        memset(ss->s[i].got[w], 0, got_size);
+    ss->blk_idx[w] = blk;
+    return(GUPPI_OK);
+}
+
+/* Work out the block's validity map from the streams' maps, fill
+ * in missing sub-bands if requested and hand it on.  Updates the
+ * drop stats, and status_buf from the status buffer.
+ */
+static void guppi_net_stream_close(struct guppi_status *st,
+        struct guppi_databuf *db, struct guppi_net_stream_state *ss,
+        long long blk, char *status_buf) {
+    const int w = blk % GUPPI_NET_STREAM_WINDOW;
+    const unsigned ppb = ss->packets_per_block;
+    const unsigned nword = (ppb + 63) / 64;
+    const double drop_lpf = 0.25;
+    struct guppi_databuf_valid *v = ss->valid[w];
+    unsigned long long bits;
+    unsigned i, k, n, j;
+    if (ss->blk_idx[w]!=blk) return;
+
+    /* A slot is valid once all streams are in */
+    for (k=0; k<nword; k++) {
+        bits = ~0ULL;
+        for (i=0; i<ss->nstream; i++) bits &= ss->s[i].got[w][k];
+        v->bits[k] = bits;
+    }
+
+    /* Per-stream drops, zero any missing sub-bands */
+    for (i=0; i<ss->nstream; i++) {
+        struct guppi_net_stream *s = &ss->s[i];
+        for (k=0, n=0; k<nword; k++) n += __builtin_popcountll(s->got[w][k]);
+        s->ndrop_block = ppb - n;
+        s->ndrop_obs += ppb - n;
+        s->nslot_obs += ppb;
+        if (!ss->zero_fill || n==ppb) continue;
+        for (k=0; k<ppb; k++) {
+            if (s->got[w][k/64] & (1ULL<<(k%64))) continue;
+            char *out = ss->data[w] + k*ss->slot_size + s->offset;
+            for (j=0; j<ss->nspec; j++)
+                memset(out + j*ss->spec_size, 0, ss->sub_size);
+        }
+    }
+    for (k=0, n=0; k<nword; k++) n += __builtin_popcountll(v->bits[k]);
+    const unsigned ndrop = ppb - n;
+    v->nvalid = n;
+    v->zeroed = ss->zero_fill;
+
+    hputi4(ss->header[w], "PKTIDX", blk*ppb);
+    hputi4(ss->header[w], "PKTSIZE", ss->slot_size);
+    hputi4(ss->header[w], "NPKT", ppb);
+    hputi4(ss->header[w], "NDROP", ndrop);
+    struct guppi_databuf_info *info = guppi_databuf_info(db, ss->db_block[w]);
+    info->pktidx = blk*ppb;
+    info->pktsize = ss->slot_size;
+    info->npkt = ppb;
+    info->ndrop = ndrop;
+    info->rx_time.tv_sec = info->rx_time.tv_nsec = 0;
+    guppi_databuf_set_filled(db, ss->db_block[w]);
+    ss->blk_idx[w] = -1;
+
+    ss->npacket_total += ppb;
+    ss->ndropped_total += ndrop;
+    ss->drop_frac_avg = (1.0-drop_lpf)*ss->drop_frac_avg
+        + drop_lpf*(double)ndrop/(double)ppb;
+    guppi_status_lock_safe(st);
+    hputr8(st->buf, "DROPAVG", ss->drop_frac_avg);
+    hputr8(st->buf, "DROPTOT",
+            (double)ss->ndropped_total/(double)ss->npacket_total);
+    hputr8(st->buf, "DROPBLK", (double)ndrop/(double)ppb);
+    ss->hdr_changed |= guppi_fitsbuf_update(status_buf, st->buf);
+    guppi_status_unlock_safe(st);
+    guppi_net_stream_status(st, ss);
+}
+
+/* Move the window on so that blk is its newest block */
+static int guppi_net_stream_advance(struct guppi_status *st,
+        struct guppi_databuf *db, struct guppi_net_stream_state *ss,
+        long long blk, char *status_buf) {
+    const long long first = blk - GUPPI_NET_STREAM_WINDOW + 1;
+    long long b;
+    for (b=ss->oldest; b<ss->oldest+GUPPI_NET_STREAM_WINDOW && b<first; b++)
+        guppi_net_stream_close(st, db, ss, b, status_buf);
+    b = ss->oldest + GUPPI_NET_STREAM_WINDOW;
+    if (b<first) b = first;
+    ss->oldest = first;
+    for (; b<=blk; b++)
+        if (guppi_net_stream_open(st, db, ss, b, status_buf)!=GUPPI_OK)
+            return(GUPPI_ERR_SYS);
+    return(GUPPI_OK);
+}
+
+void guppi_net_stream(struct guppi_status *st, struct guppi_databuf *db,
+        struct guppi_udp_params *up, char *status_buf, int block_size,
+        int nstream, int nchan, int npol, int nbits, int zero_fill) {
+
+    struct guppi_net_stream_state *ss;
+    ss = (struct guppi_net_stream_state *)calloc(1,
+            sizeof(struct guppi_net_stream_state));
+    if (ss==NULL) {
+        guppi_error("guppi_net_thread", "Error allocating stream state");
+        pthread_exit(NULL);
+    }
+    int i, j, n, rv, w;
+    char key[9], msg[256];
+    if (nstream>GUPPI_NET_MAX_STREAM) nstream = GUPPI_NET_MAX_STREAM;
+    for (i=0; i<GUPPI_NET_MAX_STREAM; i++) ss->s[i].up.sock = -1;
+    ss->nstream = nstream;
+    pthread_cleanup_push((void *)guppi_net_stream_stop, ss);
+
+    /* Sub-band sizes.  Streams are merged spectrum by spectrum, so
+     * this only works for formats whose data needs no conversion.
+     */
+    ss->fmt = up->fmt;
+    ss->zero_fill = zero_fill;
+    ss->hdr_changed = 1;
+    ss->batch_size = up->batch_size;
+    const int sub_nchan = nchan / nstream;
+    ss->spec_size = (size_t)nchan * npol * nbits / 8;
+    ss->sub_size = (size_t)sub_nchan * npol * nbits / 8;
+    if (ss->fmt.layout!=GUPPI_PKTFMT_NATIVE || sub_nchan*nstream!=nchan
+            || ss->sub_size==0 || ss->fmt.data_size % ss->sub_size) {
+        sprintf(msg, "Can not split %d channels into %d streams of %s "
+                "packets", nchan, nstream, ss->fmt.name);
+        guppi_error("guppi_net_thread", msg);
+        pthread_exit(NULL);
+    }
+    ss->nspec = ss->fmt.data_size / ss->sub_size;
+    ss->slot_size = ss->nspec * ss->spec_size;
+    ss->packets_per_block = block_size / ss->slot_size;
+    if (ss->packets_per_block==0 || ss->packets_per_block
+            > (unsigned)guppi_databuf_valid_max(db)) {
+        guppi_error("guppi_net_thread",
+                "BLOCSIZE does not suit multi-stream packets");
+        pthread_exit(NULL);
+    }
+    ss->pkts = (struct guppi_udp_packet *)malloc(
+            sizeof(struct guppi_udp_packet) * ss->batch_size);
+    if (ss->pkts==NULL) {
+        guppi_error("guppi_net_thread", "Error allocating packet batch");
+        pthread_exit(NULL);
+    }
+
+    /* Open one socket per stream.  STRHOSTn and STRPORTn give each
+     * stream's sender and port (defaults DATAHOST and DATAPORT+n),
+     * STRCHANn its first channel (default n*nchan/nstream).
+     */
+    for (i=0; i<nstream; i++) {
+        struct guppi_net_stream *s = &ss->s[i];
+        s->up = *up;
+        s->up.busy_poll = 0;
+        s->up.port = up->port + i;
+        s->chan_offset = i * sub_nchan;
+        sprintf(key, "STRHOST%d", i);
+        hgets(status_buf, key, sizeof(s->up.sender), s->up.sender);
+        sprintf(key, "STRPORT%d", i);
+        hgeti4(status_buf, key, &s->up.port);
+        sprintf(key, "STRCHAN%d", i);
+        hgeti4(status_buf, key, &s->chan_offset);
+        if (s->chan_offset<0 || s->chan_offset+sub_nchan>nchan) {
+            sprintf(msg, "Bad channel offset %d for stream %d",
+                    s->chan_offset, i);
+            guppi_error("guppi_net_thread", msg);
+            pthread_exit(NULL);
+        }
+        s->offset = (size_t)s->chan_offset * npol * nbits / 8;
+        s->last_seq = -1;
+        s->synced = 1;
+        for (w=0; w<GUPPI_NET_STREAM_WINDOW; w++) {
+            s->got[w] = (unsigned long long *)calloc(
+                    (ss->packets_per_block + 63) / 64,
+                    sizeof(unsigned long long));
+            if (s->got[w]==NULL) {
+                guppi_error("guppi_net_thread", "Error allocating bitmap");
+                pthread_exit(NULL);
+            }
+        }
+        rv = guppi_udp_init(&s->up);
+        if (rv!=GUPPI_OK) {
+            s->up.sock = -1;
+            guppi_error("guppi_net_thread", "Error opening UDP socket.");
+            pthread_exit(NULL);
+        }
+        ss->pfd[i] = s->up.pfd;
+        printf("guppi_net_thread: Stream %d from %s:%d, channels %d-%d\n",
+                i, s->up.sender, s->up.port,
+                s->chan_offset, s->chan_offset+sub_nchan-1);
+    }
+    guppi_status_lock_safe(st);
+    hputi4(st->buf, "NETNSTRM", nstream);
+    guppi_status_unlock_safe(st);
+
+    ss->oldest = -1;
+    for (w=0; w<GUPPI_NET_STREAM_WINDOW; w++) ss->blk_idx[w] = -1;
+    int new_obs=1, waiting=-1, done, any;
+    int stt_imjd=0, stt_smjd=0;
+    double stt_offs=0.0;
+    unsigned long long seq_num;
+    long long blk, b;
+    struct guppi_udp_packet *p;
+    while (run) {
+
+        rv = poll(ss->pfd, nstream, 1000); /* Timeout 1sec */
+        if (rv<0) {
+            if (errno==EINTR) continue;
+            guppi_error("guppi_net_thread", "poll returned error");
+            perror("poll");
+            pthread_exit(NULL);
+        }
+        if (rv==0) {
+            if (waiting!=1) {
+                guppi_status_lock_safe(st);
+                hputs(st->buf, STATUS_KEY, "waiting");
+                guppi_status_unlock_safe(st);
+                waiting=1;
+            }
+            continue;
+        }
+
+        for (i=0; i<nstream; i++) {
+            if ((ss->pfd[i].revents & POLLIN)==0) continue;
+            struct guppi_net_stream *s = &ss->s[i];
+            n = guppi_udp_recv_batch(&s->up, ss->pkts, ss->batch_size);
+            if (n<0) {
+                guppi_error("guppi_net_thread",
+                        "guppi_udp_recv_batch returned error");
+                perror("guppi_udp_recv_batch");
+                pthread_exit(NULL);
+            }
+
+            for (j=0; j<n; j++) {
+                p = &ss->pkts[j];
+                if (p->packet_size!=s->up.packet_size) {
+                    s->nbogus++;
+                    continue;
+                }
+                seq_num = ss->fmt.seq_num(&ss->fmt, p);
+
+                /* Big jump backwards means the senders were reset.
+                 * The first stream to see it starts a new obs, and
+                 * the others are ignored until they reset too.
+                 */
+                if (s->last_seq>=0 && (long long)seq_num < s->last_seq-128) {
+                    if (s->synced) {
+                        printf("guppi_net_thread:  Packet sequence number "
+                                "reset\n");
+                        if (ss->oldest>=0)
+                            for (b=ss->oldest;
+                                    b<ss->oldest+GUPPI_NET_STREAM_WINDOW; b++)
+                                guppi_net_stream_close(st, db, ss, b,
+                                        status_buf);
+                        ss->oldest = -1;
+                        new_obs = 1;
+                        for (w=0; w<nstream; w++) ss->s[w].synced = 0;
+                    }
+                    s->synced = 1;
+                    s->last_seq = -1;
+                }
+                if ((long long)seq_num > s->last_seq) s->last_seq = seq_num;
+                if (!s->synced) continue;
+
+                /* First packet: new obs, open the window */
+                blk = seq_num / ss->packets_per_block;
+                if (ss->oldest<0) {
+                    if (new_obs) {
+                        ss->npacket_total = ss->ndropped_total = 0;
+                        for (w=0; w<nstream; w++)
+                            ss->s[w].ndrop_obs = ss->s[w].nslot_obs = 0;
+                        if (p->rx_time.tv_sec!=0)
+                            get_mjd_from_timespec(&p->rx_time,
+                                    &stt_imjd, &stt_smjd, &stt_offs);
+                        else
+                            get_current_mjd(&stt_imjd, &stt_smjd, &stt_offs);
+                        if (stt_offs>0.5) { stt_smjd+=1; stt_offs-=1.0; }
+                        if (fabs(stt_offs)>0.1) {
+                            sprintf(msg,
+                                    "Second fraction = %3.1f ms > +/-100 ms",
+                                    stt_offs*1e3);
+                            guppi_warn("guppi_net_thread", msg);
+                        }
+                        stt_offs = 0.0;
+                        new_obs = 0;
+                    }
+                    guppi_status_lock_safe(st);
+                    hputi4(st->buf, "STT_IMJD", stt_imjd);
+                    hputi4(st->buf, "STT_SMJD", stt_smjd);
+                    hputr8(st->buf, "STT_OFFS", stt_offs);
+                    hputi4(st->buf, "STTVALID", 1);
+                    hputs(st->buf, STATUS_KEY, "receiving");
+                    ss->hdr_changed |= guppi_fitsbuf_update(status_buf, st->buf);
+                    guppi_status_unlock_safe(st);
+                    waiting=0;
+                    ss->oldest = blk;
+                    for (b=blk; b<blk+GUPPI_NET_STREAM_WINDOW; b++)
+                        if (guppi_net_stream_open(st, db, ss, b,
+                                    status_buf)!=GUPPI_OK)
+                            pthread_exit(NULL);
+                }
+
+                if (blk < ss->oldest) {
+                    s->nlate++;
+                    continue;
+                }
+                if (blk >= ss->oldest + GUPPI_NET_STREAM_WINDOW) {
+                    if (guppi_net_stream_advance(st, db, ss, blk,
+                                status_buf)!=GUPPI_OK)
+                        pthread_exit(NULL);
+                }
+
+                /* Copy each spectrum to its place in the slot */
+                w = blk % GUPPI_NET_STREAM_WINDOW;
+                const unsigned idx = seq_num - blk*ss->packets_per_block;
+                const unsigned long long bit = 1ULL << (idx%64);
+                if (s->got[w][idx/64] & bit) continue;
+                s->got[w][idx/64] |= bit;
+                const char *in = guppi_udp_packet_data(p);
+                char *out = ss->data[w] + idx*ss->slot_size + s->offset;
+                unsigned k;
+                for (k=0; k<ss->nspec; k++)
+                    memcpy(out + k*ss->spec_size, in + k*ss->sub_size,
+                            ss->sub_size);
+                s->npkt++;
+            }
+        }
+
+        /* Oldest block is done once every stream that is sending
+         * has moved past it.
+         */
+        if (ss->oldest>=0) {
+            done=1; any=0;
+            for (i=0; i<nstream; i++) {
+                if (!ss->s[i].synced || ss->s[i].last_seq<0) continue;
+                any=1;
+                if (ss->s[i].last_seq <
+                        (ss->oldest+1)*(long long)ss->packets_per_block)
+                    done=0;
+            }
+            if (any && done) {
+                if (guppi_net_stream_advance(st, db, ss,
+                            ss->oldest+GUPPI_NET_STREAM_WINDOW,
+                            status_buf)!=GUPPI_OK)
+                    pthread_exit(NULL);
+            }
+        }
+
+        pthread_testcancel();
+    }
+
+    pthread_exit(NULL);
+
+    pthread_cleanup_pop(0); /* Closes guppi_net_stream_stop */
+}
@@ -0,0 +1,51 @@
+/* guppi_net_stream.h
+ *
+ * Multi-stream packet receive for guppi_net_thread.  Split-band
+ * backends send each sub-band from a different board, each to its
+ * own port.  In this mode the net thread takes packets from all of
+ * the streams and merges them into one databuf block, with each
+ * stream's channels put at their offset within every spectrum, so
+ * the block looks like it came from a single full-band sender.
+ *
+ * Streams must share a packet count (ie, a common sync), so packet
+ * n from every stream covers the same spectra.  Each slot in the
+ * block holds packet n from all streams; it is marked valid once
+ * every stream's packet is in.  With zero-filling on, only the
+ * missing sub-bands of a slot are zeroed.
+ */
+#ifndef _GUPPI_NET_STREAM_H
+#define _GUPPI_NET_STREAM_H
+
+#include "guppi_udp.h"
+#include "guppi_databuf.h"
+#include "guppi_status.h"
+
+#define GUPPI_NET_MAX_STREAM 8
+#define GUPPI_NET_STREAM_WINDOW 2 /* Max blocks open at one time */
+
+/* Per-stream state */
+struct guppi_net_stream {
+    struct guppi_udp_params up;     /* This stream's socket */
+    int chan_offset;                /* First channel of the sub-band */
+    size_t offset;                  /* Byte offset in each spectrum */
+    long long last_seq;             /* Newest seq num, -1=none yet */
+    int synced;                     /* Seq count is the current obs */
+    unsigned long long *got[GUPPI_NET_STREAM_WINDOW]; /* Rcvd bitmaps */
+    unsigned long long npkt;        /* Packets placed */
+    unsigned long long nlate;       /* Packets too late to place */
+    unsigned long long nbogus;      /* Packets of wrong size */
+    unsigned long long kdrop;       /* Packets dropped by kernel */
+    unsigned long long ndrop_obs;   /* Packets missing, this obs */
+    unsigned long long nslot_obs;   /* Packets expected, this obs */
+    unsigned ndrop_block;           /* Packets missing, last block */
+};
+
+/* Run the net thread in multi-stream mode.  nstream streams each
+ * carry nchan/nstream of the nchan channels.  Never returns; exits
+ * the calling thread when done.
+ */
+void guppi_net_stream(struct guppi_status *st, struct guppi_databuf *db,
+        struct guppi_udp_params *up, char *status_buf, int block_size,
+        int nstream, int nchan, int npol, int nbits, int zero_fill);
+
+#endif
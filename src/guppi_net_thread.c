@@ -13,6 +13,7 @@
 #include <pthread.h>
 #include <signal.h>
 #include <sched.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/types.h>
@@ -24,7 +25,11 @@
 #include "guppi_status.h"
 #include "guppi_databuf.h"
 #include "guppi_udp.h"
+#include "guppi_parkes.h"
+#include "guppi_replay.h"
 #include "guppi_time.h"
+#include "guppi_net_multi.h"
+#include "guppi_net_stream.h"
 
 #define STATUS_KEY "NETSTAT"  /* Define before guppi_threads.h */
 #include "guppi_threads.h"
@@ -34,6 +39,60 @@ extern void guppi_read_obs_params(char *buf,
                                   struct guppi_params *g, 
                                   struct psrfits *p);
 
+/* Fill in final packet counts for a block, mark it filled, and
+ * update the drop stats in the status buffer.
+ */
+static void guppi_net_finish_block(struct guppi_status *st, 
+        struct guppi_databuf *db, int block, 
+        unsigned long long block_seq_num, size_t packet_data_size,
+        unsigned long long npacket, unsigned long long ndropped,
+        unsigned long long npacket_total, unsigned long long ndropped_total,
+        int zero_fill, double *drop_frac_avg) {
+
+    const double drop_lpf = 0.25;
+    char *header = guppi_databuf_header(db, block);
+    struct guppi_databuf_info *info = guppi_databuf_info(db, block);
+    struct guppi_databuf_valid *valid = guppi_databuf_valid(db, block);
+    hputi4(header, "PKTIDX", block_seq_num);
+    hputi4(header, "PKTSIZE", packet_data_size);
+    hputi4(header, "NPKT", npacket);
+    hputi4(header, "NDROP", ndropped);
+    info->pktidx = block_seq_num;
+    info->pktsize = packet_data_size;
+    info->npkt = npacket;
+    info->ndrop = ndropped;
+    valid->nvalid = npacket - ndropped;
+    valid->zeroed = zero_fill;
+    guppi_databuf_set_filled(db, block);
+
+    if (npacket) { 
+        *drop_frac_avg = (1.0-drop_lpf)*(*drop_frac_avg)
+            + drop_lpf*(double)ndropped/(double)npacket;
+    }
+
+    /* Put drop stats in general status area */
+    guppi_status_lock_safe(st);
+    hputr8(st->buf, "DROPAVG", *drop_frac_avg);
+    hputr8(st->buf, "DROPTOT", 
+            npacket_total ? 
+            (double)ndropped_total/(double)npacket_total 
+            : 0.0);
+    hputr8(st->buf, "DROPBLK", 
+            npacket ? 
+            (double)ndropped/(double)npacket 
+            : 0.0);
+    guppi_status_unlock_safe(st);
+}
+
+/* Wall clock and CPU time used by the calling thread (sec) */
+static void guppi_net_times(double *wall, double *cpu) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *wall = (double)ts.tv_sec + 1e-9*(double)ts.tv_nsec;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    *cpu = (double)ts.tv_sec + 1e-9*(double)ts.tv_nsec;
+}
+
 /* This thread is passed a single arg, pointer
  * to the guppi_udp_params struct.  This thread should 
  * be cancelled and restarted if any hardware params
@@ -44,17 +103,8 @@ void *guppi_net_thread(void *_args) {
     /* Get arguments */
     struct guppi_thread_args *args = (struct guppi_thread_args *)_args;
 
-    /* Set cpu affinity */
-    cpu_set_t cpuset, cpuset_orig;
-    sched_getaffinity(0, sizeof(cpu_set_t), &cpuset_orig);
-    CPU_ZERO(&cpuset);
-    //CPU_SET(2, &cpuset);
-    CPU_SET(3, &cpuset);
-    int rv = sched_setaffinity(0, sizeof(cpu_set_t), &cpuset);
-    if (rv<0) { 
-        guppi_error("guppi_net_thread", "Error setting cpu affinity.");
-        perror("sched_setaffinity");
-    }
+    /* Set cpu affinity, NETCPUS/NETNODE */
+    int rv = guppi_thread_set_affinity(args, "NET", "3");
 
     /* Set priority */
     rv = setpriority(PRIO_PROCESS, 0, args->priority);
@@ -107,55 +157,34 @@ void *guppi_net_thread(void *_args) {
     }
     pthread_cleanup_push((void *)guppi_databuf_detach, db);
 
-    /* Set up UDP socket */
-    rv = guppi_udp_init(&up);
-    if (rv!=GUPPI_OK) {
-        guppi_error("guppi_net_thread",
-                "Error opening UDP socket.");
-        pthread_exit(NULL);
-    }
-    pthread_cleanup_push((void *)guppi_udp_close, &up);
-
     /* Time parameters */
     int stt_imjd=0, stt_smjd=0;
     double stt_offs=0.0;
 
-    /* See which packet format to use */
-    int use_parkes_packets=0;
-    int nchan=0, npol=0, acclen=0;
-    if (strncmp(up.packet_format, "PARKES", 6)==0) { use_parkes_packets=1; }
-    if (use_parkes_packets) {
-        printf("guppi_net_thread: Using Parkes UDP packet format.\n");
-        nchan = pf.hdr.nchan;
-        npol = pf.hdr.npol;
-        acclen = gp.decimation_factor;
-        if (acclen==0) { 
-            guppi_error("guppi_net_thread", 
-                    "ACC_LEN must be set to use Parkes format");
-            pthread_exit(NULL);
-        }
-#if 0 
-        if (npol!=2) {
-            char msg[256];
-            sprintf(msg, 
-                    "Parkes packet format not implemented for npol=%d", 
-                    npol);
-            guppi_error("guppi_net_thread", msg);
-            pthread_exit(NULL);
-        }
-#endif
-        /* TODO : check packet_size, npol, chan for consistency? */
+    /* See which packet format to use.  Everything format-specific
+     * goes through up.fmt from here on.
+     */
+    rv = guppi_pktfmt_init(&up.fmt, up.packet_format, pf.hdr.nchan,
+            pf.hdr.npol, gp.decimation_factor);
+    if (rv!=GUPPI_OK) {
+        guppi_error("guppi_net_thread", "Unusable packet format");
+        pthread_exit(NULL);
     }
+    const struct guppi_pktfmt *fmt = &up.fmt;
+    if (fmt->layout==GUPPI_PKTFMT_INTERLEAVED) 
+        printf("guppi_net_thread: Using %s UDP packet format (%s).\n",
+                fmt->name, parkes_kernel_name());
+    else if (fmt->layout!=GUPPI_PKTFMT_NATIVE)
+        printf("guppi_net_thread: Using %s UDP packet format.\n", 
+                fmt->name);
 
     /* Figure out size of data in each packet, number of packets
      * per block, etc.
      * TODO : Figure out how/if to deal with packet size changing.
      */
     int block_size;
-    struct guppi_udp_packet p;
-    size_t packet_data_size = guppi_udp_packet_datasize(up.packet_size); 
-    if (use_parkes_packets) 
-        packet_data_size = parkes_udp_packet_datasize(up.packet_size);
+    struct guppi_udp_packet *p;
+    size_t packet_data_size = fmt->block_data_size;
     unsigned packets_per_block; 
     if (hgeti4(status_buf, "BLOCSIZE", &block_size)==0) {
             block_size = db->block_size;
@@ -169,29 +198,168 @@ void *guppi_net_thread(void *_args) {
     }
     packets_per_block = block_size / packet_data_size;
 
+    /* Packet validity is tracked in the databuf itself.  Zero-filling
+     * dropped packets is optional since consumers can use the
+     * validity map instead.
+     */
+    int zero_fill=1;
+    hgeti4(status_buf, "NETZFILL", &zero_fill);
+    const int valid_max = guppi_databuf_valid_max(db);
+    if (packet_data_size < GUPPI_DATABUF_MIN_PKT_SIZE || valid_max==0) {
+        guppi_error("guppi_net_thread", 
+                "Packet validity map not usable with this databuf");
+        pthread_exit(NULL);
+    }
+
+    /* Start time and sample clock come from a fit to the kernel
+     * receive times of the first NETTFIT packets of each obs (the 
+     * first packet's time is used until then).  NETTRND=0 keeps the
+     * fitted start time as is, instead of rounding it to the nearest
+     * second.
+     */
+    int tfit_n=4096, stt_round=1;
+    hgeti4(status_buf, "NETTFIT", &tfit_n);
+    hgeti4(status_buf, "NETTRND", &stt_round);
+    if (tfit_n > (int)packets_per_block) tfit_n = packets_per_block;
+    if (tfit_n==1) tfit_n = 2;
+    double spec_per_packet = 0.0;
+    if (pf.hdr.nchan>0 && pf.hdr.npol>0 && pf.hdr.nbits>0)
+        spec_per_packet = 8.0 * packet_data_size 
+            / ((double)pf.hdr.nchan * pf.hdr.npol * pf.hdr.nbits);
+
+    /* Hand off to multi-receiver or multi-stream code if requested.
+     * Note that BLOCSIZE can not change between obs in these modes.
+     */
+    int nrecv=1, multiport=0, nstream=1;
+    hgeti4(status_buf, "NETNRECV", &nrecv);
+    hgeti4(status_buf, "NETMPORT", &multiport);
+    hgeti4(status_buf, "NETNSTRM", &nstream);
+    if ((nrecv>1 || nstream>1) && strncmp(up.capture_mode, "REPLAY", 6)==0) {
+        guppi_warn("guppi_net_thread", 
+                "Only one receiver is used in REPLAY mode");
+        nrecv = nstream = 1;
+    }
+    if (nstream>1) {
+        if (nrecv>1)
+            guppi_warn("guppi_net_thread", 
+                    "NETNRECV is ignored with several streams");
+        guppi_net_stream(&st, db, &up, status_buf, block_size, nstream,
+                pf.hdr.nchan, pf.hdr.npol, pf.hdr.nbits, zero_fill);
+    }
+    if (nrecv>1) 
+        guppi_net_multi(&st, db, &up, status_buf, packets_per_block,
+                packet_data_size, nrecv, multiport, zero_fill,
+                tfit_n, stt_round, spec_per_packet, pf.hdr.dt);
+
+    /* Set up UDP socket */
+    rv = guppi_udp_init(&up);
+    if (rv!=GUPPI_OK) {
+        guppi_error("guppi_net_thread",
+                "Error opening UDP socket.");
+        pthread_exit(NULL);
+    }
+    pthread_cleanup_push((void *)guppi_udp_close, &up);
+
+    /* Packet batch buffer */
+    struct guppi_udp_packet *pkts;
+    pkts = (struct guppi_udp_packet *)malloc(
+            sizeof(struct guppi_udp_packet) * up.batch_size);
+    if (pkts==NULL) {
+        guppi_error("guppi_net_thread", "Error allocating packet batch");
+        pthread_exit(NULL);
+    }
+    pthread_cleanup_push((void *)free, pkts);
+    int nbatch=0, ibatch=0, j;
+    unsigned direct_slot=0;
+    unsigned long long direct_seq=0, nmispredict_block=0;
+    unsigned long long nrecv_block=0, nsyscall_block=0;
+
+    int tfit_active=0;
+    unsigned long long stt_seq=0;
+    struct guppi_pktclock clk;
+    if (guppi_pktclock_init(&clk, tfit_n)!=GUPPI_OK) 
+        pthread_exit(NULL);
+    pthread_cleanup_push((void *)guppi_pktclock_free, &clk);
+
+    guppi_status_lock_safe(&st);
+    hputi4(st.buf, "NETBATCH", up.batch_size);
+    hputi4(st.buf, "NETZFILL", zero_fill);
+    hputi4(st.buf, "NETBUSY", up.busy_poll);
+    hputi4(st.buf, "NETTFIT", clk.nmax);
+    hputi4(st.buf, "NETTRND", stt_round);
+    guppi_status_unlock_safe(&st);
+
     /* Counters */
     unsigned long long npacket_total=0, npacket_block=0;
     unsigned long long ndropped_total=0, ndropped_block=0;
     unsigned long long nbogus_total=0, nbogus_block=0;
+    unsigned long long kdrop=0, kdrop_last=0, kdrop_obs=0;
+    long rxq=-1;
+    unsigned long long nwakeup_last=0;
+    double t_wall, t_cpu, t_wall_last, t_cpu_last;
+    guppi_net_times(&t_wall_last, &t_cpu_last);
     unsigned long long curblock_seq_num=0, nextblock_seq_num=0;
     unsigned long long seq_num, last_seq_num=2048;
     int curblock=-1;
-    char *curheader=NULL, *curdata=NULL;
+    char *curdata=NULL;
+    int hdr_changed=1;
     unsigned block_packet_idx=0, last_block_packet_idx=0;
     double drop_frac_avg=0.0;
-    const double drop_lpf = 0.25;
+
+    /* Reorder window.  The previous block is kept open until
+     * packets this far past its end have arrived, so late packets
+     * can still be put in place.
+     */
+    int reorder_window=0;
+    hgeti4(status_buf, "NETREORD", &reorder_window);
+    if (reorder_window<0) reorder_window=0;
+    int prevblock=-1;
+    char *prevdata=NULL;
+    unsigned long long prevblock_seq_num=0;
+    unsigned long long npacket_prev=0, ndropped_prev=0, nlate_block=0;
+    unsigned long long *cur_got=NULL, *prev_got=NULL;
 
     /* Main loop */
-    unsigned i, force_new_block=0, waiting=-1;
+    unsigned ndrop, force_new_block=0, waiting=-1;
+    struct guppi_databuf_valid *curvalid=NULL;
     char *dataptr;
     long long seq_num_diff;
     signal(SIGINT,cc);
     while (run) {
 
-        /* Wait for data */
-        rv = guppi_udp_wait(&up);
-        if (rv!=GUPPI_OK) {
-            if (rv==GUPPI_TIMEOUT) { 
+        /* Refill the packet batch once it has been used up.  Only
+         * poll when the socket is actually empty.
+         */
+        if (ibatch>=nbatch) {
+            ibatch = nbatch = 0;
+            /* Predict that the next packets follow the last one,
+             * and receive their data straight into those slots
+             * of the current block.
+             */
+            direct_slot = last_block_packet_idx;
+            if (curblock>=0 && direct_slot<packets_per_block) {
+                int nmax = up.batch_size;
+                if (nmax > packets_per_block - direct_slot)
+                    nmax = packets_per_block - direct_slot;
+                direct_seq = curblock_seq_num + direct_slot;
+                rv = guppi_udp_recv_batch_direct(&up, pkts, nmax,
+                        curdata + direct_slot*packet_data_size);
+            } else 
+                rv = guppi_udp_recv_batch(&up, pkts, up.batch_size);
+            if (rv<0) {
+                guppi_error("guppi_net_thread", 
+                        "guppi_udp_recv_batch returned error");
+                perror("guppi_udp_recv_batch");
+                pthread_exit(NULL);
+            }
+            nsyscall_block++;
+            nbatch = rv;
+            nrecv_block += nbatch;
+        }
+        if (nbatch==0) {
+            rv = guppi_udp_wait(&up);
+            if (rv==GUPPI_OK) { continue; } 
+            else if (rv==GUPPI_TIMEOUT) { 
                 /* Set "waiting" flag */
                 if (waiting!=1) {
                     guppi_status_lock_safe(&st);
@@ -208,20 +376,13 @@ void *guppi_net_thread(void *_args) {
             }
         }
 
-        /* Read packet */
-        rv = guppi_udp_recv(&up, &p);
-        if (rv!=GUPPI_OK) {
-            if (rv==GUPPI_ERR_PACKET) {
-                /* Unexpected packet size, ignore? */
-                nbogus_total++;
-                nbogus_block++;
-                continue; 
-            } else {
-                guppi_error("guppi_net_thread", 
-                        "guppi_udp_recv returned error");
-                perror("guppi_udp_recv");
-                pthread_exit(NULL);
-            }
+        /* Next packet from batch */
+        p = &pkts[ibatch++];
+        if (p->packet_size!=up.packet_size) {
+            /* Unexpected packet size, ignore? */
+            nbogus_total++;
+            nbogus_block++;
+            continue; 
         }
 
         /* Update status if needed */
@@ -232,15 +393,59 @@ void *guppi_net_thread(void *_args) {
             waiting=0;
         }
 
-        /* Convert packet format if needed */
-        if (use_parkes_packets) 
-            parkes_to_guppi(&p, acclen, npol, nchan);
-
         /* Check seq num diff */
-        seq_num = guppi_udp_packet_seq_num(&p);
+        seq_num = fmt->seq_num(fmt, p);
+
+        /* If a directly-received packet is not the one we predicted,
+         * it and the rest of the batch are sitting in the wrong slots.
+         * Copy them out before anything else touches the block.
+         */
+        if (p->payload!=NULL && seq_num!=direct_seq+(ibatch-1)) {
+            for (j=ibatch-1; j<nbatch; j++) 
+                guppi_udp_packet_localize(&pkts[j], fmt);
+            nmispredict_block++;
+        }
         seq_num_diff = seq_num - last_seq_num;
+
+        /* Late packet inside the reorder window: put it in its slot
+         * in the current or previous block, and un-count the drop.
+         */
+        if (seq_num_diff<0 && curblock>=0 && -seq_num_diff<=reorder_window) {
+            unsigned long long *got, *ndrop;
+            char *blkdata;
+            if (seq_num>=curblock_seq_num) {
+                block_packet_idx = seq_num - curblock_seq_num;
+                got = cur_got;
+                ndrop = &ndropped_block;
+                blkdata = curdata;
+            } else if (prevblock>=0 && seq_num>=prevblock_seq_num) {
+                block_packet_idx = seq_num - prevblock_seq_num;
+                got = prev_got;
+                ndrop = &ndropped_prev;
+                blkdata = prevdata;
+            } else {
+                continue;
+            }
+            if (got[block_packet_idx/64] & (1ULL<<(block_packet_idx%64))) {
+                char msg[256];
+                sprintf(msg, "Received duplicate packet (seq_num=%lld)", 
+                        seq_num);
+                guppi_warn("guppi_net_thread", msg);
+                continue;
+            }
+            got[block_packet_idx/64] |= 1ULL<<(block_packet_idx%64);
+            fmt->copy(fmt, blkdata + block_packet_idx*packet_data_size, p);
+            (*ndrop)--;
+            ndropped_total--;
+            nlate_block++;
+            continue;
+        }
+
         if (seq_num_diff<=0 && curblock>=0) { 
-            if (seq_num_diff<-128) { 
+            /* Further back than the reorder window allows for
+             * means the sender was reset.
+             */
+            if (seq_num_diff < -(reorder_window + 128)) { 
                 printf("guppi_net_thread:  Packet sequence number reset\n");
                 force_new_block=1; 
             } else if (seq_num_diff==0) {
@@ -260,59 +465,130 @@ void *guppi_net_thread(void *_args) {
             } 
         } else { force_new_block=0; }
 
+        /* Previous block is done once the reorder window has passed */
+        if (prevblock>=0 && (force_new_block || seq_num >= 
+                    prevblock_seq_num + packets_per_block + reorder_window)) {
+            guppi_net_finish_block(&st, db, prevblock, prevblock_seq_num,
+                    packet_data_size, npacket_prev, ndropped_prev,
+                    npacket_total, ndropped_total, zero_fill, 
+                    &drop_frac_avg);
+            prevblock = -1;
+        }
+
         /* Determine if we go to next block */
         if ((seq_num>=nextblock_seq_num) || force_new_block) {
 
             if (curblock>=0) { 
-                /* Close out current block */
-                hputi4(curheader, "PKTIDX", curblock_seq_num);
-                hputi4(curheader, "PKTSIZE", packet_data_size);
-                hputi4(curheader, "NPKT", npacket_block);
-                hputi4(curheader, "NDROP", ndropped_block);
-                guppi_databuf_set_filled(db, curblock);
-            }
+                /* Packets missing from the end of the block were
+                 * dropped too (unless the obs has ended).
+                 */
+                if (!force_new_block 
+                        && last_block_packet_idx<packets_per_block) {
+                    ndrop = packets_per_block - last_block_packet_idx;
+                    if (zero_fill)
+                        memset(curdata 
+                                + last_block_packet_idx*packet_data_size,
+                                0, ndrop*packet_data_size);
+                    ndropped_block += ndrop;
+                    ndropped_total += ndrop;
+                    npacket_total += ndrop;
+                    npacket_block += ndrop;
+                }
 
-            if (npacket_block) { 
-                drop_frac_avg = (1.0-drop_lpf)*drop_frac_avg 
-                    + drop_lpf*(double)ndropped_block/(double)npacket_block;
+                /* Only one block can wait on late packets */
+                if (prevblock>=0) 
+                    guppi_net_finish_block(&st, db, prevblock, 
+                            prevblock_seq_num, packet_data_size, 
+                            npacket_prev, ndropped_prev,
+                            npacket_total, ndropped_total, zero_fill,
+                            &drop_frac_avg);
+
+                /* Current block becomes previous block */
+                prevblock = curblock;
+                prevdata = curdata;
+                prevblock_seq_num = curblock_seq_num;
+                npacket_prev = npacket_block;
+                ndropped_prev = ndropped_block;
+                prev_got = cur_got;
+
+                /* Close out now if no reordering is allowed */
+                if (reorder_window==0 || force_new_block) {
+                    guppi_net_finish_block(&st, db, prevblock, 
+                            prevblock_seq_num, packet_data_size, 
+                            npacket_prev, ndropped_prev,
+                            npacket_total, ndropped_total, zero_fill,
+                            &drop_frac_avg);
+                    prevblock = -1;
+                }
             }
 
-            /* Put drop stats in general status area */
+            /* Packets the kernel dropped (socket buffer overflow)
+             * show up as sequence gaps too, this tells them apart
+             * from losses upstream.
+             */
+            guppi_udp_kernel_stats(&up, &kdrop, &rxq);
+
+            /* CPU use and wakeups since the last block, to see what
+             * busy-polling costs.
+             */
+            guppi_net_times(&t_wall, &t_cpu);
+
+            /* Put receive stats in general status area */
             guppi_status_lock_safe(&st);
-            hputr8(st.buf, "DROPAVG", drop_frac_avg);
-            hputr8(st.buf, "DROPTOT", 
-                    npacket_total ? 
-                    (double)ndropped_total/(double)npacket_total 
+            hputr8(st.buf, "NETPPSC", 
+                    nsyscall_block ? 
+                    (double)nrecv_block/(double)nsyscall_block 
                     : 0.0);
-            hputr8(st.buf, "DROPBLK", 
-                    npacket_block ? 
-                    (double)ndropped_block/(double)npacket_block 
+            hputi4(st.buf, "NETMISPR", nmispredict_block);
+            hputi4(st.buf, "NETLATE", nlate_block);
+            hputr8(st.buf, "KDROPBLK", 
+                    (double)(kdrop-kdrop_last)/(double)packets_per_block);
+            hputr8(st.buf, "KDROPTOT", 
+                    npacket_total ? 
+                    (double)(kdrop-kdrop_obs)/(double)npacket_total 
                     : 0.0);
+            hputi4(st.buf, "NETRXQ", rxq);
+            if (t_wall > t_wall_last) {
+                hputr8(st.buf, "NETCPU", 
+                        100.0*(t_cpu-t_cpu_last)/(t_wall-t_wall_last));
+                hputr8(st.buf, "NETWAKE", 
+                        (double)(up.nwakeup-nwakeup_last)
+                        /(t_wall-t_wall_last));
+            }
+            if (up.replay!=NULL) {
+                hputi4(st.buf, "RPLNPKT", up.replay->npkt);
+                hputi4(st.buf, "RPLNLOSS", up.replay->nloss);
+                hputi4(st.buf, "RPLNREOR", up.replay->nreorder);
+                hputi4(st.buf, "RPLDONE", up.replay->done);
+            }
             guppi_status_unlock_safe(&st);
 
             /* Reset block counters */
+            kdrop_last=kdrop;
+            nwakeup_last=up.nwakeup;
+            t_wall_last=t_wall;
+            t_cpu_last=t_cpu;
+            nmispredict_block=0;
+            nrecv_block=0;
+            nsyscall_block=0;
+            nlate_block=0;
             npacket_block=0;
             ndropped_block=0;
             nbogus_block=0;
 
             /* If new obs started, reset total counters, get start
-             * time.  Start time is rounded to nearest integer
-             * second, with warning if we're off that by more
-             * than 100ms. */
+             * time from the first packet.  This is refined once the
+             * arrival time fit is done.
+             */
             if (force_new_block) {
                 npacket_total=0;
                 ndropped_total=0;
+                kdrop_obs=kdrop;
                 nbogus_total=0;
-                get_current_mjd(&stt_imjd, &stt_smjd, &stt_offs);
-                if (stt_offs>0.5) { stt_smjd+=1; stt_offs-=1.0; }
-                if (fabs(stt_offs)>0.1) { 
-                    char msg[256];
-                    sprintf(msg, 
-                            "Second fraction = %3.1f ms > +/-100 ms",
-                            stt_offs*1e3);
-                    guppi_warn("guppi_net_thread", msg);
-                }
-                stt_offs = 0.0;
+                guppi_pktclock_reset(&clk);
+                tfit_active = clk.nmax>0 && p->rx_time.tv_sec!=0;
+                get_start_mjd(&p->rx_time, stt_round, !tfit_active,
+                        &stt_imjd, &stt_smjd, &stt_offs);
                 /* Warn if 1st packet number is not zero */
                 if (seq_num!=0) {
                     char msg[256];
@@ -332,7 +608,7 @@ void *guppi_net_thread(void *_args) {
             } else {
                 hputi4(st.buf, "STTVALID", 0);
             }
-            memcpy(status_buf, st.buf, GUPPI_STATUS_SIZE);
+            hdr_changed |= guppi_fitsbuf_update(status_buf, st.buf);
             guppi_status_unlock_safe(&st);
 
             /* block size possibly changed on new obs */
@@ -352,11 +628,11 @@ void *guppi_net_thread(void *_args) {
 
             /* Advance to next block when free, update its header */
             curblock = (curblock + 1) % db->n_block;
-            curheader = guppi_databuf_header(db, curblock);
             curdata = guppi_databuf_data(db, curblock);
             last_block_packet_idx = 0;
             curblock_seq_num = seq_num - (seq_num % packets_per_block);
             nextblock_seq_num = curblock_seq_num + packets_per_block;
+            if (force_new_block) stt_seq = curblock_seq_num;
             while ((rv=guppi_databuf_wait_free(db,curblock)) != GUPPI_OK) {
                 if (rv==GUPPI_TIMEOUT) {
                     waiting=1;
@@ -372,29 +648,84 @@ void *guppi_net_thread(void *_args) {
                     break;
                 }
             }
-            memcpy(curheader, status_buf, GUPPI_STATUS_SIZE);
+            guppi_databuf_header_copy(db, curblock, status_buf, hdr_changed);
+            hdr_changed = 0;
+            guppi_databuf_info(db, curblock)->rx_time = p->rx_time;
+            curvalid = guppi_databuf_valid(db, curblock);
+            guppi_databuf_valid_reset(curvalid, packets_per_block, 
+                    packet_data_size);
+            cur_got = curvalid->bits;
         }
 
-        /* Skip dropped blocks, put packet in right spot */
+        /* Skip dropped packets, put packet in right spot */
         block_packet_idx = seq_num - curblock_seq_num;
-        dataptr = curdata + last_block_packet_idx*packet_data_size;
-        for (i=last_block_packet_idx; i<block_packet_idx; i++) {
-            memset(dataptr, 0, packet_data_size);
-            dataptr += packet_data_size;
-            ndropped_block++;
-            ndropped_total++;
-            npacket_total++;
-            npacket_block++;
+        if (block_packet_idx > last_block_packet_idx) {
+            ndrop = block_packet_idx - last_block_packet_idx;
+            if (zero_fill)
+                memset(curdata + last_block_packet_idx*packet_data_size,
+                        0, ndrop*packet_data_size);
+            ndropped_block += ndrop;
+            ndropped_total += ndrop;
+            npacket_total += ndrop;
+            npacket_block += ndrop;
         }
-        // TODO replace memcpy with special func that expands out
-        // 1SFA packets, etc.
-        //memcpy(dataptr, guppi_udp_packet_data(&p), packet_data_size);
-        guppi_udp_packet_data_copy(dataptr, &p);
+        dataptr = curdata + block_packet_idx*packet_data_size;
+        // No copy needed if the data was received in place
+        fmt->copy(fmt, dataptr, p);
+        cur_got[block_packet_idx/64] |= 1ULL<<(block_packet_idx%64);
         npacket_total++;
         npacket_block++;
         last_block_packet_idx = block_packet_idx + 1;
         last_seq_num = seq_num;
 
+        /* Arrival time fit, once enough packets are in */
+        if (tfit_active && guppi_pktclock_add(&clk, seq_num, &p->rx_time)) {
+            struct timespec t;
+            double resid;
+            tfit_active = 0;
+            /* A packet arrives once its last sample is taken, so the
+             * data in packet stt_seq starts when packet stt_seq-1 
+             * arrives.
+             */
+            guppi_pktclock_time(&clk, stt_seq-1, &t);
+            resid = get_start_mjd(&t, stt_round, 1, 
+                    &stt_imjd, &stt_smjd, &stt_offs);
+            guppi_status_lock_safe(&st);
+            hputi4(st.buf, "STT_IMJD", stt_imjd);
+            hputi4(st.buf, "STT_SMJD", stt_smjd);
+            hputr8(st.buf, "STT_OFFS", stt_offs);
+            hputi4(st.buf, "NETTFITN", clk.nfit);
+            hputr8(st.buf, "NETPKTDT", clk.dt);
+            hputr8(st.buf, "NETTRES", resid);
+            hputr8(st.buf, "NETTJIT", clk.rms);
+            hputr8(st.buf, "NETTJMAX", clk.max);
+            if (spec_per_packet>0.0) {
+                hputr8(st.buf, "NETTBIN", clk.dt/spec_per_packet);
+                if (pf.hdr.dt>0.0)
+                    hputr8(st.buf, "NETCLKER", 1e6 * 
+                            (clk.dt/spec_per_packet/pf.hdr.dt - 1.0));
+            }
+            guppi_status_unlock_safe(&st);
+
+            /* Fix up the first block's header if it is still ours.
+             * Its text no longer matches any other block's.
+             */
+            int blk = -1;
+            if (curblock_seq_num==stt_seq) 
+                blk = curblock;
+            else if (prevblock>=0 && prevblock_seq_num==stt_seq)
+                blk = prevblock;
+            if (blk>=0) {
+                char *hdr = guppi_databuf_header(db, blk);
+                hputi4(hdr, "STT_IMJD", stt_imjd);
+                hputi4(hdr, "STT_SMJD", stt_smjd);
+                hputr8(hdr, "STT_OFFS", stt_offs);
+                guppi_databuf_info(db, blk)->hdr_seq = 0;
+            } else
+                guppi_warn("guppi_net_thread", 
+                        "Start time fit done after first block was filled");
+        }
+
         /* Will exit if thread has been cancelled */
         pthread_testcancel();
     }
@@ -402,6 +733,8 @@ void *guppi_net_thread(void *_args) {
     pthread_exit(NULL);
 
     /* Have to close all push's */
+    pthread_cleanup_pop(0); /* Closes guppi_pktclock_free */
+    pthread_cleanup_pop(0); /* Closes free(pkts) */
     pthread_cleanup_pop(0); /* Closes push(guppi_udp_close) */
     pthread_cleanup_pop(0); /* Closes set_exit_status */
     pthread_cleanup_pop(0); /* Closes guppi_free_psrfits */
@@ -36,18 +36,12 @@ extern void guppi_read_obs_params(char *buf,
 void guppi_null_thread(void *_args) {
 
     int rv;
-#if 0 
-    /* Set cpu affinity */
-    cpu_set_t cpuset, cpuset_orig;
-    sched_getaffinity(0, sizeof(cpu_set_t), &cpuset_orig);
-    CPU_ZERO(&cpuset);
-    CPU_SET(1, &cpuset);
-    rv = sched_setaffinity(0, sizeof(cpu_set_t), &cpuset);
-    if (rv<0) { 
-        guppi_error("guppi_null_thread", "Error setting cpu affinity.");
-        perror("sched_setaffinity");
-    }
-#endif
+
+    /* Get args */
+    struct guppi_thread_args *args = (struct guppi_thread_args *)_args;
+
+    /* Set cpu affinity, NULLCPUS/NULLNODE.  Not pinned by default. */
+    guppi_thread_set_affinity(args, "NULL", "");
 
     /* Set priority */
     rv = setpriority(PRIO_PROCESS, 0, 0);
@@ -56,9 +50,6 @@ void guppi_null_thread(void *_args) {
         perror("set_priority");
     }
 
-    /* Get args */
-    struct guppi_thread_args *args = (struct guppi_thread_args *)_args;
-
     /* Attach to status shared mem area */
     struct guppi_status st;
     rv = guppi_status_attach(&st);
@@ -84,9 +75,11 @@ void guppi_null_thread(void *_args) {
         pthread_exit(NULL);
     }
     pthread_cleanup_push((void *)guppi_databuf_detach, db);
+    if (args->numa_node>=0) guppi_databuf_set_node(db, args->numa_node);
 
     /* Loop */
     char *ptr;
+    struct guppi_databuf_info *info;
     struct guppi_params gp;
     struct psrfits pf;
     pf.sub.dat_freqs = NULL;
@@ -95,6 +88,7 @@ void guppi_null_thread(void *_args) {
     pf.sub.dat_scales = NULL;
     pthread_cleanup_push((void *)guppi_free_psrfits, &pf);
     int curblock=0;
+    unsigned long long hdr_seq=0;
     signal(SIGINT,cc);
     while (run) {
 
@@ -104,7 +98,7 @@ void guppi_null_thread(void *_args) {
         guppi_status_unlock_safe(&st);
 
         /* Wait for buf to have data */
-        rv = guppi_databuf_wait_filled(db, curblock);
+        rv = guppi_databuf_wait_filled_reader(db, curblock, args->reader);
         if (rv!=0) {
             //sleep(1);
             continue;
@@ -116,9 +110,14 @@ void guppi_null_thread(void *_args) {
         hputi4(st.buf, "CURBLOCK", curblock);
         guppi_status_unlock_safe(&st);
 
-        /* Get params */
+        /* Get params, only parsing the header if it has changed */
         ptr = guppi_databuf_header(db, curblock);
-        guppi_read_obs_params(ptr, &gp, &pf);
+        info = guppi_databuf_info(db, curblock);
+        if (info->hdr_seq==0 || info->hdr_seq!=hdr_seq) {
+            guppi_read_obs_params(ptr, &gp, &pf);
+            hdr_seq = info->hdr_seq;
+        } else
+            guppi_read_block_params(db, curblock, &hdr_seq, &gp, &pf);
 
         /* Output if data was lost */
         if (gp.n_dropped!=0 && 
@@ -129,7 +128,7 @@ void guppi_null_thread(void *_args) {
         }
 
         /* Mark as free */
-        guppi_databuf_set_free(db, curblock);
+        guppi_databuf_set_free_reader(db, curblock, args->reader);
 
         /* Go to next block */
         curblock = (curblock + 1) % db->n_block;
@@ -127,16 +127,23 @@ void guppi_read_net_params(char *buf, struct guppi_udp_params *u) {
     get_str("DATAHOST", u->sender, 80, "bee2-10");
     get_int("DATAPORT", u->port, 50000);
     get_str("PKTFMT", u->packet_format, 32, "GUPPI");
-    if (strncmp(u->packet_format, "PARKES", 6)==0)
-        u->packet_size = 2056;
-    else if (strncmp(u->packet_format, "1SFA", 4)==0)
-        u->packet_size = 8224;
-    else if (strncmp(u->packet_format, "FAST4K", 6)==0)
-        u->packet_size = 4128;
-    else if (strncmp(u->packet_format, "SHORT", 5)==0)
-        u->packet_size = 544;
-    else
-        u->packet_size = 8208;
+    get_str("CAPMODE", u->capture_mode, 16, "SOCKET");
+    get_str("DATAIFC", u->iface, 32, "");
+    get_str("REPLFILE", u->replay_file, 256, "");
+    get_str("REPLHDR", u->replay_hdr, 256, "");
+    get_dbl("REPLRATE", u->replay_rate, 0.0);
+    get_dbl("REPLLOSS", u->replay_loss, 0.0);
+    get_dbl("REPLREOR", u->replay_reorder, 0.0);
+    get_int("REPLSEED", u->replay_seed, 1);
+    get_int("REPLLOOP", u->replay_loops, 1);
+    u->reuseport = 0;
+    get_int("NETBUSY", u->busy_poll, 0);
+    if (u->busy_poll<0) u->busy_poll = 0;
+    get_int("NETBATCH", u->batch_size, 32);
+    if (u->batch_size<1) u->batch_size = 1;
+    if (u->batch_size>GUPPI_MAX_PACKET_BATCH) 
+        u->batch_size = GUPPI_MAX_PACKET_BATCH;
+    u->packet_size = guppi_pktfmt_lookup(u->packet_format)->packet_size;
 }
 
 /* Some code just needs a simple way to get the obs mode string */
@@ -213,6 +220,48 @@ void guppi_read_subint_params(char *buf,
 }
 
 
+// Read the per-block params for a databuf block.  The header text
+// is only parsed if it differs from the last block read (*hdr_seq
+// holds its version); otherwise the packet counts come from the
+// block's binary info and everything else is carried over.
+void guppi_read_block_params(struct guppi_databuf *d, int block_id,
+                             unsigned long long *hdr_seq,
+                             struct guppi_params *g, 
+                             struct psrfits *p)
+{
+    char *buf = guppi_databuf_header(d, block_id);
+    struct guppi_databuf_info *info = guppi_databuf_info(d, block_id);
+    if (info->hdr_seq==0 || info->hdr_seq!=*hdr_seq) {
+        guppi_read_subint_params(buf, g, p);
+        *hdr_seq = info->hdr_seq;
+        return;
+    }
+
+    g->packetindex = info->pktidx;
+    g->packetsize = info->pktsize;
+    g->n_packets = info->npkt;
+    g->n_dropped = info->ndrop;
+    g->drop_frac = (double) g->n_dropped / (double) g->n_packets;
+
+    if (strcmp("PSR", p->hdr.obs_mode)==0 
+            || strcmp("CAL", p->hdr.obs_mode)==0) {
+        // Set per block by the fold thread
+        get_dbl("TSUBINT", p->sub.tsubint, 0.0); 
+        get_dbl("OFFS_SUB", p->sub.offs, 0.0); 
+        get_int("NPOLYCO", p->fold.n_polyco_sets, 0);
+    } else {
+        // Move the LST on by the time since the last block
+        int bytes_per_dt = p->hdr.nchan * p->hdr.npol * p->hdr.nbits / 8;
+        if (bytes_per_dt<=0) return;
+        double offs = p->hdr.dt * 
+            (double)(g->packetindex * g->packetsize / bytes_per_dt)
+            + 0.5 * p->sub.tsubint;
+        p->sub.lst = fmod(p->sub.lst + 1.00273790935 * (offs - p->sub.offs)
+                + 86400.0, 86400.0);
+        p->sub.offs = offs;
+    }
+}
+
 // Read a status buffer all of the key observation paramters
 void guppi_read_obs_params(char *buf, 
                            struct guppi_params *g, 
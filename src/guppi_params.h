@@ -26,12 +26,17 @@ struct guppi_params {
 };
 
 #include "guppi_udp.h"
+#include "guppi_databuf.h"
 #include "psrfits.h"
 void guppi_read_obs_mode(const char *buf, char *mode);
 void guppi_read_net_params(char *buf, struct guppi_udp_params *u);
 void guppi_read_subint_params(char *buf, 
                               struct guppi_params *g, 
                               struct psrfits *p);
+void guppi_read_block_params(struct guppi_databuf *d, int block_id,
+                             unsigned long long *hdr_seq,
+                             struct guppi_params *g, 
+                             struct psrfits *p);
 void guppi_read_obs_params(char *buf, 
                            struct guppi_params *g, 
                            struct psrfits *p);
@@ -0,0 +1,233 @@
+/* guppi_parkes.c
+ *
+ * Parkes packet reorder kernels.  See guppi_parkes.h.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  ifdef __SSE2__
+#    define PARKES_USE_SSE2
+#  endif
+#  define PARKES_USE_AVX2
+#endif
+
+#include "guppi_parkes.h"
+
+/* Scalar versions, handling channels c0..nchan-1.  These also
+ * clean up the leftover channels for the SIMD versions.
+ */
+static void parkes_npol2_tail(char *out, const char *in, int nchan,
+        int c0) {
+    char *pol0 = &out[c0];
+    char *pol1 = &out[nchan + c0];
+    int i;
+    in += 2*c0;
+    for (i=c0; i+2<=nchan; i+=2) {
+        /* Each loop handles 2 values from each pol */
+        memcpy(pol0, in, 2*sizeof(char));
+        memcpy(pol1, &in[2], 2*sizeof(char));
+        pol0 += 2;
+        pol1 += 2;
+        in += 4;
+    }
+}
+
+static void parkes_npol4_tail(char *out, const char *in, int nchan,
+        int c0) {
+    char *pol0 = &out[c0];
+    char *pol1 = &out[nchan + c0];
+    char *pol2 = &out[2*nchan + c0];
+    char *pol3 = &out[3*nchan + c0];
+    int i;
+    in += 4*c0;
+    for (i=c0; i<nchan; i++) {
+        /* Each loop handles one sample */
+        *pol0 = *in; in++; pol0++;
+        *pol1 = *in; in++; pol1++;
+        *pol2 = *in; in++; pol2++;
+        *pol3 = *in; in++; pol3++;
+    }
+}
+
+static void parkes_npol2_scalar(char *out, const char *in, int nchan) {
+    parkes_npol2_tail(out, in, nchan, 0);
+}
+
+static void parkes_npol4_scalar(char *out, const char *in, int nchan) {
+    parkes_npol4_tail(out, in, nchan, 0);
+}
+
+#ifdef PARKES_USE_SSE2
+/* SSE2 versions.  Each unpack lo/hi pass below rotates the bits
+ * of the element index (vector number, position in vector) left
+ * by one, so repeated passes turn the interleaved order into
+ * pol-major order without any byte shuffles.
+ */
+static void parkes_npol2_sse2(char *out, const char *in, int nchan) {
+    __m128i v0, v1, t0, t1;
+    int c, k;
+    /* 16 channels per loop, as 16-bit (2-channel) words */
+    for (c=0; c+16<=nchan; c+=16) {
+        v0 = _mm_loadu_si128((const __m128i *)&in[2*c]);
+        v1 = _mm_loadu_si128((const __m128i *)&in[2*c + 16]);
+        for (k=0; k<3; k++) {
+            t0 = _mm_unpacklo_epi16(v0, v1);
+            t1 = _mm_unpackhi_epi16(v0, v1);
+            v0 = t0;
+            v1 = t1;
+        }
+        _mm_storeu_si128((__m128i *)&out[c], v0);
+        _mm_storeu_si128((__m128i *)&out[nchan + c], v1);
+    }
+    parkes_npol2_tail(out, in, nchan, c);
+}
+
+static void parkes_npol4_sse2(char *out, const char *in, int nchan) {
+    __m128i v0, v1, v2, v3, t0, t1, t2, t3;
+    int c, k;
+    /* 16 channels per loop */
+    for (c=0; c+16<=nchan; c+=16) {
+        v0 = _mm_loadu_si128((const __m128i *)&in[4*c]);
+        v1 = _mm_loadu_si128((const __m128i *)&in[4*c + 16]);
+        v2 = _mm_loadu_si128((const __m128i *)&in[4*c + 32]);
+        v3 = _mm_loadu_si128((const __m128i *)&in[4*c + 48]);
+        for (k=0; k<4; k++) {
+            t0 = _mm_unpacklo_epi8(v0, v2);
+            t1 = _mm_unpackhi_epi8(v0, v2);
+            t2 = _mm_unpacklo_epi8(v1, v3);
+            t3 = _mm_unpackhi_epi8(v1, v3);
+            v0 = t0; v1 = t1; v2 = t2; v3 = t3;
+        }
+        _mm_storeu_si128((__m128i *)&out[c], v0);
+        _mm_storeu_si128((__m128i *)&out[nchan + c], v1);
+        _mm_storeu_si128((__m128i *)&out[2*nchan + c], v2);
+        _mm_storeu_si128((__m128i *)&out[3*nchan + c], v3);
+    }
+    parkes_npol4_tail(out, in, nchan, c);
+}
+#endif
+
+#ifdef PARKES_USE_AVX2
+/* AVX2 versions.  Shuffles only work within each 128-bit lane,
+ * so group within lanes first, then permute across them.
+ */
+__attribute__((target("avx2")))
+static void parkes_npol2_avx2(char *out, const char *in, int nchan) {
+    const __m256i mask = _mm256_setr_epi8(
+            0,1,4,5,8,9,12,13, 2,3,6,7,10,11,14,15,
+            0,1,4,5,8,9,12,13, 2,3,6,7,10,11,14,15);
+    __m256i a, b;
+    int c;
+    /* 32 channels per loop */
+    for (c=0; c+32<=nchan; c+=32) {
+        a = _mm256_loadu_si256((const __m256i *)&in[2*c]);
+        b = _mm256_loadu_si256((const __m256i *)&in[2*c + 32]);
+        /* Each 8-byte group now holds 8 channels of one pol */
+        a = _mm256_shuffle_epi8(a, mask);
+        b = _mm256_shuffle_epi8(b, mask);
+        a = _mm256_permute4x64_epi64(a, 0xd8);
+        b = _mm256_permute4x64_epi64(b, 0xd8);
+        _mm256_storeu_si256((__m256i *)&out[c],
+                _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)&out[nchan + c],
+                _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    parkes_npol2_tail(out, in, nchan, c);
+}
+
+__attribute__((target("avx2")))
+static void parkes_npol4_avx2(char *out, const char *in, int nchan) {
+    const __m256i mask = _mm256_setr_epi8(
+            0,4,8,12, 1,5,9,13, 2,6,10,14, 3,7,11,15,
+            0,4,8,12, 1,5,9,13, 2,6,10,14, 3,7,11,15);
+    const __m256i perm = _mm256_setr_epi32(0,4,1,5,2,6,3,7);
+    __m256i r0, r1, r2, r3, lo01, hi01, lo23, hi23;
+    int c;
+    /* 32 channels per loop */
+    for (c=0; c+32<=nchan; c+=32) {
+        r0 = _mm256_loadu_si256((const __m256i *)&in[4*c]);
+        r1 = _mm256_loadu_si256((const __m256i *)&in[4*c + 32]);
+        r2 = _mm256_loadu_si256((const __m256i *)&in[4*c + 64]);
+        r3 = _mm256_loadu_si256((const __m256i *)&in[4*c + 96]);
+        /* Each 64-bit word now holds 8 channels of one pol */
+        r0 = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(r0, mask), perm);
+        r1 = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(r1, mask), perm);
+        r2 = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(r2, mask), perm);
+        r3 = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(r3, mask), perm);
+        /* 4x4 transpose of the 64-bit words */
+        lo01 = _mm256_unpacklo_epi64(r0, r1);
+        hi01 = _mm256_unpackhi_epi64(r0, r1);
+        lo23 = _mm256_unpacklo_epi64(r2, r3);
+        hi23 = _mm256_unpackhi_epi64(r2, r3);
+        _mm256_storeu_si256((__m256i *)&out[c],
+                _mm256_permute2x128_si256(lo01, lo23, 0x20));
+        _mm256_storeu_si256((__m256i *)&out[nchan + c],
+                _mm256_permute2x128_si256(hi01, hi23, 0x20));
+        _mm256_storeu_si256((__m256i *)&out[2*nchan + c],
+                _mm256_permute2x128_si256(lo01, lo23, 0x31));
+        _mm256_storeu_si256((__m256i *)&out[3*nchan + c],
+                _mm256_permute2x128_si256(hi01, hi23, 0x31));
+    }
+    parkes_npol4_tail(out, in, nchan, c);
+}
+#endif
+
+static struct parkes_kernel kernels[PARKES_NKERNEL] = {
+    { "scalar", parkes_npol2_scalar, parkes_npol4_scalar },
+#ifdef PARKES_USE_SSE2
+    { "sse2", parkes_npol2_sse2, parkes_npol4_sse2 },
+#else
+    { "sse2", NULL, NULL },
+#endif
+#ifdef PARKES_USE_AVX2
+    { "avx2", parkes_npol2_avx2, parkes_npol4_avx2 },
+#else
+    { "avx2", NULL, NULL },
+#endif
+};
+
+/* Pick the best kernel this CPU can run, once */
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static const struct parkes_kernel *kernel = &kernels[PARKES_KERNEL_SCALAR];
+static void parkes_select_kernel() {
+#ifdef PARKES_USE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = &kernels[PARKES_KERNEL_AVX2];
+        return;
+    }
+#endif
+#ifdef PARKES_USE_SSE2
+    kernel = &kernels[PARKES_KERNEL_SSE2];
+#endif
+}
+
+const struct parkes_kernel *parkes_get_kernel(int ikernel) {
+    if (ikernel<0 || ikernel>=PARKES_NKERNEL) return(NULL);
+    if (kernels[ikernel].npol2==NULL) return(NULL);
+#ifdef PARKES_USE_AVX2
+    if (ikernel==PARKES_KERNEL_AVX2) {
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2")) return(NULL);
+    }
+#endif
+    return(&kernels[ikernel]);
+}
+
+const char *parkes_kernel_name() {
+    pthread_once(&kernel_once, parkes_select_kernel);
+    return(kernel->name);
+}
+
+void parkes_reorder(char *out, const char *in, int npol, int nchan) {
+    pthread_once(&kernel_once, parkes_select_kernel);
+    if (npol==2)
+        kernel->npol2(out, in, nchan);
+    else if (npol==4)
+        kernel->npol4(out, in, nchan);
+    else
+        memcpy(out, in, sizeof(char) * npol * nchan);
+}
@@ -0,0 +1,38 @@
+/* guppi_parkes.h
+ *
+ * Kernels to reorder Parkes UDP packet data into guppi
+ * (polarization-major) order.  Parkes packets interleave the
+ * polarizations; guppi blocks want all channels of pol 0, then
+ * all channels of pol 1, etc.
+ *
+ * Vectorized versions are chosen at runtime based on what the
+ * CPU supports.  All versions give identical output.
+ */
+#ifndef _GUPPI_PARKES_H
+#define _GUPPI_PARKES_H
+
+/* Reorder nchan channels of npol-pol data from in to out.  Only
+ * npol=2 and npol=4 need reordering, other values are copied as-is.
+ * in and out must not overlap.
+ */
+void parkes_reorder(char *out, const char *in, int npol, int nchan);
+
+/* Individual kernels, exposed for testing and benchmarking.
+ * The SIMD versions are NULL if not available on this machine.
+ */
+typedef void (*parkes_reorder_func)(char *out, const char *in, int nchan);
+struct parkes_kernel {
+    const char *name;
+    parkes_reorder_func npol2;
+    parkes_reorder_func npol4;
+};
+#define PARKES_KERNEL_SCALAR 0
+#define PARKES_KERNEL_SSE2   1
+#define PARKES_KERNEL_AVX2   2
+#define PARKES_NKERNEL       3
+const struct parkes_kernel *parkes_get_kernel(int ikernel);
+
+/* Name of the kernel parkes_reorder() is using */
+const char *parkes_kernel_name();
+
+#endif
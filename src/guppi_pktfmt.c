@@ -0,0 +1,127 @@
+/* guppi_pktfmt.c
+ *
+ * Packet format descriptor table.  See guppi_pktfmt.h.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "guppi_pktfmt.h"
+#include "guppi_udp.h"
+#include "guppi_parkes.h"
+#include "guppi_error.h"
+
+/* Standard guppi packets start with a big-endian 64-bit count */
+static unsigned long long guppi_pktfmt_seq(const struct guppi_pktfmt *f,
+        const struct guppi_udp_packet *p) {
+    return(change_endian64((unsigned long long *)p->data));
+}
+
+/* Plain copy, unless the data was already received in place */
+static void guppi_pktfmt_copy(const struct guppi_pktfmt *f, char *out,
+        const struct guppi_udp_packet *p) {
+    if (out==p->payload) return;
+    memcpy(out, p->payload!=NULL ? p->payload : p->data + f->header_size,
+            f->data_size);
+}
+
+/* Old 1SFA packets: expand out, leaving space for missing data.
+ * So far only need to deal with 4k-channel case of 2 spectra per
+ * packet.
+ *
+ * TODO: Update 5/12/2009, newer 1SFA modes always will have full
+ * data contents, and the old 4k ones never really worked, so
+ * this format can probably be deleted.
+ */
+static void guppi_pktfmt_copy_padded(const struct guppi_pktfmt *f,
+        char *out, const struct guppi_udp_packet *p) {
+    const size_t pad = 16;
+    const size_t spec_data_size = 4096 - 2*pad;
+    const char *in = p->data + f->header_size;
+    memset(out, 0, pad);
+    memcpy(out + pad, in, spec_data_size);
+    memset(out + pad + spec_data_size, 0, 2*pad);
+    memcpy(out + pad + spec_data_size + pad + pad,
+            in + spec_data_size, spec_data_size);
+    memset(out + pad + spec_data_size + pad
+            + pad + spec_data_size, 0, pad);
+}
+
+/* Parkes packets count IBOB clocks rather than packets.  This
+ * assumes 2 samples per IBOB clock, and that acclen is the actual
+ * accumulation length (=reg_acclen+1).
+ */
+static unsigned long long parkes_pktfmt_seq(const struct guppi_pktfmt *f,
+        const struct guppi_udp_packet *p) {
+    const unsigned int counts_per_packet = (f->nchan/2) * f->acclen;
+    return(change_endian64((unsigned long long *)p->data)
+            / counts_per_packet);
+}
+
+static void parkes_pktfmt_copy(const struct guppi_pktfmt *f, char *out,
+        const struct guppi_udp_packet *p) {
+    parkes_reorder(out, p->data + f->header_size, f->npol, f->nchan);
+}
+
+/* The table.  Longer names must come before shorter names they
+ * start with.
+ */
+static const struct guppi_pktfmt guppi_pktfmts[] = {
+    /* name    pktsize hdr  data   block  layout           dir obs */
+    { "GUPPI",    8208, 8, 8192, 8192, GUPPI_PKTFMT_NATIVE,      1, 0,
+        guppi_pktfmt_seq, guppi_pktfmt_copy },
+    { "1SFA_OLD", 8160, 8, 8144, 8192, GUPPI_PKTFMT_PADDED,      0, 0,
+        guppi_pktfmt_seq, guppi_pktfmt_copy_padded },
+    { "1SFA",     8224, 8, 8192, 8192, GUPPI_PKTFMT_NATIVE,      1, 0,
+        guppi_pktfmt_seq, guppi_pktfmt_copy },
+    { "FAST4K",   4128, 8, 4096, 4096, GUPPI_PKTFMT_NATIVE,      1, 0,
+        guppi_pktfmt_seq, guppi_pktfmt_copy },
+    { "SHORT",     544, 8,  512,  512, GUPPI_PKTFMT_NATIVE,      1, 0,
+        guppi_pktfmt_seq, guppi_pktfmt_copy },
+    { "PARKES",   2056, 8, 2048, 2048, GUPPI_PKTFMT_INTERLEAVED, 0, 1,
+        parkes_pktfmt_seq, parkes_pktfmt_copy },
+};
+#define GUPPI_NPKTFMT (sizeof(guppi_pktfmts)/sizeof(guppi_pktfmts[0]))
+
+const struct guppi_pktfmt *guppi_pktfmt_lookup(const char *name) {
+    int i;
+    for (i=0; i<GUPPI_NPKTFMT; i++) {
+        const char *fname = guppi_pktfmts[i].name;
+        if (strncmp(name, fname, strlen(fname))==0)
+            return(&guppi_pktfmts[i]);
+    }
+    return(&guppi_pktfmts[0]);
+}
+
+const struct guppi_pktfmt *guppi_pktfmt_by_size(size_t packet_size) {
+    int i;
+    for (i=0; i<GUPPI_NPKTFMT; i++)
+        if (guppi_pktfmts[i].packet_size==packet_size)
+            return(&guppi_pktfmts[i]);
+    return(NULL);
+}
+
+int guppi_pktfmt_init(struct guppi_pktfmt *f, const char *name,
+        int nchan, int npol, int acclen) {
+    *f = *guppi_pktfmt_lookup(name);
+    f->nchan = nchan;
+    f->npol = npol;
+    f->acclen = acclen;
+    if (f->needs_obs) {
+        if (acclen==0 || nchan<2) {
+            guppi_error("guppi_pktfmt_init",
+                    "ACC_LEN and OBSNCHAN must be set to use this format");
+            return(GUPPI_ERR_PARAM);
+        }
+        if ((size_t)nchan*npol!=f->data_size) {
+            char msg[256];
+            sprintf(msg, "%s packets hold %d bytes, not nchan*npol=%d",
+                    f->name, (int)f->data_size, nchan*npol);
+            if ((size_t)nchan*npol > f->data_size) {
+                guppi_error("guppi_pktfmt_init", msg);
+                return(GUPPI_ERR_PARAM);
+            }
+            guppi_warn("guppi_pktfmt_init", msg);
+        }
+    }
+    return(GUPPI_OK);
+}
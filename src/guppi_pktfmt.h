@@ -0,0 +1,68 @@
+/* guppi_pktfmt.h
+ *
+ * UDP packet format descriptors.  Each supported packet format
+ * (PKTFMT status keyword) has an entry in a table giving its
+ * size and layout, plus functions to pull out the packet sequence
+ * number and to copy the data portion into a databuf block.  The
+ * net thread picks a descriptor once at startup and calls through
+ * it for every packet.
+ *
+ * To add a format, write its seq_num/copy functions (if the
+ * generic ones don't fit) and add an entry to the table in
+ * guppi_pktfmt.c.
+ */
+#ifndef _GUPPI_PKTFMT_H
+#define _GUPPI_PKTFMT_H
+
+#include <sys/types.h>
+
+struct guppi_udp_packet;
+struct guppi_pktfmt;
+
+/* Return the (guppi-style) packet count for a packet */
+typedef unsigned long long (*guppi_pktfmt_seq_func)(
+        const struct guppi_pktfmt *f, const struct guppi_udp_packet *p);
+
+/* Copy the data portion of a packet to its place in a block,
+ * converting it to guppi order if needed.
+ */
+typedef void (*guppi_pktfmt_copy_func)(const struct guppi_pktfmt *f,
+        char *out, const struct guppi_udp_packet *p);
+
+/* Order of the data within a packet */
+#define GUPPI_PKTFMT_NATIVE      0 /* Same as in the databuf */
+#define GUPPI_PKTFMT_INTERLEAVED 1 /* Pols interleaved per channel pair */
+#define GUPPI_PKTFMT_PADDED      2 /* Spectra missing edge channels */
+
+struct guppi_pktfmt {
+    const char *name;       /* PKTFMT value (matched as a prefix) */
+    size_t packet_size;     /* Total packet size (bytes) */
+    size_t header_size;     /* Bytes before the data */
+    size_t data_size;       /* Bytes of data in the packet */
+    size_t block_data_size; /* Bytes each packet fills in a block */
+    int layout;             /* Data layout, GUPPI_PKTFMT_* */
+    int direct;             /* Data can be received straight into block */
+    int needs_obs;          /* Conversion needs nchan/npol/acclen */
+    guppi_pktfmt_seq_func seq_num;
+    guppi_pktfmt_copy_func copy;
+
+    /* Observation params, filled in by guppi_pktfmt_init */
+    int nchan;
+    int npol;
+    int acclen;
+};
+
+/* Look up a format by name, or by total packet size.  Unknown
+ * names give the standard GUPPI format; unknown sizes give NULL.
+ */
+const struct guppi_pktfmt *guppi_pktfmt_lookup(const char *name);
+const struct guppi_pktfmt *guppi_pktfmt_by_size(size_t packet_size);
+
+/* Fill in f with the named format and the observation params it
+ * needs.  Returns GUPPI_ERR_PARAM if the params don't work for
+ * this format.
+ */
+int guppi_pktfmt_init(struct guppi_pktfmt *f, const char *name,
+        int nchan, int npol, int acclen);
+
+#endif
@@ -0,0 +1,211 @@
+/* guppi_pktring.c
+ *
+ * TPACKET_V3 memory-mapped capture ring implementation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include "guppi_pktring.h"
+#include "guppi_error.h"
+
+/* Kernel-side filter equivalent to "udp dst port N" for unfragmented
+ * IPv4 over ethernet framing (which includes the loopback device).
+ */
+static int guppi_pktring_filter(int sock, int port) {
+    struct sock_filter code[] = {
+        { 0x28, 0, 0, 12 },             /* ldh [12] (ethertype) */
+        { 0x15, 0, 8, ETHERTYPE_IP },   /* IPv4? */
+        { 0x30, 0, 0, 23 },             /* ldb [23] (IP proto) */
+        { 0x15, 0, 6, IPPROTO_UDP },    /* UDP? */
+        { 0x28, 0, 0, 20 },             /* ldh [20] (frag offset) */
+        { 0x45, 4, 0, 0x1fff },         /* drop fragments */
+        { 0xb1, 0, 0, 14 },             /* x = IP header len */
+        { 0x48, 0, 0, 16 },             /* ldh [x+16] (dest port) */
+        { 0x15, 0, 1, (unsigned)port }, /* our port? */
+        { 0x06, 0, 0, 0x40000 },        /* accept */
+        { 0x06, 0, 0, 0 },              /* reject */
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code)/sizeof(code[0]);
+    prog.filter = code;
+    return(setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER,
+                &prog, sizeof(prog)));
+}
+
+int guppi_pktring_init(struct guppi_pktring *r, const char *iface,
+        int port) {
+
+    memset(r, 0, sizeof(struct guppi_pktring));
+    r->port = port;
+
+    /* Raw packet socket, IPv4 only */
+    r->sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+    if (r->sock==-1) {
+        guppi_error("guppi_pktring_init", "socket error (need CAP_NET_RAW?)");
+        return(GUPPI_ERR_SYS);
+    }
+
+    /* Filter in kernel so only our packets hit the ring */
+    if (guppi_pktring_filter(r->sock, port)!=0) {
+        guppi_error("guppi_pktring_init", "Error attaching port filter.");
+        close(r->sock);
+        return(GUPPI_ERR_SYS);
+    }
+
+    /* Don't see our own outgoing packets (matters on loopback) */
+#ifdef PACKET_IGNORE_OUTGOING
+    int one = 1;
+    setsockopt(r->sock, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+            &one, sizeof(one));
+#endif
+
+    /* Set up ring */
+    int version = TPACKET_V3;
+    int rv = setsockopt(r->sock, SOL_PACKET, PACKET_VERSION,
+            &version, sizeof(version));
+    if (rv!=0) {
+        guppi_error("guppi_pktring_init", "TPACKET_V3 not supported");
+        close(r->sock);
+        return(GUPPI_ERR_SYS);
+    }
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = GUPPI_PKTRING_BLOCK_SIZE;
+    req.tp_block_nr = GUPPI_PKTRING_NBLOCK;
+    req.tp_frame_size = GUPPI_PKTRING_FRAME_SIZE;
+    req.tp_frame_nr = (req.tp_block_size * req.tp_block_nr)
+        / req.tp_frame_size;
+    req.tp_retire_blk_tov = GUPPI_PKTRING_TIMEOUT_MS;
+    req.tp_feature_req_word = 0;
+    rv = setsockopt(r->sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+    if (rv!=0) {
+        guppi_error("guppi_pktring_init", "Error setting up PACKET_RX_RING");
+        close(r->sock);
+        return(GUPPI_ERR_SYS);
+    }
+    r->nblock = req.tp_block_nr;
+    r->map_size = (size_t)req.tp_block_size * req.tp_block_nr;
+    r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_LOCKED, r->sock, 0);
+    if (r->map==MAP_FAILED) {
+        guppi_error("guppi_pktring_init", "mmap error");
+        close(r->sock);
+        return(GUPPI_ERR_SYS);
+    }
+    r->blocks = (struct iovec *)malloc(sizeof(struct iovec) * r->nblock);
+    int i;
+    for (i=0; i<r->nblock; i++) {
+        r->blocks[i].iov_base = r->map + (size_t)i * req.tp_block_size;
+        r->blocks[i].iov_len = req.tp_block_size;
+    }
+
+    /* Bind to interface */
+    struct sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_IP);
+    ll.sll_ifindex = 0;
+    if (iface!=NULL && iface[0]!='\0') {
+        ll.sll_ifindex = if_nametoindex(iface);
+        if (ll.sll_ifindex==0) {
+            guppi_error("guppi_pktring_init", "Unknown interface");
+            guppi_pktring_close(r);
+            return(GUPPI_ERR_PARAM);
+        }
+    }
+    rv = bind(r->sock, (struct sockaddr *)&ll, sizeof(ll));
+    if (rv!=0) {
+        guppi_error("guppi_pktring_init", "bind");
+        guppi_pktring_close(r);
+        return(GUPPI_ERR_SYS);
+    }
+
+    return(GUPPI_OK);
+}
+
+/* Hand the current block back to the kernel, move to next one */
+static void guppi_pktring_release(struct guppi_pktring *r) {
+    struct tpacket_block_desc *bd =
+        (struct tpacket_block_desc *)r->blocks[r->curblock].iov_base;
+    __sync_synchronize();
+    bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    r->block_held = 0;
+    r->npkt_left = 0;
+    r->curblock = (r->curblock + 1) % r->nblock;
+}
+
+int guppi_pktring_recv_batch(struct guppi_pktring *r,
+        struct guppi_udp_packet *b, int nmax) {
+
+    /* Done with the previous block? */
+    if (r->block_held && r->npkt_left==0)
+        guppi_pktring_release(r);
+
+    /* Grab next block if the kernel has retired it */
+    if (!r->block_held) {
+        struct tpacket_block_desc *bd =
+            (struct tpacket_block_desc *)r->blocks[r->curblock].iov_base;
+        if ((bd->hdr.bh1.block_status & TP_STATUS_USER)==0)
+            return(0);
+        __sync_synchronize();
+        r->block_held = 1;
+        r->npkt_left = bd->hdr.bh1.num_pkts;
+        r->nextpkt = (char *)bd + bd->hdr.bh1.offset_to_first_pkt;
+    }
+
+    /* Walk packets in this block, pointing b[] at UDP payloads */
+    int n=0;
+    while (r->npkt_left>0 && n<nmax) {
+        struct tpacket3_hdr *ppd = (struct tpacket3_hdr *)r->nextpkt;
+        r->nextpkt += ppd->tp_next_offset;
+        r->npkt_left--;
+
+        const unsigned char *ip = (unsigned char *)ppd + ppd->tp_net;
+        const size_t ihl = 4 * (ip[0] & 0x0f);
+        if (ppd->tp_snaplen < (ppd->tp_net - ppd->tp_mac) + ihl + 8)
+            continue;
+        const unsigned char *udp = ip + ihl;
+        size_t len = ((udp[4]<<8) | udp[5]) - 8;
+        if ((udp[2]<<8 | udp[3]) != r->port) continue;
+        if (ppd->tp_snaplen < (ppd->tp_net - ppd->tp_mac) + ihl + 8 + len)
+            continue;
+
+        b[n].data = (char *)udp + 8;
+        b[n].payload = NULL;
+        b[n].packet_size = len;
+        b[n].rx_time.tv_sec = ppd->tp_sec;
+        b[n].rx_time.tv_nsec = ppd->tp_nsec;
+        n++;
+    }
+
+    return(n);
+}
+
+unsigned long long guppi_pktring_drops(struct guppi_pktring *r) {
+    /* Reading the stats resets them */
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+    if (getsockopt(r->sock, SOL_PACKET, PACKET_STATISTICS, &stats, &len)<0)
+        return(0);
+    return(stats.tp_drops);
+}
+
+int guppi_pktring_close(struct guppi_pktring *r) {
+    if (r->map!=NULL && r->map!=MAP_FAILED) munmap(r->map, r->map_size);
+    if (r->blocks!=NULL) free(r->blocks);
+    r->map = NULL;
+    r->blocks = NULL;
+    close(r->sock);
+    return(GUPPI_OK);
+}
@@ -0,0 +1,56 @@
+/* guppi_pktring.h
+ *
+ * PACKET_MMAP (TPACKET_V3) capture backend.  UDP payloads are
+ * read directly out of a block ring shared with the kernel,
+ * with no per-packet system calls.
+ */
+#ifndef _GUPPI_PKTRING_H
+#define _GUPPI_PKTRING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "guppi_udp.h"
+
+/* Ring geometry */
+#define GUPPI_PKTRING_BLOCK_SIZE (4*1024*1024)
+#define GUPPI_PKTRING_NBLOCK 64
+#define GUPPI_PKTRING_FRAME_SIZE 2048
+#define GUPPI_PKTRING_TIMEOUT_MS 10
+
+/* Ring state */
+struct guppi_pktring {
+    int sock;               /* AF_PACKET socket */
+    int port;               /* UDP dest port to accept */
+    char *map;              /* mmap'd ring */
+    size_t map_size;        /* Total size of ring (bytes) */
+    struct iovec *blocks;   /* Pointers to each ring block */
+    int nblock;             /* Number of ring blocks */
+    int curblock;           /* Block currently being read */
+    int block_held;         /* Nonzero if curblock is owned by us */
+    unsigned npkt_left;     /* Packets remaining in curblock */
+    char *nextpkt;          /* Next tpacket3_hdr in curblock */
+};
+
+/* Set up the ring on the given interface ("" = all interfaces),
+ * accepting only UDP packets sent to the given port.
+ */
+int guppi_pktring_init(struct guppi_pktring *r, const char *iface,
+        int port);
+
+/* Fill b[] with up to nmax packets from the ring.  The packet data
+ * pointers point into ring memory, and stay valid until the next
+ * call.  Returns number of packets, 0 if the ring is empty.
+ */
+int guppi_pktring_recv_batch(struct guppi_pktring *r,
+        struct guppi_udp_packet *b, int nmax);
+
+/* Packets the kernel dropped because the ring was full, since
+ * the previous call.  Returns 0 if the count can't be read.
+ */
+unsigned long long guppi_pktring_drops(struct guppi_pktring *r);
+
+/* Release all ring memory, close socket */
+int guppi_pktring_close(struct guppi_pktring *r);
+
+#endif
@@ -36,6 +36,12 @@ extern void guppi_read_subint_params(char *buf,
                                      struct guppi_params *g,
                                      struct psrfits *p);
 
+/* Same, skipping the parse if the header text has not changed */
+extern void guppi_read_block_params(struct guppi_databuf *d, int block_id,
+                                    unsigned long long *hdr_seq,
+                                    struct guppi_params *g,
+                                    struct psrfits *p);
+
 /* Downsampling functions */
 extern void get_stokes_I(struct psrfits *pf);
 extern void downsample_freq(struct psrfits *pf);
@@ -61,16 +67,8 @@ void guppi_psrfits_thread(void *_args) {
     struct guppi_thread_args *args = (struct guppi_thread_args *)_args;
     pthread_cleanup_push((void *)guppi_thread_set_finished, args);
     
-    /* Set cpu affinity */
-    cpu_set_t cpuset, cpuset_orig;
-    sched_getaffinity(0, sizeof(cpu_set_t), &cpuset_orig);
-    CPU_ZERO(&cpuset);
-    CPU_SET(1, &cpuset);
-    int rv = sched_setaffinity(0, sizeof(cpu_set_t), &cpuset);
-    if (rv<0) { 
-        guppi_error("guppi_psrfits_thread", "Error setting cpu affinity.");
-        perror("sched_setaffinity");
-    }
+    /* Set cpu affinity, DISKCPUS/DISKNODE */
+    int rv = guppi_thread_set_affinity(args, "DISK", "1");
 
     /* Set priority */
     rv = setpriority(PRIO_PROCESS, 0, args->priority);
@@ -118,9 +116,11 @@ void guppi_psrfits_thread(void *_args) {
         pthread_exit(NULL);
     }
     pthread_cleanup_push((void *)guppi_databuf_detach, db);
+    if (args->numa_node>=0) guppi_databuf_set_node(db, args->numa_node);
     
     /* Loop */
     int curblock=0, total_status=0, firsttime=1, run=1, got_packet_0=0;
+    unsigned long long hdr_seq=0;
     int mode=SEARCH_MODE;
     char *ptr;
     char tmpstr[256];
@@ -129,6 +129,7 @@ void guppi_psrfits_thread(void *_args) {
     memset(pc, 0, sizeof(pc));
     int n_polyco_written=0;
     float *fold_output_array = NULL;
+    char *zero_copy = NULL;
     int scan_finished=0;
     signal(SIGINT, cc);
     do {
@@ -142,10 +143,10 @@ void guppi_psrfits_thread(void *_args) {
         guppi_status_unlock_safe(&st);
         
         /* Wait for buf to have data */
-        rv = guppi_databuf_wait_filled(db, curblock);
+        rv = guppi_databuf_wait_filled_reader(db, curblock, args->reader);
+        if (rv==GUPPI_TIMEOUT) continue;
         if (rv!=0) {
-            // This is a big ol' kludge to avoid this process hanging
-            // due to thread synchronization problems.
+            // Back off on real errors rather than spinning
             sleep(1);
             continue; 
         }
@@ -164,7 +165,7 @@ void guppi_psrfits_thread(void *_args) {
             guppi_read_obs_params(ptr, &gp, &pf);
             firsttime = 0;
         } else {
-            guppi_read_subint_params(ptr, &gp, &pf);
+            guppi_read_block_params(db, curblock, &hdr_seq, &gp, &pf);
         }
 
         /* Find out what mode this data is in */
@@ -203,8 +204,17 @@ void guppi_psrfits_thread(void *_args) {
                 pf.sub.data = (unsigned char *)fold_output_array;
                 pf.fold.pc = (struct polyco *)(guppi_databuf_data(db,curblock)
                         + foldbuf_data_size(&fb) + foldbuf_count_size(&fb));
-            } else 
-                pf.sub.data = (unsigned char *)guppi_databuf_data(db, curblock);
+            } else {
+                /* Dropped packets must read as zeros in the file */
+                pf.sub.data = (unsigned char *)guppi_databuf_data_zeroed(db,
+                        curblock, args->reader, &zero_copy);
+                if (pf.sub.data==NULL) {
+                    guppi_error("guppi_psrfits_thread", 
+                            "Error zero-filling dropped packets");
+                    pf.sub.data = 
+                        (unsigned char *)guppi_databuf_data(db, curblock);
+                }
+            }
             
             /* Set the DC and Nyquist channels explicitly to zero */
             /* because of the "FFT Problem" that splits DC power  */
@@ -274,7 +284,7 @@ void guppi_psrfits_thread(void *_args) {
         }
 
         /* Mark as free */
-        guppi_databuf_set_free(db, curblock);
+        guppi_databuf_set_free_reader(db, curblock, args->reader);
         
         /* Go to next block */
         curblock = (curblock + 1) % db->n_block;
@@ -287,6 +297,7 @@ void guppi_psrfits_thread(void *_args) {
     /* Cleanup */
     
     if (fold_output_array!=NULL) free(fold_output_array);
+    if (zero_copy!=NULL) free(zero_copy);
 
     pthread_exit(NULL);
     
@@ -33,23 +33,21 @@ extern void guppi_read_subint_params(char *buf,
                                      struct guppi_params *g,
                                      struct psrfits *p);
 
+/* Same, skipping the parse if the header text has not changed */
+extern void guppi_read_block_params(struct guppi_databuf *d, int block_id,
+                                    unsigned long long *hdr_seq,
+                                    struct guppi_params *g,
+                                    struct psrfits *p);
 
-void guppi_rawdisk_thread(void *_args) {
 
-    /* Set cpu affinity */
-    cpu_set_t cpuset, cpuset_orig;
-    sched_getaffinity(0, sizeof(cpu_set_t), &cpuset_orig);
-    CPU_ZERO(&cpuset);
-    CPU_SET(1, &cpuset);
-    int rv = sched_setaffinity(0, sizeof(cpu_set_t), &cpuset);
-    if (rv<0) { 
-        guppi_error("guppi_rawdisk_thread", "Error setting cpu affinity.");
-        perror("sched_setaffinity");
-    }
+void guppi_rawdisk_thread(void *_args) {
 
     /* Get args */
     struct guppi_thread_args *args = (struct guppi_thread_args *)_args;
 
+    /* Set cpu affinity, DISKCPUS/DISKNODE */
+    int rv = guppi_thread_set_affinity(args, "DISK", "1");
+
     /* Set priority */
     rv = setpriority(PRIO_PROCESS, 0, 0);
     if (rv<0) {
@@ -84,6 +82,7 @@ void guppi_rawdisk_thread(void *_args) {
                 "Error attaching to databuf shared memory.");
         pthread_exit(NULL);
     }
+    if (args->numa_node>=0) guppi_databuf_set_node(db, args->numa_node);
 
     /* Open output file */
     FILE *fraw = fopen("guppi_raw.dat", "w");
@@ -102,8 +101,9 @@ void guppi_rawdisk_thread(void *_args) {
     /* Loop */
     int packetidx=0, npacket=0, ndrop=0, packetsize=0;
     int curblock=0, total_status=0;
+    unsigned long long hdr_seq=0;
     int got_packet_0=0;
-    char *ptr;
+    char *ptr, *zero_copy=NULL;
     //char *hend;
     signal(SIGINT,cc);
     while (run) {
@@ -114,17 +114,14 @@ void guppi_rawdisk_thread(void *_args) {
         guppi_status_unlock_safe(&st);
 
         /* Wait for buf to have data */
-        guppi_databuf_wait_filled(db, curblock);
+        guppi_databuf_wait_filled_reader(db, curblock, args->reader);
 
         /* Read param struct for this block */
-        ptr = guppi_databuf_header(db, curblock);
-        guppi_read_subint_params(ptr, &gp, &pf);
-
-        /* Parse packet size, npacket from header */
-        hgeti4(ptr, "PKTIDX", &packetidx);
-        hgeti4(ptr, "PKTSIZE", &packetsize);
-        hgeti4(ptr, "NPKT", &npacket);
-        hgeti4(ptr, "NDROP", &ndrop);
+        guppi_read_block_params(db, curblock, &hdr_seq, &gp, &pf);
+        packetidx = gp.packetindex;
+        packetsize = gp.packetsize;
+        npacket = gp.n_packets;
+        ndrop = gp.n_dropped;
 
         /* Wait for packet 0 before starting write */
         if (got_packet_0==0 && packetidx==0) got_packet_0=1;
@@ -150,10 +147,11 @@ void guppi_rawdisk_thread(void *_args) {
             //    fwrite(ptr, 80, 1, fraw);
             //}
 
-            /* Write data */
-            ptr = guppi_databuf_data(db, curblock);
-            rv = fwrite(ptr, packetsize, npacket, fraw);
-            if (rv != npacket) { 
+            /* Write data, with dropped packets zeroed */
+            ptr = guppi_databuf_data_zeroed(db, curblock, args->reader,
+                    &zero_copy);
+            if (ptr!=NULL) rv = fwrite(ptr, packetsize, npacket, fraw);
+            if (ptr==NULL || rv != npacket) { 
                 guppi_error("guppi_rawdisk_thread", 
                         "Error writing data.");
             }
@@ -164,7 +162,7 @@ void guppi_rawdisk_thread(void *_args) {
         }
 
         /* Mark as free */
-        guppi_databuf_set_free(db, curblock);
+        guppi_databuf_set_free_reader(db, curblock, args->reader);
 
         /* Go to next block */
         curblock = (curblock + 1) % db->n_block;
@@ -174,6 +172,8 @@ void guppi_rawdisk_thread(void *_args) {
 
     }
 
+    if (zero_copy!=NULL) free(zero_copy);
+
     pthread_exit(NULL);
 
     pthread_cleanup_pop(0); /* Closes push(fclose) */
@@ -0,0 +1,397 @@
+/* guppi_replay.c
+ *
+ * Packet replay backend.  See guppi_replay.h.
+ */
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "guppi_replay.h"
+#include "guppi_error.h"
+
+/* pcap file format bits */
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_HDR_SIZE 24
+#define PCAP_REC_SIZE 16
+#define PCAP_LINK_NULL   0
+#define PCAP_LINK_ETHER  1
+#define PCAP_LINK_RAW    101
+#define PCAP_LINK_RAW_BSD 12
+#define PCAP_LINK_IPV4   228
+#define PCAP_LINK_SLL    113
+
+static double replay_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((double)ts.tv_sec + 1e-9*(double)ts.tv_nsec);
+}
+
+static unsigned int get32(const char *buf, int swapped) {
+    unsigned int v;
+    memcpy(&v, buf, sizeof(v));
+    return(swapped ? __builtin_bswap32(v) : v);
+}
+
+static unsigned int get16be(const char *buf) {
+    const unsigned char *b = (const unsigned char *)buf;
+    return((b[0]<<8) | b[1]);
+}
+
+static int replay_map_file(struct guppi_replay *r, const char *fname) {
+    int fd = open(fname, O_RDONLY);
+    if (fd<0) {
+        char msg[300];
+        sprintf(msg, "Error opening %.256s", fname);
+        guppi_error("guppi_replay_init", msg);
+        return(GUPPI_ERR_SYS);
+    }
+    struct stat sb;
+    if (fstat(fd, &sb)<0 || sb.st_size==0) {
+        guppi_error("guppi_replay_init", "Empty or unreadable input file");
+        close(fd);
+        return(GUPPI_ERR_SYS);
+    }
+    r->map_size = sb.st_size;
+    r->map = (char *)mmap(NULL, r->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (r->map==MAP_FAILED) {
+        guppi_error("guppi_replay_init", "mmap error");
+        r->map = NULL;
+        return(GUPPI_ERR_SYS);
+    }
+    madvise(r->map, r->map_size, MADV_SEQUENTIAL);
+    return(GUPPI_OK);
+}
+
+static int replay_init_pcap(struct guppi_replay *r) {
+    if (r->map_size < PCAP_HDR_SIZE) {
+        guppi_error("guppi_replay_init", "pcap file too short");
+        return(GUPPI_ERR_PARAM);
+    }
+    unsigned int magic;
+    memcpy(&magic, r->map, sizeof(magic));
+    if (magic==PCAP_MAGIC_US || magic==PCAP_MAGIC_NS)
+        r->swapped = 0;
+    else if (__builtin_bswap32(magic)==PCAP_MAGIC_US
+            || __builtin_bswap32(magic)==PCAP_MAGIC_NS)
+        r->swapped = 1;
+    else {
+        guppi_error("guppi_replay_init", "Not a pcap file");
+        return(GUPPI_ERR_PARAM);
+    }
+    r->linktype = get32(r->map + 20, r->swapped) & 0xffff;
+    switch (r->linktype) {
+        case PCAP_LINK_NULL:
+        case PCAP_LINK_ETHER:
+        case PCAP_LINK_RAW:
+        case PCAP_LINK_RAW_BSD:
+        case PCAP_LINK_IPV4:
+        case PCAP_LINK_SLL:
+            break;
+        default:
+            guppi_error("guppi_replay_init", "Unsupported pcap link type");
+            return(GUPPI_ERR_PARAM);
+    }
+    r->pos = PCAP_HDR_SIZE;
+    return(GUPPI_OK);
+}
+
+/* Read guppi_hdr.dat, one line per block:
+ *   pktidx pktsize npkt ndrop ...
+ */
+static int replay_init_raw(struct guppi_replay *r,
+        const struct guppi_udp_params *p) {
+    FILE *f = fopen(p->replay_hdr, "r");
+    if (f==NULL) {
+        char msg[300];
+        sprintf(msg, "Error opening %.256s", p->replay_hdr);
+        guppi_error("guppi_replay_init", msg);
+        return(GUPPI_ERR_SYS);
+    }
+    char line[256];
+    int nalloc=0, pktsize, npkt, ndrop;
+    long long pktidx;
+    size_t total=0;
+    r->nblock = 0;
+    while (fgets(line, sizeof(line), f)!=NULL) {
+        if (line[0]=='#') continue;
+        if (sscanf(line, "%lld %d %d %d", &pktidx, &pktsize, &npkt,
+                    &ndrop)!=4) continue;
+        if (r->nblock==0)
+            r->pktsize = pktsize;
+        else if (pktsize!=r->pktsize) {
+            guppi_error("guppi_replay_init",
+                    "Packet size changes within raw dump");
+            fclose(f);
+            return(GUPPI_ERR_PARAM);
+        }
+        if (r->nblock==nalloc) {
+            nalloc = nalloc ? 2*nalloc : 256;
+            r->blk_pktidx = (long long *)realloc(r->blk_pktidx,
+                    sizeof(long long) * nalloc);
+            r->blk_npkt = (int *)realloc(r->blk_npkt, sizeof(int) * nalloc);
+        }
+        r->blk_pktidx[r->nblock] = pktidx;
+        r->blk_npkt[r->nblock] = npkt;
+        r->nblock++;
+        total += (size_t)npkt * pktsize;
+    }
+    fclose(f);
+    if (r->nblock==0) {
+        guppi_error("guppi_replay_init", "No blocks in raw dump header");
+        return(GUPPI_ERR_PARAM);
+    }
+
+    /* Packets are rebuilt in the native layout of the current format */
+    if (p->fmt.layout!=GUPPI_PKTFMT_NATIVE || r->pktsize!=p->fmt.data_size) {
+        guppi_error("guppi_replay_init",
+                "Raw dump does not match packet format");
+        return(GUPPI_ERR_PARAM);
+    }
+    if (total > r->map_size) {
+        guppi_error("guppi_replay_init",
+                "Raw dump is shorter than its header file says");
+        return(GUPPI_ERR_PARAM);
+    }
+    r->packet_size = p->fmt.packet_size;
+    r->iblock = r->ipkt = 0;
+    r->pos = 0;
+    return(GUPPI_OK);
+}
+
+int guppi_replay_init(struct guppi_replay *r,
+        const struct guppi_udp_params *p) {
+    int rv;
+    memset(r, 0, sizeof(struct guppi_replay));
+    r->mode = p->replay_hdr[0]=='\0' ? GUPPI_REPLAY_PCAP : GUPPI_REPLAY_RAW;
+    r->port = p->port;
+    r->rate = p->replay_rate;
+    r->loss = p->replay_loss;
+    r->reorder = p->replay_reorder;
+    r->seed = p->replay_seed;
+    r->loops_left = p->replay_loops;
+
+    rv = replay_map_file(r, p->replay_file);
+    if (rv!=GUPPI_OK) return(rv);
+    if (r->mode==GUPPI_REPLAY_PCAP)
+        rv = replay_init_pcap(r);
+    else
+        rv = replay_init_raw(r, p);
+    if (rv!=GUPPI_OK) {
+        guppi_replay_close(r);
+        return(rv);
+    }
+    return(GUPPI_OK);
+}
+
+/* Find the UDP payload in a captured frame.  Returns NULL for
+ * anything that isn't an unfragmented IPv4 UDP packet to our port.
+ */
+static const char *replay_pcap_payload(const struct guppi_replay *r,
+        const char *frame, size_t caplen, size_t *len) {
+    size_t off;
+    unsigned int ethertype = 0x0800;
+    switch (r->linktype) {
+        case PCAP_LINK_ETHER:
+            if (caplen < 14) return(NULL);
+            ethertype = get16be(frame + 12);
+            off = 14;
+            if (ethertype==0x8100 && caplen >= 18) {
+                ethertype = get16be(frame + 16);
+                off = 18;
+            }
+            break;
+        case PCAP_LINK_SLL:
+            if (caplen < 16) return(NULL);
+            ethertype = get16be(frame + 14);
+            off = 16;
+            break;
+        case PCAP_LINK_NULL:
+            off = 4;
+            break;
+        default:
+            off = 0;
+            break;
+    }
+    if (ethertype!=0x0800 || caplen < off + 20) return(NULL);
+
+    /* IPv4 */
+    const unsigned char *ip = (const unsigned char *)frame + off;
+    if ((ip[0]>>4)!=4 || ip[9]!=17) return(NULL);
+    if (get16be((const char *)ip + 6) & 0x3fff) return(NULL); /* Fragment */
+    off += (ip[0] & 0xf) * 4;
+    if (caplen < off + 8) return(NULL);
+
+    /* UDP */
+    const char *udp = frame + off;
+    if (r->port && get16be(udp + 2)!=r->port) return(NULL);
+    size_t udplen = get16be(udp + 4);
+    if (udplen < 8 || off + udplen > caplen) return(NULL);
+    *len = udplen - 8;
+    return(udp + 8);
+}
+
+/* Copy the next packet from the file into out.  Returns 0 once
+ * the input (including any repeats) is used up.
+ */
+static int replay_next_file(struct guppi_replay *r, char *out, size_t *len) {
+    if (r->mode==GUPPI_REPLAY_PCAP) {
+        while (r->pos + PCAP_REC_SIZE <= r->map_size) {
+            const char *rec = r->map + r->pos;
+            size_t caplen = get32(rec + 8, r->swapped);
+            if (r->pos + PCAP_REC_SIZE + caplen > r->map_size) break;
+            r->pos += PCAP_REC_SIZE + caplen;
+            const char *pl = replay_pcap_payload(r, rec + PCAP_REC_SIZE,
+                    caplen, len);
+            if (pl==NULL || *len > GUPPI_MAX_PACKET_SIZE
+                    || *len < sizeof(unsigned long long))
+                continue;
+            memcpy(out, pl, *len);
+            return(1);
+        }
+        return(0);
+    }
+
+    /* Raw dump: put back the packet header and an empty trailer */
+    while (r->iblock < r->nblock && r->ipkt >= r->blk_npkt[r->iblock]) {
+        r->iblock++;
+        r->ipkt = 0;
+    }
+    if (r->iblock >= r->nblock) return(0);
+    unsigned long long seq = r->blk_pktidx[r->iblock] + r->ipkt;
+    seq = __builtin_bswap64(seq);
+    memcpy(out, &seq, sizeof(seq));
+    memcpy(out + sizeof(seq), r->map + r->pos, r->pktsize);
+    memset(out + sizeof(seq) + r->pktsize, 0,
+            r->packet_size - sizeof(seq) - r->pktsize);
+    r->pos += r->pktsize;
+    r->ipkt++;
+    *len = r->packet_size;
+    return(1);
+}
+
+/* Next packet from the file, starting over (with the sequence
+ * numbers moved on past the end of the previous pass) as needed.
+ */
+static int replay_next(struct guppi_replay *r, char *out, size_t *len) {
+    if (!replay_next_file(r, out, len)) {
+        if (r->loops_left==1 || !r->seq_valid) return(0);
+        if (r->loops_left>1) r->loops_left--;
+        r->seq_offset += r->seq_last - r->seq_first + r->seq_step;
+        r->pos = r->mode==GUPPI_REPLAY_PCAP ? PCAP_HDR_SIZE : 0;
+        r->iblock = r->ipkt = 0;
+        if (!replay_next_file(r, out, len)) return(0);
+    }
+
+    /* Work out the repeat offset during the first pass */
+    unsigned long long seq = change_endian64((unsigned long long *)out);
+    if (r->seq_offset==0) {
+        if (!r->seq_valid) {
+            r->seq_first = r->seq_last = seq;
+            r->seq_step = 1;
+            r->seq_valid = 1;
+        } else if (seq > r->seq_last) {
+            if (r->seq_last==r->seq_first || seq - r->seq_last < r->seq_step)
+                r->seq_step = seq - r->seq_last;
+            r->seq_last = seq;
+        }
+    } else {
+        seq = __builtin_bswap64(seq + r->seq_offset);
+        memcpy(out, &seq, sizeof(seq));
+    }
+    r->npkt++;
+    return(1);
+}
+
+/* Replayed packets are stamped with the time they are handed out */
+static void replay_emit(struct guppi_replay *r, struct guppi_udp_packet *b,
+        const char *data, size_t len, const struct timespec *ts) {
+    int i;
+    b->data = b->buf;
+    b->payload = NULL;
+    b->packet_size = len;
+    b->rx_time = *ts;
+    if (data!=b->buf) memcpy(b->buf, data, len);
+    for (i=0; i<r->nheld; i++) r->held[i].countdown--;
+}
+
+int guppi_replay_recv_batch(struct guppi_replay *r,
+        struct guppi_udp_packet *b, int nmax) {
+    int n=0, i;
+    double now = replay_now();
+    if (r->t0==0.0) r->t0 = now;
+    unsigned long long due = (unsigned long long)-1;
+    if (r->rate>0.0) due = (unsigned long long)(r->rate * (now - r->t0)) + 1;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    while (n<nmax) {
+
+        /* Held packets whose turn has come go first */
+        for (i=0; i<r->nheld; i++)
+            if (r->held[i].countdown<=0) break;
+        if (i<r->nheld) {
+            struct guppi_replay_held *h = &r->held[i];
+            replay_emit(r, &b[n++], h->data, h->len, &ts);
+            memmove(h, h+1, sizeof(*h) * (r->nheld - i - 1));
+            r->nheld--;
+            continue;
+        }
+
+        if (r->npkt >= due) break;
+        size_t len;
+        if (r->done || !replay_next(r, b[n].buf, &len)) {
+            /* End of input, let out whatever is still held */
+            r->done = 1;
+            if (r->nheld==0) break;
+            r->held[0].countdown = 0;
+            continue;
+        }
+        if (r->loss>0.0 && rand_r(&r->seed) < r->loss * RAND_MAX) {
+            r->nloss++;
+            continue;
+        }
+        if (r->reorder>0.0 && r->nheld<GUPPI_REPLAY_MAXHOLD
+                && rand_r(&r->seed) < r->reorder * RAND_MAX) {
+            struct guppi_replay_held *h = &r->held[r->nheld++];
+            h->countdown = 1 + rand_r(&r->seed) % GUPPI_REPLAY_DEPTH;
+            h->len = len;
+            memcpy(h->data, b[n].buf, len);
+            r->nreorder++;
+            continue;
+        }
+        replay_emit(r, &b[n], b[n].buf, len, &ts);
+        n++;
+    }
+    return(n);
+}
+
+int guppi_replay_wait(struct guppi_replay *r) {
+    if (r->done && r->nheld==0) {
+        usleep(100000);
+        return(GUPPI_TIMEOUT);
+    }
+    if (r->rate>0.0 && r->t0!=0.0) {
+        double wait = r->t0 + (double)r->npkt / r->rate - replay_now();
+        if (wait>0.0) usleep((useconds_t)(wait * 1e6));
+    }
+    return(GUPPI_OK);
+}
+
+int guppi_replay_close(struct guppi_replay *r) {
+    if (r->map!=NULL) munmap(r->map, r->map_size);
+    r->map = NULL;
+    free(r->blk_pktidx);
+    free(r->blk_npkt);
+    r->blk_pktidx = NULL;
+    r->blk_npkt = NULL;
+    return(GUPPI_OK);
+}
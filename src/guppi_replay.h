@@ -0,0 +1,92 @@
+/* guppi_replay.h
+ *
+ * Packet replay backend for the net thread.  Instead of a socket,
+ * packets come from a pcap capture file, or are rebuilt from the
+ * guppi_raw.dat/guppi_hdr.dat dump written by guppi_rawdisk_thread.
+ * Packets can be paced at a given rate (or sent as fast as they
+ * are taken), and loss and reordering can be injected.  The same
+ * seed always gives the same packet sequence.
+ */
+#ifndef _GUPPI_REPLAY_H
+#define _GUPPI_REPLAY_H
+
+#include <sys/types.h>
+
+#include "guppi_udp.h"
+
+#define GUPPI_REPLAY_PCAP 0
+#define GUPPI_REPLAY_RAW  1
+
+#define GUPPI_REPLAY_MAXHOLD 16 /* Max packets held back at once */
+#define GUPPI_REPLAY_DEPTH 8    /* Max packets a held one is delayed */
+
+/* A packet held back for reordering */
+struct guppi_replay_held {
+    int countdown;          /* Packets to send before this one */
+    size_t len;
+    char data[GUPPI_MAX_PACKET_SIZE];
+};
+
+struct guppi_replay {
+    int mode;               /* GUPPI_REPLAY_PCAP or GUPPI_REPLAY_RAW */
+    char *map;              /* mmap'd input file */
+    size_t map_size;
+    size_t pos;             /* Offset of next packet in map */
+
+    /* pcap only */
+    int swapped;            /* File is opposite endianness */
+    int linktype;           /* pcap link layer type */
+    int port;               /* UDP dest port to accept, 0=any */
+
+    /* raw dump only */
+    int nblock;             /* Blocks listed in the header file */
+    int iblock, ipkt;       /* Current block, packet within it */
+    long long *blk_pktidx;  /* First packet index of each block */
+    int *blk_npkt;          /* Packets in each block */
+    size_t pktsize;         /* Data bytes per packet */
+    size_t packet_size;     /* Size of the packets we rebuild */
+
+    /* Looping over the file */
+    int loops_left;
+    int seq_valid;
+    unsigned long long seq_first, seq_last, seq_step, seq_offset;
+
+    /* Pacing */
+    double rate;            /* Packets/sec, 0 = as fast as possible */
+    double t0;              /* Time of first recv, 0 = not started */
+
+    /* Impairments */
+    double loss;            /* Fraction of packets to drop */
+    double reorder;         /* Fraction of packets to delay */
+    unsigned int seed;
+    int nheld;
+    struct guppi_replay_held held[GUPPI_REPLAY_MAXHOLD];
+
+    /* Stats */
+    unsigned long long npkt;     /* Packets read from the file */
+    unsigned long long nloss;    /* Packets dropped on purpose */
+    unsigned long long nreorder; /* Packets sent late on purpose */
+    int done;                    /* Input used up */
+};
+
+/* Open the replay input named in the params (replay_file, plus
+ * replay_hdr for raw dumps) and set up pacing/impairments.
+ */
+int guppi_replay_init(struct guppi_replay *r,
+        const struct guppi_udp_params *p);
+
+/* Fill b[] with up to nmax packets.  Returns number of packets,
+ * 0 if none are due yet or the input is used up.
+ */
+int guppi_replay_recv_batch(struct guppi_replay *r,
+        struct guppi_udp_packet *b, int nmax);
+
+/* Sleep until the next packet is due.  Returns GUPPI_OK, or
+ * GUPPI_TIMEOUT once the input has run out.
+ */
+int guppi_replay_wait(struct guppi_replay *r);
+
+/* Release everything */
+int guppi_replay_close(struct guppi_replay *r);
+
+#endif
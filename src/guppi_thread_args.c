@@ -1,8 +1,22 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "fitshead.h"
+#include "guppi_status.h"
+#include "guppi_error.h"
 #include "guppi_thread_args.h"
 
 void guppi_thread_args_init(struct guppi_thread_args *a) {
     a->priority=0;
     a->finished=0;
+    a->cpus[0]='\0';
+    a->numa_node=-1;
+    a->reader=0;
     pthread_cond_init(&a->finished_c,NULL);
     pthread_mutex_init(&a->finished_m,NULL);
 }
@@ -37,3 +51,120 @@ int guppi_thread_finished(struct guppi_thread_args *a,
     return(rv);
 }
 
+/* Parse a CPU list like "0-3,8" or "!2,3" into set */
+static int guppi_parse_cpus(const char *list, cpu_set_t *set) {
+    const char *c = list;
+    char *end;
+    long lo, hi, i;
+    int exclude = 0;
+    if (*c=='!') {
+        exclude = 1;
+        c++;
+        sched_getaffinity(0, sizeof(cpu_set_t), set);
+    } else
+        CPU_ZERO(set);
+    while (*c!='\0' && *c!='\n') {
+        lo = hi = strtol(c, &end, 10);
+        if (end==c) return(GUPPI_ERR_PARAM);
+        c = end;
+        if (*c=='-') {
+            c++;
+            hi = strtol(c, &end, 10);
+            if (end==c) return(GUPPI_ERR_PARAM);
+            c = end;
+        }
+        if (lo<0 || hi<lo || hi>=CPU_SETSIZE) return(GUPPI_ERR_PARAM);
+        for (i=lo; i<=hi; i++) {
+            if (exclude) CPU_CLR(i, set);
+            else CPU_SET(i, set);
+        }
+        if (*c==',') c++;
+        else if (*c!='\0' && *c!='\n') return(GUPPI_ERR_PARAM);
+    }
+    if (CPU_COUNT(set)==0) return(GUPPI_ERR_PARAM);
+    return(GUPPI_OK);
+}
+
+/* CPUs belonging to a NUMA node */
+static int guppi_node_cpus(int node, cpu_set_t *set) {
+    char fname[128], list[1024];
+    sprintf(fname, "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(fname, "r");
+    if (f==NULL) return(GUPPI_ERR_PARAM);
+    char *rv = fgets(list, sizeof(list), f);
+    fclose(f);
+    if (rv==NULL) return(GUPPI_ERR_PARAM);
+    return(guppi_parse_cpus(list, set));
+}
+
+int guppi_thread_set_affinity(struct guppi_thread_args *a,
+        const char *tag, const char *def_cpus) {
+    char key[16], msg[256];
+    int rv;
+
+    /* Status keywords override whatever the args say */
+    struct guppi_status st;
+    if (guppi_status_attach(&st)==GUPPI_OK) {
+        guppi_status_lock(&st);
+        sprintf(key, "%.4sCPUS", tag);
+        hgets(st.buf, key, sizeof(a->cpus), a->cpus);
+        sprintf(key, "%.4sNODE", tag);
+        hgeti4(st.buf, key, &a->numa_node);
+        guppi_status_unlock(&st);
+        guppi_status_detach(&st);
+    }
+    if (a->cpus[0]=='\0' && a->numa_node<0) {
+        strncpy(a->cpus, def_cpus, sizeof(a->cpus)-1);
+        a->cpus[sizeof(a->cpus)-1] = '\0';
+    }
+
+    /* CPU affinity */
+    cpu_set_t cpuset;
+    rv = GUPPI_OK;
+    if (a->cpus[0]!='\0')
+        rv = guppi_parse_cpus(a->cpus, &cpuset);
+    else if (a->numa_node>=0)
+        rv = guppi_node_cpus(a->numa_node, &cpuset);
+    else
+        return(GUPPI_OK);
+    if (rv!=GUPPI_OK) {
+        sprintf(msg, "Bad CPU list '%s' / node %d for %s thread",
+                a->cpus, a->numa_node, tag);
+        guppi_error("guppi_thread_set_affinity", msg);
+        return(rv);
+    }
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset)<0) {
+        sprintf(msg, "Error setting %s thread cpu affinity.", tag);
+        guppi_error("guppi_thread_set_affinity", msg);
+        perror("sched_setaffinity");
+        return(GUPPI_ERR_SYS);
+    }
+
+    /* Prefer memory from the node */
+    if (a->numa_node>=0) {
+        unsigned long mask[16];
+        memset(mask, 0, sizeof(mask));
+        if (a->numa_node >= 8*sizeof(mask)) return(GUPPI_ERR_PARAM);
+        mask[a->numa_node/(8*sizeof(long))] |=
+            1UL << (a->numa_node%(8*sizeof(long)));
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+                    8*sizeof(mask))<0) {
+            sprintf(msg, "Error setting %s thread memory policy.", tag);
+            guppi_warn("guppi_thread_set_affinity", msg);
+        }
+    }
+
+    return(GUPPI_OK);
+}
+
+int guppi_thread_attr_cpus(pthread_attr_t *attr, const char *cpus) {
+    cpu_set_t cpuset;
+    if (cpus[0]=='\0') return(GUPPI_OK);
+    if (guppi_parse_cpus(cpus, &cpuset)!=GUPPI_OK) {
+        guppi_error("guppi_thread_attr_cpus", "Bad CPU list");
+        return(GUPPI_ERR_PARAM);
+    }
+    if (pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &cpuset))
+        return(GUPPI_ERR_SYS);
+    return(GUPPI_OK);
+}
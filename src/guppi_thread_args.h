@@ -11,6 +11,9 @@ struct guppi_thread_args {
     int input_buffer;
     int output_buffer;
     int priority;
+    char cpus[64];      /* CPUs to run on (see below), "" = default */
+    int numa_node;      /* NUMA node for thread and input buffer, -1=any */
+    int reader;         /* Input buffer reader id, 0=sole consumer */
     int finished;
     pthread_cond_t finished_c;
     pthread_mutex_t finished_m;
@@ -20,4 +23,20 @@ void guppi_thread_args_destroy(struct guppi_thread_args *a);
 void guppi_thread_set_finished(struct guppi_thread_args *a);
 int guppi_thread_finished(struct guppi_thread_args *a, 
         float timeout_sec);
+
+/* Set the calling thread's CPU affinity and NUMA memory policy.
+ * Settings come from the <tag>CPUS and <tag>NODE status keywords
+ * if present, else from a->cpus and a->numa_node, else def_cpus.
+ * CPU lists look like "0-3,8"; a leading '!' removes the listed
+ * CPUs from the current mask instead.  A NUMA node with no CPU
+ * list runs the thread on all of that node's CPUs.  The settings
+ * used are left in a.
+ */
+int guppi_thread_set_affinity(struct guppi_thread_args *a, 
+        const char *tag, const char *def_cpus);
+
+/* Set a CPU list (as above) in attributes for creating a thread.
+ * An empty list leaves attr unchanged.
+ */
+int guppi_thread_attr_cpus(pthread_attr_t *attr, const char *cpus);
 #endif
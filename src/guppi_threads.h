@@ -25,7 +25,7 @@ extern void cc(int sig);
 #  define STATUS_KEY "XXXSTAT"
 #  define TMP_STATUS_KEY 1
 #endif
-static void set_exit_status(struct guppi_status *s) {
+static inline void set_exit_status(struct guppi_status *s) {
     guppi_status_lock(s);
     hputs(s->buf, STATUS_KEY, "exiting");
     guppi_status_unlock(s);
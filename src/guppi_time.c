@@ -3,10 +3,13 @@
  * Routines dealing with time conversion.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
 #include <time.h>
 #include <sys/time.h>
 #include "slalib.h"
 #include "guppi_error.h"
+#include "guppi_time.h"
 
 int get_current_mjd(int *stt_imjd, int *stt_smjd, double *stt_offs) {
     int rv;
@@ -76,3 +79,132 @@ int get_current_lst(double mjd, int *lst_secs) {
     return(GUPPI_OK);
 }
 
+
+int get_mjd_from_timespec(const struct timespec *ts, 
+        int *stt_imjd, int *stt_smjd, double *stt_offs) {
+    int rv;
+    struct tm gmt;
+    double mjd;
+
+    if (gmtime_r(&ts->tv_sec, &gmt)==NULL) { return(GUPPI_ERR_SYS); }
+
+    slaCaldj(gmt.tm_year+1900, gmt.tm_mon+1, gmt.tm_mday, &mjd, &rv);
+    if (rv!=0) { return(GUPPI_ERR_GEN); }
+
+    if (stt_imjd!=NULL) { *stt_imjd = (int)mjd; }
+    if (stt_smjd!=NULL) { *stt_smjd = gmt.tm_hour*3600 + gmt.tm_min*60 
+        + gmt.tm_sec; }
+    if (stt_offs!=NULL) { *stt_offs = ts->tv_nsec*1e-9; }
+
+    return(GUPPI_OK);
+}
+
+double get_start_mjd(const struct timespec *ts, int round, int warn,
+        int *stt_imjd, int *stt_smjd, double *stt_offs) {
+    double resid;
+    if (ts->tv_sec!=0) 
+        get_mjd_from_timespec(ts, stt_imjd, stt_smjd, stt_offs);
+    else
+        get_current_mjd(stt_imjd, stt_smjd, stt_offs);
+    if (!round) return(0.0);
+    if (*stt_offs>0.5) { *stt_smjd+=1; *stt_offs-=1.0; }
+    if (*stt_smjd>=86400) { *stt_imjd+=1; *stt_smjd-=86400; }
+    resid = *stt_offs;
+    if (warn && fabs(resid)>0.1) { 
+        char msg[256];
+        sprintf(msg, "Second fraction = %3.1f ms > +/-100 ms", resid*1e3);
+        guppi_warn("get_start_mjd", msg);
+    }
+    *stt_offs = 0.0;
+    return(resid);
+}
+
+int guppi_pktclock_init(struct guppi_pktclock *c, int nmax) {
+    c->nmax = nmax>0 ? nmax : 0;
+    c->x = c->y = NULL;
+    if (c->nmax) {
+        c->x = (double *)malloc(sizeof(double) * c->nmax);
+        c->y = (double *)malloc(sizeof(double) * c->nmax);
+        if (c->x==NULL || c->y==NULL) {
+            guppi_pktclock_free(c);
+            guppi_error("guppi_pktclock_init", "malloc failed");
+            return(GUPPI_ERR_SYS);
+        }
+    }
+    guppi_pktclock_reset(c);
+    return(GUPPI_OK);
+}
+
+void guppi_pktclock_reset(struct guppi_pktclock *c) {
+    c->n = c->nfit = 0;
+    c->sec0 = 0;
+    c->seq0 = 0;
+    c->t0 = c->dt = c->rms = c->max = 0.0;
+}
+
+void guppi_pktclock_free(struct guppi_pktclock *c) {
+    if (c->x!=NULL) free(c->x);
+    if (c->y!=NULL) free(c->y);
+    c->x = c->y = NULL;
+    c->nmax = 0;
+}
+
+/* Least-squares line through the points with |residual| < clip
+ * from the current fit (all points if clip<=0).
+ */
+static void guppi_pktclock_fit(struct guppi_pktclock *c, double clip) {
+    double sx=0.0, sy=0.0, sxx=0.0, sxy=0.0, r;
+    int i, n=0;
+    for (i=0; i<c->n; i++) {
+        if (clip>0.0 && fabs(c->y[i] - c->t0 - c->dt*c->x[i]) >= clip)
+            continue;
+        sx += c->x[i];
+        sy += c->y[i];
+        sxx += c->x[i]*c->x[i];
+        sxy += c->x[i]*c->y[i];
+        n++;
+    }
+    const double d = n*sxx - sx*sx;
+    if (n<2 || d==0.0) return;
+    c->nfit = n;
+    c->dt = (n*sxy - sx*sy) / d;
+    c->t0 = (sy - c->dt*sx) / n;
+    c->rms = c->max = 0.0;
+    for (i=0; i<c->n; i++) {
+        r = c->y[i] - c->t0 - c->dt*c->x[i];
+        if (clip>0.0 && fabs(r) >= clip) continue;
+        c->rms += r*r;
+        if (fabs(r) > c->max) c->max = fabs(r);
+    }
+    c->rms = sqrt(c->rms / n);
+}
+
+int guppi_pktclock_add(struct guppi_pktclock *c, unsigned long long seq,
+        const struct timespec *ts) {
+    if (c->n>=c->nmax || ts->tv_sec==0) return(0);
+    if (c->n==0) {
+        c->sec0 = ts->tv_sec;
+        c->seq0 = seq;
+    }
+    c->x[c->n] = (double)(long long)(seq - c->seq0);
+    c->y[c->n] = (double)(ts->tv_sec - c->sec0) + 1e-9*ts->tv_nsec;
+    c->n++;
+    if (c->n<c->nmax) return(0);
+
+    /* Packets held up on the way in (interrupt coalescing, 
+     * scheduling) only ever arrive late; leave out the worst of
+     * them and fit again.
+     */
+    guppi_pktclock_fit(c, 0.0);
+    if (c->rms>0.0) guppi_pktclock_fit(c, 3.0*c->rms);
+    return(1);
+}
+
+void guppi_pktclock_time(const struct guppi_pktclock *c, 
+        unsigned long long seq, struct timespec *ts) {
+    double t = c->t0 + c->dt*(double)(long long)(seq - c->seq0);
+    double whole = floor(t);
+    ts->tv_sec = c->sec0 + (time_t)whole;
+    ts->tv_nsec = (long)((t - whole)*1e9);
+    if (ts->tv_nsec>=1000000000L) { ts->tv_sec++; ts->tv_nsec -= 1000000000L; }
+}
@@ -5,10 +5,24 @@
 #ifndef _GUPPI_TIME_H
 #define _GUPPI_TIME_H
 
+#include <time.h>
+
 /* Return current time using PSRFITS-style integer MJD, integer 
  * second time of day, and fractional second offset. */
 int get_current_mjd(int *stt_imjd, int *stt_smjd, double *stt_offs);
 
+/* Same, for a given (UTC) time instead of now. */
+int get_mjd_from_timespec(const struct timespec *ts, 
+        int *stt_imjd, int *stt_smjd, double *stt_offs);
+
+/* Obs start time from the given UTC time, or from the current time
+ * if that is zero.  If round is set, start time is rounded to the
+ * nearest integer second, with a warning (if warn is set) if we're
+ * off that by more than 100ms.  Returns the amount rounded off (s).
+ */
+double get_start_mjd(const struct timespec *ts, int round, int warn,
+        int *stt_imjd, int *stt_smjd, double *stt_offs);
+
 /* Return Y, M, D, h, m, and s for an MJD */
 int datetime_from_mjd(long double MJD, int *YYYY, int *MM, int *DD, 
                       int *h, int *m, double *s);
@@ -16,4 +30,38 @@ int datetime_from_mjd(long double MJD, int *YYYY, int *MM, int *DD,
 /* Return the LST (in sec) for the GBT at a specific MJD (UTC) */
 int get_current_lst(double mjd, int *lst_secs);
 
+/* Straight-line fit of packet arrival time against sequence
+ * number over the first nmax packets of an obs.  Gives the time
+ * any packet would arrive, and the actual packet period (ie, the
+ * sample clock).  Arrival times are measured relative to sec0.
+ */
+struct guppi_pktclock {
+    int nmax;                   /* Packets to fit, 0 = disabled */
+    int n;                      /* Packets so far */
+    time_t sec0;                /* Whole seconds of first arrival */
+    unsigned long long seq0;    /* First sequence number */
+    double *x;                  /* Seq num - seq0 */
+    double *y;                  /* Arrival time - sec0 (s) */
+    /* Results, set once n reaches nmax: */
+    int nfit;                   /* Packets used (outliers left out) */
+    double t0;                  /* Fitted arrival of seq0 - sec0 (s) */
+    double dt;                  /* Fitted packet period (s) */
+    double rms;                 /* RMS arrival residual (s) */
+    double max;                 /* Max arrival residual (s) */
+};
+
+int guppi_pktclock_init(struct guppi_pktclock *c, int nmax);
+void guppi_pktclock_reset(struct guppi_pktclock *c);
+void guppi_pktclock_free(struct guppi_pktclock *c);
+
+/* Add one packet.  Returns 1 when this packet completes the fit,
+ * else 0.  Packets with no timestamp are ignored.
+ */
+int guppi_pktclock_add(struct guppi_pktclock *c, unsigned long long seq,
+        const struct timespec *ts);
+
+/* Fitted arrival time of packet seq. */
+void guppi_pktclock_time(const struct guppi_pktclock *c, 
+        unsigned long long seq, struct timespec *ts);
+
 #endif
@@ -2,23 +2,66 @@
  *
  * UDP implementations.
  */
+#define _GNU_SOURCE 1
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <time.h>
+#include <errno.h>
 
 #include "guppi_udp.h"
+#include "guppi_pktring.h"
+#include "guppi_replay.h"
 #include "guppi_databuf.h"
 #include "guppi_error.h"
 
 int guppi_udp_init(struct guppi_udp_params *p) {
 
+    /* Memory-mapped capture ring instead of a UDP socket */
+    p->ring = NULL;
+    p->replay = NULL;
+    p->rxq_ovfl_on = 0;
+    p->timestamp_on = 0;
+    p->kernel_drops = 0;
+    p->nempty = 0;
+    p->nwakeup = 0;
+    if (strncmp(p->capture_mode, "TPACKET", 7)==0) {
+        p->ring = (struct guppi_pktring *)malloc(
+                sizeof(struct guppi_pktring));
+        int rv = guppi_pktring_init(p->ring, p->iface, p->port);
+        if (rv!=GUPPI_OK) {
+            free(p->ring);
+            p->ring = NULL;
+            return(rv);
+        }
+        p->sock = p->ring->sock;
+        p->pfd.fd = p->sock;
+        p->pfd.events = POLLIN;
+        return(GUPPI_OK);
+    }
+
+    /* Packets from a file instead of the network */
+    if (strncmp(p->capture_mode, "REPLAY", 6)==0) {
+        p->replay = (struct guppi_replay *)malloc(
+                sizeof(struct guppi_replay));
+        int rv = guppi_replay_init(p->replay, p);
+        if (rv!=GUPPI_OK) {
+            free(p->replay);
+            p->replay = NULL;
+            return(rv);
+        }
+        p->sock = -1;
+        return(GUPPI_OK);
+    }
+
     /* Resolve sender hostname */
     struct addrinfo hints;
     struct addrinfo *result, *rp;
@@ -39,6 +82,18 @@ int guppi_udp_init(struct guppi_udp_params *p) {
         return(GUPPI_ERR_SYS);
     }
 
+    /* Let several receive sockets share the port */
+    if (p->reuseport) {
+        int one = 1;
+        rv = setsockopt(p->sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        if (rv<0) {
+            guppi_error("guppi_udp_init", "Error setting SO_REUSEPORT.");
+            close(p->sock);
+            freeaddrinfo(result);
+            return(GUPPI_ERR_SYS);
+        }
+    }
+
     /* bind to local address */
     struct sockaddr_in local_ip;
     local_ip.sin_family =  AF_INET;
@@ -50,8 +105,12 @@ int guppi_udp_init(struct guppi_udp_params *p) {
         return(GUPPI_ERR_SYS);
     }
 
-    /* Set up socket to recv only from sender */
+    /* Set up socket to recv only from sender.  Connected sockets are 
+     * not load-balanced by SO_REUSEPORT (the kernel just picks one),
+     * so shared-port sockets are left unconnected.
+     */
     for (rp=result; rp!=NULL; rp=rp->ai_next) {
+        if (p->reuseport) { break; }
         if (connect(p->sock, rp->ai_addr, rp->ai_addrlen)==0) { break; }
     }
     if (rp==NULL) { 
@@ -79,6 +138,32 @@ int guppi_udp_init(struct guppi_udp_params *p) {
         printf("guppi_udp_init: SO_RCVBUF=%d\n", bufsize);
     }
 
+    /* Have the kernel report its drop count with each packet */
+    int one = 1;
+    rv = setsockopt(p->sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+    if (rv<0) 
+        guppi_warn("guppi_udp_init", 
+                "SO_RXQ_OVFL not available, kernel drops not counted.");
+    else
+        p->rxq_ovfl_on = 1;
+
+    /* Kernel receive timestamps, for timing the packet stream */
+    rv = setsockopt(p->sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+    if (rv<0) 
+        guppi_warn("guppi_udp_init", 
+                "SO_TIMESTAMPNS not available, no packet timestamps.");
+    else
+        p->timestamp_on = 1;
+
+    /* Let the kernel busy-poll the device queue on recv */
+    if (p->busy_poll>0) {
+        rv = setsockopt(p->sock, SOL_SOCKET, SO_BUSY_POLL, &p->busy_poll,
+                sizeof(int));
+        if (rv<0) 
+            guppi_warn("guppi_udp_init", 
+                    "Error setting SO_BUSY_POLL, spinning in user space only.");
+    }
+
     /* Poll command */
     p->pfd.fd = p->sock;
     p->pfd.events = POLLIN;
@@ -86,7 +171,41 @@ int guppi_udp_init(struct guppi_udp_params *p) {
     return(GUPPI_OK);
 }
 
+static double guppi_udp_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((double)ts.tv_sec + 1e-9*(double)ts.tv_nsec);
+}
+
+/* Busy-poll version of guppi_udp_wait.  Spin for a while, then back
+ * off to sleeps of doubling length.
+ */
+static int guppi_udp_spin(struct guppi_udp_params *p) {
+    if (p->nempty==0) p->idle_start = guppi_udp_now();
+    p->nempty++;
+    if (p->nempty <= GUPPI_UDP_SPIN) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        return(GUPPI_OK);
+    }
+    if (guppi_udp_now() - p->idle_start > 1.0) {
+        p->nempty = 0;
+        return(GUPPI_TIMEOUT);
+    }
+    unsigned shift = p->nempty - GUPPI_UDP_SPIN - 1;
+    long us = shift < 16 ? 1L<<shift : GUPPI_UDP_MAX_SLEEP_US;
+    if (us > GUPPI_UDP_MAX_SLEEP_US) us = GUPPI_UDP_MAX_SLEEP_US;
+    struct timespec ts = { 0, 1000*us };
+    nanosleep(&ts, NULL);
+    p->nwakeup++;
+    return(GUPPI_OK);
+}
+
 int guppi_udp_wait(struct guppi_udp_params *p) {
+    if (p->replay!=NULL) return(guppi_replay_wait(p->replay));
+    if (p->busy_poll) return(guppi_udp_spin(p));
+    p->nwakeup++;
     int rv = poll(&p->pfd, 1, 1000); /* Timeout 1sec */
     if (rv==1) { return(GUPPI_OK); } /* Data ready */
     else if (rv==0) { return(GUPPI_TIMEOUT); } /* Timed out */
@@ -94,7 +213,21 @@ int guppi_udp_wait(struct guppi_udp_params *p) {
 }
 
 int guppi_udp_recv(struct guppi_udp_params *p, struct guppi_udp_packet *b) {
-    int rv = recv(p->sock, b->data, GUPPI_MAX_PACKET_SIZE, 0);
+    int rv;
+    if (p->ring!=NULL) {
+        rv = guppi_pktring_recv_batch(p->ring, b, 1);
+        if (rv==0) { errno = EAGAIN; rv = -1; }
+        else { rv = b->packet_size; }
+    } else if (p->replay!=NULL) {
+        rv = guppi_replay_recv_batch(p->replay, b, 1);
+        if (rv==0) { errno = EAGAIN; rv = -1; }
+        else { rv = b->packet_size; }
+    } else {
+        b->data = b->buf;
+        b->payload = NULL;
+        b->rx_time.tv_sec = b->rx_time.tv_nsec = 0;
+        rv = recv(p->sock, b->data, GUPPI_MAX_PACKET_SIZE, 0);
+    }
     b->packet_size = rv;
     if (rv==-1) { return(GUPPI_ERR_SYS); }
     else if (p->packet_size) {
@@ -106,136 +239,242 @@ int guppi_udp_recv(struct guppi_udp_params *p, struct guppi_udp_packet *b) {
     }
 }
 
-unsigned long long change_endian64(const unsigned long long *d) {
-    unsigned long long tmp;
-    char *in=(char *)d, *out=(char *)&tmp;
+/* Common recvmmsg() code.  If dest is non-NULL, the data portion
+ * of packet i is scattered directly to dest + i*datasize, with the 
+ * hdr header bytes and trailing bytes going to the packet's buf.
+ */
+static int guppi_udp_recvmmsg(struct guppi_udp_params *p, 
+        struct guppi_udp_packet *b, int nmax, 
+        char *dest, size_t hdr, size_t datasize) {
+
+    /* Set up one msghdr per packet slot */
+    struct mmsghdr msgs[GUPPI_MAX_PACKET_BATCH];
+    struct iovec iovs[3*GUPPI_MAX_PACKET_BATCH];
+    char ctrl[GUPPI_MAX_PACKET_BATCH][CMSG_SPACE(sizeof(unsigned int))
+        + CMSG_SPACE(sizeof(struct timespec))];
     int i;
-    for (i=0; i<8; i++) {
-        out[i] = in[7-i];
+    memset(msgs, 0, sizeof(struct mmsghdr)*nmax);
+    for (i=0; i<nmax; i++) {
+        b[i].data = b[i].buf;
+        b[i].payload = NULL;
+        msgs[i].msg_hdr.msg_iov = &iovs[3*i];
+        if (p->rxq_ovfl_on || p->timestamp_on) {
+            msgs[i].msg_hdr.msg_control = ctrl[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+        }
+        if (dest==NULL) {
+            iovs[3*i].iov_base = b[i].buf;
+            iovs[3*i].iov_len = GUPPI_MAX_PACKET_SIZE;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        } else {
+            b[i].payload = dest + i*datasize;
+            iovs[3*i].iov_base = b[i].buf;
+            iovs[3*i].iov_len = hdr;
+            iovs[3*i+1].iov_base = b[i].payload;
+            iovs[3*i+1].iov_len = datasize;
+            iovs[3*i+2].iov_base = b[i].buf + hdr;
+            iovs[3*i+2].iov_len = GUPPI_MAX_PACKET_SIZE - hdr - datasize;
+            msgs[i].msg_hdr.msg_iovlen = 3;
+        }
+    }
+
+    /* Grab whatever is queued, without blocking */
+    int rv = recvmmsg(p->sock, msgs, nmax, MSG_DONTWAIT, NULL);
+    if (rv==-1) {
+        if (errno==EAGAIN || errno==EWOULDBLOCK) { return(0); }
+        return(GUPPI_ERR_SYS);
     }
-    return(tmp);
+    p->nempty = 0;
+    for (i=0; i<rv; i++) 
+        b[i].packet_size = msgs[i].msg_len;
+
+    /* Receive timestamps */
+    for (i=0; i<rv; i++) {
+        b[i].rx_time.tv_sec = b[i].rx_time.tv_nsec = 0;
+        if (!p->timestamp_on) continue;
+        struct msghdr *h = &msgs[i].msg_hdr;
+        struct cmsghdr *c;
+        for (c=CMSG_FIRSTHDR(h); c!=NULL; c=CMSG_NXTHDR(h, c)) {
+            if (c->cmsg_level==SOL_SOCKET && c->cmsg_type==SCM_TIMESTAMPNS) {
+                memcpy(&b[i].rx_time, CMSG_DATA(c), sizeof(struct timespec));
+                break;
+            }
+        }
+    }
+
+    /* The kernel drop count is cumulative, so only the newest
+     * packet's copy matters.  It is only sent once nonzero.
+     */
+    if (rv>0 && p->rxq_ovfl_on) {
+        struct msghdr *h = &msgs[rv-1].msg_hdr;
+        struct cmsghdr *c;
+        for (c=CMSG_FIRSTHDR(h); c!=NULL; c=CMSG_NXTHDR(h, c)) {
+            if (c->cmsg_level==SOL_SOCKET && c->cmsg_type==SO_RXQ_OVFL) {
+                unsigned int ndrop;
+                memcpy(&ndrop, CMSG_DATA(c), sizeof(ndrop));
+                p->kernel_drops = ndrop;
+            }
+        }
+    }
+
+    /* Learn packet size from the first packet if not specified */
+    if (rv>0 && p->packet_size==0) 
+        p->packet_size = b[0].packet_size;
+
+    return(rv);
+}
+
+int guppi_udp_recv_batch(struct guppi_udp_params *p, 
+        struct guppi_udp_packet *b, int nmax) {
+
+    if (nmax>GUPPI_MAX_PACKET_BATCH) nmax = GUPPI_MAX_PACKET_BATCH;
+    if (nmax<1) nmax = 1;
+
+    /* Ring backend hands out pointers into the ring */
+    if (p->ring!=NULL) {
+        int rv = guppi_pktring_recv_batch(p->ring, b, nmax);
+        if (rv>0) p->nempty = 0;
+        if (rv>0 && p->packet_size==0) 
+            p->packet_size = b[0].packet_size;
+        return(rv);
+    }
+
+    /* Replay copies packets out of the file */
+    if (p->replay!=NULL) {
+        int rv = guppi_replay_recv_batch(p->replay, b, nmax);
+        if (rv>0 && p->packet_size==0) 
+            p->packet_size = b[0].packet_size;
+        return(rv);
+    }
+
+    return(guppi_udp_recvmmsg(p, b, nmax, NULL, 0, 0));
+}
+
+unsigned long long change_endian64(const unsigned long long *d) {
+    unsigned long long tmp;
+    memcpy(&tmp, d, sizeof(tmp)); /* d may not be aligned */
+    return(__builtin_bswap64(tmp));
 }
 
 unsigned long long guppi_udp_packet_seq_num(const struct guppi_udp_packet *p) {
     return(change_endian64((unsigned long long *)(p->data)));
 }
 
-#define PACKET_SIZE_ORIG ((size_t)8208)
-#define PACKET_SIZE_SHORT ((size_t)544)
-#define PACKET_SIZE_1SFA ((size_t)8224)
-#define PACKET_SIZE_1SFA_OLD ((size_t)8160)
-#define PACKET_SIZE_FAST4K ((size_t)4128)
-
 size_t guppi_udp_packet_datasize(size_t packet_size) {
-    /* Special case for the new "1SFA" packets, which have an extra
-     * 16 bytes at the end reserved for future use.  All other guppi
+    /* Known formats come from the format table.  All other guppi
      * packets have 8 bytes index at the front, and 8 bytes error
      * flags at the end.
-     * NOTE: This represents the "full" packet output size...
      */
-    if (packet_size==PACKET_SIZE_1SFA) // 1SFA packet size
-        return((size_t)8192);
-    else if (packet_size==PACKET_SIZE_FAST4K) 
-        return((size_t)4096);
-    else if (packet_size==PACKET_SIZE_SHORT) 
-        //return((size_t)256);
-        return((size_t)512);
-    else              
+    const struct guppi_pktfmt *f = guppi_pktfmt_by_size(packet_size);
+    if (f!=NULL) 
+        return(f->data_size);
+    else
         return(packet_size - 2*sizeof(unsigned long long));
 }
 
 char *guppi_udp_packet_data(const struct guppi_udp_packet *p) {
     /* This is valid for all guppi packet formats */
+    if (p->payload!=NULL) return(p->payload);
     return((char *)(p->data) + sizeof(unsigned long long));
 }
 
 unsigned long long guppi_udp_packet_flags(const struct guppi_udp_packet *p) {
+    if (p->payload!=NULL)  /* Trailer was received after seq num */
+        return(*(unsigned long long *)((char *)(p->data) 
+                    + p->packet_size - guppi_udp_packet_datasize(p->packet_size)
+                    - sizeof(unsigned long long)));
     return(*(unsigned long long *)((char *)(p->data) 
                 + p->packet_size - sizeof(unsigned long long)));
 }
 
-/* Copy the data portion of a guppi udp packet to the given output
- * address.  This function takes care of expanding out the 
- * "missing" channels in 1SFA packets.
- */
-void guppi_udp_packet_data_copy(char *out, const struct guppi_udp_packet *p) {
-    if (p->packet_size==PACKET_SIZE_1SFA_OLD) {
-        /* Expand out, leaving space for missing data.  So far only 
-         * need to deal with 4k-channel case of 2 spectra per packet.
-         * May need to be updated in the future if 1SFA works with 
-         * different numbers of channels.
-         *
-         * TODO: Update 5/12/2009, newer 1SFA modes always will have full 
-         * data contents, and the old 4k ones never really worked, so
-         * this code can probably be deleted.
-         */
-        const size_t pad = 16;
-        const size_t spec_data_size = 4096 - 2*pad;
-        memset(out, 0, pad);
-        memcpy(out + pad, guppi_udp_packet_data(p), spec_data_size);
-        memset(out + pad + spec_data_size, 0, 2*pad);
-        memcpy(out + pad + spec_data_size + pad + pad, 
-                guppi_udp_packet_data(p) + spec_data_size, 
-                spec_data_size);
-        memset(out + pad + spec_data_size + pad
-                + pad + spec_data_size, 0, pad);
-    } else {
-        /* Packet has full data, just do a memcpy */
-        memcpy(out, guppi_udp_packet_data(p), 
-                guppi_udp_packet_datasize(p->packet_size));
-    }
-}
+int guppi_udp_recv_batch_direct(struct guppi_udp_params *p, 
+        struct guppi_udp_packet *b, int nmax, char *dest) {
 
-size_t parkes_udp_packet_datasize(size_t packet_size) {
-    return(packet_size - sizeof(unsigned long long));
-}
+    /* Fall back to normal recv where the data portion is not
+     * a plain copy of the packet contents.
+     */
+    if (p->ring!=NULL || p->replay!=NULL || !p->fmt.direct 
+            || p->packet_size!=p->fmt.packet_size)
+        return(guppi_udp_recv_batch(p, b, nmax));
 
-void parkes_to_guppi(struct guppi_udp_packet *b, const int acc_len, 
-        const int npol, const int nchan) {
+    if (nmax>GUPPI_MAX_PACKET_BATCH) nmax = GUPPI_MAX_PACKET_BATCH;
+    if (nmax<1) nmax = 1;
+    return(guppi_udp_recvmmsg(p, b, nmax, dest, 
+                p->fmt.header_size, p->fmt.data_size));
+}
 
-    /* Convert IBOB clock count to packet count.
-     * This assumes 2 samples per IBOB clock, and that
-     * acc_len is the actual accumulation length (=reg_acclen+1).
-     */
-    const unsigned int counts_per_packet = (nchan/2) * acc_len;
-    unsigned long long *packet_idx = (unsigned long long *)b->data;
-    (*packet_idx) = change_endian64(packet_idx);
-    (*packet_idx) /= counts_per_packet;
-    (*packet_idx) = change_endian64(packet_idx);
+void guppi_udp_packet_localize(struct guppi_udp_packet *p, 
+        const struct guppi_pktfmt *f) {
+    if (p->payload==NULL) return;
+    const size_t hdr = f->header_size;
+    const size_t datasize = f->data_size;
+    if (p->packet_size > hdr + datasize) 
+        memmove(p->buf + hdr + datasize, p->buf + hdr, 
+                p->packet_size - hdr - datasize);
+    memcpy(p->buf + hdr, p->payload, datasize);
+    p->data = p->buf;
+    p->payload = NULL;
+}
 
-    /* Reorder from the 2-pol Parkes ordering */
-    int i;
-    char tmp[GUPPI_MAX_PACKET_SIZE];
-    char *pol0, *pol1, *pol2, *pol3, *in;
-    in = b->data + sizeof(long long);
-    if (npol==2) {
-        pol0 = &tmp[0];
-        pol1 = &tmp[nchan];
-        for (i=0; i<nchan/2; i++) {
-            /* Each loop handles 2 values from each pol */
-            memcpy(pol0, in, 2*sizeof(char));
-            memcpy(pol1, &in[2], 2*sizeof(char));
-            pol0 += 2;
-            pol1 += 2;
-            in += 4;
-        }
-    } else if (npol==4) {
-        pol0 = &tmp[0];
-        pol1 = &tmp[nchan];
-        pol2 = &tmp[2*nchan];
-        pol3 = &tmp[3*nchan];
-        for (i=0; i<nchan; i++) {
-            /* Each loop handles one sample */
-            *pol0 = *in; in++; pol0++;
-            *pol1 = *in; in++; pol1++;
-            *pol2 = *in; in++; pol2++;
-            *pol3 = *in; in++; pol3++;
+/* Look up the socket's line in /proc/net/udp by inode */
+static int guppi_udp_proc_stats(int sock, long *rxq, 
+        unsigned long long *ndrop) {
+    struct stat sb;
+    if (fstat(sock, &sb)<0) return(GUPPI_ERR_SYS);
+    FILE *f = fopen("/proc/net/udp", "r");
+    if (f==NULL) return(GUPPI_ERR_SYS);
+    char line[512];
+    unsigned long q, inode;
+    unsigned long long drops;
+    int rv = GUPPI_ERR_PARAM;
+    while (fgets(line, sizeof(line), f)!=NULL) {
+        /* sl local rem st tx:rx tr:when retrnsmt uid timeout inode
+         * ref pointer drops */
+        if (sscanf(line, "%*s %*s %*s %*s %*x:%lx %*s %*s %*s %*s %lu "
+                    "%*s %*s %llu", &q, &inode, &drops)!=3)
+            continue;
+        if (inode==sb.st_ino) {
+            *rxq = q;
+            *ndrop = drops;
+            rv = GUPPI_OK;
+            break;
         }
     }
-    memcpy(b->data + sizeof(long long), tmp, sizeof(char) * npol * nchan);
+    fclose(f);
+    return(rv);
+}
+
+int guppi_udp_kernel_stats(struct guppi_udp_params *p,
+        unsigned long long *ndrop, long *rxq) {
+    *rxq = -1;
+    if (p->ring!=NULL) 
+        p->kernel_drops += guppi_pktring_drops(p->ring);
+    *ndrop = p->kernel_drops;
+    if (p->ring==NULL && p->replay==NULL) {
+        /* The proc counter is the same one SO_RXQ_OVFL reports, but
+         * is up to date even when no packets are arriving.
+         */
+        unsigned long long proc_drops;
+        if (guppi_udp_proc_stats(p->sock, rxq, &proc_drops)==GUPPI_OK
+                && proc_drops > *ndrop)
+            *ndrop = proc_drops;
+    }
+    return(GUPPI_OK);
 }
 
 int guppi_udp_close(struct guppi_udp_params *p) {
+    if (p->ring!=NULL) {
+        guppi_pktring_close(p->ring);
+        free(p->ring);
+        p->ring = NULL;
+        return(GUPPI_OK);
+    }
+    if (p->replay!=NULL) {
+        guppi_replay_close(p->replay);
+        free(p->replay);
+        p->replay = NULL;
+        return(GUPPI_OK);
+    }
     close(p->sock);
     return(GUPPI_OK);
 }
@@ -7,10 +7,20 @@
 #define _GUPPI_UDP_H
 
 #include <sys/types.h>
+#include <time.h>
 #include <netdb.h>
 #include <poll.h>
 
+#include "guppi_pktfmt.h"
+
 #define GUPPI_MAX_PACKET_SIZE 9000
+#define GUPPI_MAX_PACKET_BATCH 64
+
+/* Busy-poll backoff: spin this many times on an empty socket, then
+ * sleep for doubling intervals up to the max.
+ */
+#define GUPPI_UDP_SPIN 1024
+#define GUPPI_UDP_MAX_SLEEP_US 256
 
 /* Struct to hold connection parameters */
 struct guppi_udp_params {
@@ -20,11 +30,34 @@ struct guppi_udp_params {
     int port;         /* Receive port */
     size_t packet_size;     /* Expected packet size, 0 = don't care */
     char packet_format[32]; /* Packet format */
+    int batch_size;         /* Max packets per recv call */
+    char capture_mode[16];  /* "SOCKET", "TPACKET" or "REPLAY" */
+    char iface[32];         /* Capture interface (TPACKET mode) */
+    int reuseport;          /* Share port with other sockets */
+    int busy_poll;          /* Busy-poll time (us), 0 = block in poll() */
+    struct guppi_pktfmt fmt;    /* Format details, see guppi_pktfmt_init */
+
+    /* Replay input (REPLAY mode only), see guppi_replay.h */
+    char replay_file[256];  /* pcap file, or guppi_raw.dat */
+    char replay_hdr[256];   /* guppi_hdr.dat for raw dumps, else empty */
+    double replay_rate;     /* Packets/sec, 0 = as fast as possible */
+    double replay_loss;     /* Fraction of packets to drop */
+    double replay_reorder;  /* Fraction of packets to send late */
+    int replay_seed;        /* Seed for loss/reorder choices */
+    int replay_loops;       /* Passes through the file, 0 = forever */
 
     /* Derived from above: */
     int sock;                       /* Receive socket */
     struct addrinfo sender_addr;    /* Sender hostname/IP params */
     struct pollfd pfd;              /* Use to poll for avail data */
+    struct guppi_pktring *ring;     /* Capture ring, TPACKET mode only */
+    struct guppi_replay *replay;    /* Replay input, REPLAY mode only */
+    int rxq_ovfl_on;                /* SO_RXQ_OVFL is enabled */
+    int timestamp_on;               /* SO_TIMESTAMPNS is enabled */
+    unsigned nempty;                /* Empty recvs in a row (busy-poll) */
+    double idle_start;              /* Time socket went empty (busy-poll) */
+    unsigned long long nwakeup;     /* Times guppi_udp_wait slept */
+    unsigned long long kernel_drops; /* Packets dropped by kernel */
 };
 
 /* Basic structure of a packet.  This struct, functions should 
@@ -42,12 +75,15 @@ struct guppi_udp_params {
  */
 struct guppi_udp_packet {
     size_t packet_size;  /* packet size, bytes */
-    char data[GUPPI_MAX_PACKET_SIZE]; /* packet data */
+    char *data;          /* packet data, either buf or capture ring */
+    char *payload;       /* If non-NULL, data portion was received here */
+    struct timespec rx_time; /* Kernel receive time (UTC), 0 if unknown */
+    char buf[GUPPI_MAX_PACKET_SIZE]; /* local packet storage */
 };
+unsigned long long change_endian64(const unsigned long long *d);
 unsigned long long guppi_udp_packet_seq_num(const struct guppi_udp_packet *p);
 char *guppi_udp_packet_data(const struct guppi_udp_packet *p);
 size_t guppi_udp_packet_datasize(size_t packet_size);
-size_t parkes_udp_packet_datasize(size_t packet_size);
 unsigned long long guppi_udp_packet_flags(const struct guppi_udp_packet *p);
 
 /* Use sender and port fields in param struct to init
@@ -55,20 +91,49 @@ unsigned long long guppi_udp_packet_flags(const struct guppi_udp_packet *p);
  */
 int guppi_udp_init(struct guppi_udp_params *p);
 
-/* Wait for available data on the UDP socket */
+/* Wait for available data on the UDP socket.  In busy-poll mode
+ * this spins, then sleeps briefly, and returns GUPPI_OK right away
+ * so the caller tries to recv again.  GUPPI_TIMEOUT is returned
+ * after 1 sec with no data either way.
+ */
 int guppi_udp_wait(struct guppi_udp_params *p); 
 
 /* Read a packet */
 int guppi_udp_recv(struct guppi_udp_params *p, struct guppi_udp_packet *b);
 
-/* Convert a Parkes-style packet to a GUPPI-style packet */
-void parkes_to_guppi(struct guppi_udp_packet *b, const int acc_len, 
-        const int npol, const int nchan);
+/* Read up to nmax packets with a single system call.  Returns the
+ * number of packets read (0 if the socket is empty) or GUPPI_ERR_SYS.
+ * Packets of unexpected size are returned as-is; callers should
+ * compare each packet_size against p->packet_size.  Each packet's
+ * rx_time is filled in from the kernel timestamp where available.
+ */
+int guppi_udp_recv_batch(struct guppi_udp_params *p, 
+        struct guppi_udp_packet *b, int nmax);
+
+/* Like guppi_udp_recv_batch, but the data portion of packet i is
+ * received in place at dest + i*datasize (eg, straight into the 
+ * databuf slots the packets are expected to occupy).  Uses the
+ * format in p->fmt, and falls back to a normal batch recv for 
+ * formats that need conversion.
+ */
+int guppi_udp_recv_batch_direct(struct guppi_udp_params *p, 
+        struct guppi_udp_packet *b, int nmax, char *dest);
+
+/* Move the data portion of a directly-received packet back into
+ * the packet's own buffer.  Used when the packet did not land 
+ * where it was predicted to.
+ */
+void guppi_udp_packet_localize(struct guppi_udp_packet *p, 
+        const struct guppi_pktfmt *f);
 
-/* Copy a guppi packet to the specified location in memory, 
- * expanding out missing channels for 1SFA packets.
+/* Kernel-side socket stats.  ndrop is the total packets dropped by
+ * the kernel for lack of buffer space since the socket was opened
+ * (from SO_RXQ_OVFL, or the ring stats in TPACKET mode).  rxq is
+ * the number of bytes waiting in the socket receive queue, from
+ * /proc/net/udp, or -1 if not known.
  */
-void guppi_udp_packet_data_copy(char *out, const struct guppi_udp_packet *p);
+int guppi_udp_kernel_stats(struct guppi_udp_params *p,
+        unsigned long long *ndrop, long *rxq);
 
 /* Close out socket, etc */
 int guppi_udp_close(struct guppi_udp_params *p);
@@ -1200,6 +1200,328 @@ const char *keyword;    /* character string containing the name of the variable
 }
 
 
+/* Keyword index.  Each thread keeps, for the last few headers it
+ * searched, a hash of 8-character keyword to card offset, so that
+ * repeated lookups don't rescan the header.  Headers can change
+ * behind the index (other threads or processes, memcpy), so a hit
+ * is only used if the card it points to still has the keyword and
+ * END is still where it was, and the index is rebuilt before a
+ * keyword is reported missing.  hput keeps the index current for
+ * its own changes; a copy that adds an earlier duplicate of an
+ * indexed keyword is not noticed until the next rebuild.  Only
+ * keywords of 1-8 characters are indexed; anything else, or headers
+ * with cards ksearch could match away from column 1, get the full
+ * search.  Unlike the full search, cards after END are never found.
+ */
+
+#include <pthread.h>
+
+#define HINDEX_NBUF 16      /* Headers indexed per thread */
+#define HINDEX_SIZE 4096    /* Hash slots per header, power of 2 */
+#define HINDEX_MAXCARD 3072 /* Most cards indexed per header */
+
+struct hindex {
+    const char *hstring;    /* Header indexed, NULL if none */
+    int end;                /* Offset of END card */
+    int ncard;              /* Cards indexed */
+    int nonstd;             /* Full search needed (cards not indexed) */
+    unsigned long long used; /* For reuse of least recently used */
+    unsigned long long key[HINDEX_SIZE];
+    int off[HINDEX_SIZE];   /* Card offset + 1, 0 if slot empty */
+};
+
+struct hindex_set {
+    unsigned long long clock;
+    struct hindex h[HINDEX_NBUF];
+};
+
+static int hindex_on = 1;
+static pthread_key_t hindex_tkey;
+static pthread_once_t hindex_once = PTHREAD_ONCE_INIT;
+
+static void
+hindex_init ()
+{
+    pthread_key_create (&hindex_tkey, free);
+}
+
+/* Turn the keyword index on (1) or off (0) */
+void
+sethindex (hi)
+int hi;
+{ hindex_on = hi; return; }
+
+/* Pack a keyword of up to n characters into a blank-padded upper case
+ * 8-character key, as ksearch would match it.  Returns 0 if it can't
+ * be indexed.
+ */
+static unsigned long long
+hindex_key (keyword, n)
+const char *keyword;
+int n;
+{
+    unsigned long long k = 0;
+    int i, c;
+    for (i = 0; i < 8; i++) {
+        c = (i < n) ? (int) keyword[i] : 0;
+        if (c == 61 || c <= 32 || c >= 127) {
+            if (i == 0)
+                return (0);
+            for (; i < 8; i++)
+                k |= (unsigned long long) ' ' << (8*i);
+            break;
+            }
+        if (c >= 'a' && c <= 'z')
+            c += 'A' - 'a';
+        k |= (unsigned long long) c << (8*i);
+        }
+    return (k);
+}
+
+/* Key of the keyword starting a card, 0 if it doesn't start with one
+ * that fits in 8 characters
+ */
+static unsigned long long
+hindex_cardkey (card)
+const char *card;
+{
+    int i, c;
+    for (i = 0; i < 8; i++) {
+        c = (int) card[i];
+        if (c == 61 || c <= 32 || c >= 127)
+            break;
+        }
+    c = (int) card[i];
+    if (i == 0 || (c != 61 && c > 32 && c < 127))
+        return (0);
+    return (hindex_key (card, i));
+}
+
+static int
+hindex_slot (k)
+unsigned long long k;
+{
+    return ((int) ((k * 0x9E3779B97F4A7C15ULL) >> 52) & (HINDEX_SIZE-1));
+}
+
+/* Offset of keyword k in the index, or -1 */
+static int
+hindex_find (h, k)
+struct hindex *h;
+unsigned long long k;
+{
+    int i = hindex_slot (k);
+    while (h->off[i]) {
+        if (h->key[i] == k)
+            return (h->off[i] - 1);
+        i = (i + 1) & (HINDEX_SIZE-1);
+        }
+    return (-1);
+}
+
+/* Add or move keyword k.  Returns 0 if the index is full. */
+static int
+hindex_add (h, k, off, replace)
+struct hindex *h;
+unsigned long long k;
+int off, replace;
+{
+    int i = hindex_slot (k);
+    while (h->off[i]) {
+        if (h->key[i] == k) {
+            if (replace)
+                h->off[i] = off + 1;
+            return (1);
+            }
+        i = (i + 1) & (HINDEX_SIZE-1);
+        }
+    if (h->ncard >= HINDEX_MAXCARD)
+        return (0);
+    h->key[i] = k;
+    h->off[i] = off + 1;
+    h->ncard++;
+    return (1);
+}
+
+static const unsigned long long hindex_endkey = 0x2020202020444e45ULL;
+
+/* Index every card up to END.  Leaves h->hstring NULL if there is no
+ * END, or h->nonstd set if the header can't be indexed.
+ */
+static void
+hindex_build (h, hstring)
+struct hindex *h;
+const char *hstring;
+{
+    const char *card;
+    unsigned long long k;
+    int off, i;
+
+    memset (h->off, 0, sizeof (h->off));
+    h->hstring = NULL;
+    h->ncard = 0;
+    h->nonstd = 0;
+    for (off = 0; off + 80 <= 256000; off += 80) {
+        card = hstring + off;
+        for (i = 0; i < 9; i++) {
+            if (card[i] == 0)
+                return;
+            }
+        k = hindex_cardkey (card);
+        if (k == 0) {
+            /* ksearch could still match in a non-blank keyword field */
+            for (i = 0; i < 8 && card[i] == ' '; i++);
+            if (i < 8)
+                h->nonstd = 1;
+            continue;
+            }
+        if (!hindex_add (h, k, off, 0)) {
+            /* Too big, keep it so as not to rebuild on every search */
+            h->hstring = hstring;
+            h->nonstd = 1;
+            return;
+            }
+        if (k == hindex_endkey) {
+            h->end = off;
+            h->hstring = hstring;
+            return;
+            }
+        }
+}
+
+/* Index for a header, building it if need be */
+static struct hindex *
+hindex_get (hstring, built)
+const char *hstring;
+int *built;
+{
+    struct hindex_set *hs;
+    struct hindex *h, *old;
+    int i;
+
+    pthread_once (&hindex_once, hindex_init);
+    hs = (struct hindex_set *) pthread_getspecific (hindex_tkey);
+    if (hs == NULL) {
+        hs = (struct hindex_set *) calloc (1, sizeof (struct hindex_set));
+        if (hs == NULL)
+            return (NULL);
+        pthread_setspecific (hindex_tkey, hs);
+        }
+    hs->clock++;
+    *built = 0;
+    old = hs->h;
+    for (i = 0; i < HINDEX_NBUF; i++) {
+        h = hs->h + i;
+        if (h->hstring == hstring) {
+            h->used = hs->clock;
+            return (h);
+            }
+        if (h->used < old->used)
+            old = h;
+        }
+    hindex_build (old, hstring);
+    old->used = hs->clock;
+    *built = 1;
+    return (old->hstring == NULL ? NULL : old);
+}
+
+/* Look keyword up in the index.  Returns 1 if that gave the answer,
+ * with the card or NULL in *pval, or 0 if a full search is needed.
+ */
+static int
+hindex_search (hstring, keyword, pval)
+const char *hstring;
+const char *keyword;
+char **pval;
+{
+    struct hindex *h;
+    unsigned long long k;
+    int off, built, len, c;
+
+    if (!hindex_on)
+        return (0);
+    for (len = 0; keyword[len] != 0; len++) {
+        c = (int) keyword[len];
+        if (len == 8 || c == 61 || c <= 32 || c >= 127)
+            return (0);
+        }
+    k = hindex_key (keyword, len);
+    if (k == 0)
+        return (0);
+    h = hindex_get (hstring, &built);
+    if (h == NULL || h->nonstd)
+        return (0);
+
+    for (;;) {
+        off = hindex_find (h, k);
+        if (off >= 0 && hindex_cardkey (hstring + off) == k &&
+            hindex_cardkey (hstring + h->end) == hindex_endkey) {
+            *pval = (char *) hstring + off;
+            return (1);
+            }
+        if (built)
+            break;
+        hindex_build (h, hstring);
+        if (h->hstring == NULL)
+            return (0);
+        built = 1;
+        }
+
+    /* Not in a freshly built index */
+    if (off >= 0 || h->nonstd)
+        return (0);
+    *pval = NULL;
+    return (1);
+}
+
+/* Note a card hput has just written at card */
+void
+hindex_update (hstring, card)
+const char *hstring;
+const char *card;
+{
+    struct hindex_set *hs;
+    struct hindex *h;
+    unsigned long long k;
+    int i;
+
+    pthread_once (&hindex_once, hindex_init);
+    hs = (struct hindex_set *) pthread_getspecific (hindex_tkey);
+    if (hs == NULL)
+        return;
+    k = hindex_cardkey (card);
+    for (i = 0; i < HINDEX_NBUF; i++) {
+        h = hs->h + i;
+        if (h->hstring != hstring)
+            continue;
+        if (k == 0 || !hindex_add (h, k, (int) (card - hstring), 1))
+            h->hstring = NULL;
+        else if (k == hindex_endkey)
+            h->end = (int) (card - hstring);
+        return;
+        }
+}
+
+/* Forget the index for a header hput has rearranged, or all of them
+ * if hstring is NULL */
+void
+hindex_drop (hstring)
+const char *hstring;
+{
+    struct hindex_set *hs;
+    int i;
+
+    pthread_once (&hindex_once, hindex_init);
+    hs = (struct hindex_set *) pthread_getspecific (hindex_tkey);
+    if (hs == NULL)
+        return;
+    for (i = 0; i < HINDEX_NBUF; i++) {
+        if (hstring == NULL || hs->h[i].hstring == hstring)
+            hs->h[i].hstring = NULL;
+        }
+}
+
+
 /* Find FITS header line containing specified keyword */
 
 char *
@@ -1233,6 +1555,10 @@ const char *keyword;    /* character string containing the name of the variable
 
     pval = 0;
 
+/* Try the keyword index first */
+    if (hindex_search (hstring, keyword, &pval))
+        return (pval);
+
 /* Find current length of header string */
     if (lhead0)
         lmax = lhead0;
@@ -1921,4 +2247,6 @@ int     dropzero;       /* If nonzero, drop trailing zeroes */
  * Feb 28 2007  If header length is not set in hlength, set it to 0
  * May 31 2007  Add return value of 3 to isnum() if string has colon(s)
  * Aug 22 2007  If closing quote not found, make one up
+ *
+ * Oct 16 2026  Add per-thread keyword index to speed up ksearch()
  */
@@ -439,6 +439,7 @@ const char *value; /* character string containing the value for variable
 
             /* Move END down 80 characters */
             strncpy (v2, v1, 80);
+            hindex_update (hstring, v2);
             }
         else
             v2 = v1 + 80;
@@ -457,6 +458,7 @@ const char *value; /* character string containing the value for variable
 
         /* Insert comment */
         strncpy (v1+9,value,lv1);
+        hindex_update (hstring, v1);
         return (0);
         }
 
@@ -488,6 +490,7 @@ const char *value; /* character string containing the value for variable
                 }
 
             strncpy (v2, ve, 80);
+            hindex_update (hstring, v2);
             }
         else
             v2 = v1 + 80;
@@ -584,6 +587,7 @@ const char *value; /* character string containing the value for variable
                 fprintf (stderr,"HPUT: %s  = %s\n",keyword, value);
             }
 
+        hindex_update (hstring, v1);
         return (0);
 }
 
@@ -632,11 +636,13 @@ hputcom (hstring,keyword,comment)
 
         /* Move END down 80 characters */
         strncpy (v2, v1, 80);
+        hindex_update (hstring, v2);
 
         /*  blank out new line and insert keyword */
         for (vp = v1; vp < v2; vp++)
             *vp = ' ';
         strncpy (v1, keyword, lkeyword);
+        hindex_update (hstring, v1);
         c0 = v1 + lkeyword;
         }
 
@@ -790,6 +796,7 @@ const char *keyword;    /* Keyword of entry to be deleted */
             *v = ' ';
         }
 
+    hindex_drop (hstring);
     return (1);
 }
 
@@ -836,6 +843,8 @@ const char *keyword;    /* Keyword of entry to be deleted */
     for (i = 9; i < 80; i++)
         hplace[i] = ' ';
 
+    /* Cards moved, but hplace needn't be the start of the header */
+    hindex_drop (NULL);
     return (1);
 }
 
@@ -875,6 +884,7 @@ const char *keyword2;   /* New keyword name */
             }
         }
 
+    hindex_drop (hstring);
     return (1);
 }
 
@@ -1317,4 +1327,6 @@ int     ndec;           /* Number of decimal places in degree string */
  * Jan 16 2007  Fix bugs in ra2str() and dec2str() so ndec=0 works
  * Aug 20 2007  Fix bug so comments after quoted keywords work
  * Aug 22 2007  If closing quote not found, make one up
+ *
+ * Oct 16 2026  Keep ksearch() keyword index current as cards change
  */
@@ -0,0 +1,176 @@
+/* replay_guppi_databuf.c
+ *
+ * Refill a databuf from a tap file written by tap_guppi_databuf, as
+ * the producer for downstream threads.  Blocks go out as fast as
+ * they are freed, or with --realtime at the spacing they were
+ * originally received at.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+
+#include "guppi_error.h"
+#include "guppi_databuf.h"
+#include "guppi_dbtap.h"
+
+void usage() {
+    fprintf(stderr,
+            "Usage: replay_guppi_databuf [options] tap_file\n"
+            "Options:\n"
+            "  -i n, --id=n       Databuf id (1)\n"
+            "  -r, --realtime     Keep the original block spacing\n"
+            "  -l n, --loop=n     Play the file n times (0=forever) (1)\n"
+            "  -f, --futex        Use futex locks if creating the databuf\n"
+            "  -d, --direct       Read with O_DIRECT\n"
+            "  -q, --quiet        No per-block output\n"
+            "  -h, --help         This message\n"
+           );
+}
+
+/* control-c handler */
+int run=1;
+void stop_running(int sig) { run=0; }
+
+static double ts_sec(const struct timespec *ts) {
+    return((double)ts->tv_sec + 1e-9*(double)ts->tv_nsec);
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts_sec(&ts));
+}
+
+int main(int argc, char *argv[]) {
+
+    static struct option long_opts[] = {
+        {"help",     0, NULL, 'h'},
+        {"id",       1, NULL, 'i'},
+        {"realtime", 0, NULL, 'r'},
+        {"loop",     1, NULL, 'l'},
+        {"futex",    0, NULL, 'f'},
+        {"direct",   0, NULL, 'd'},
+        {"quiet",    0, NULL, 'q'},
+        {0,0,0,0}
+    };
+    int opt, opti, db_id=1, realtime=0, nloop=1, flags=0, direct=0;
+    int quiet=0;
+    while ((opt=getopt_long(argc,argv,"hi:rl:fdq",long_opts,&opti))!=-1) {
+        switch (opt) {
+            case 'i':
+                db_id = atoi(optarg);
+                break;
+            case 'r':
+                realtime = 1;
+                break;
+            case 'l':
+                nloop = atoi(optarg);
+                break;
+            case 'f':
+                flags |= GUPPI_DATABUF_FUTEX;
+                break;
+            case 'd':
+                direct = 1;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+            case 'h':
+                usage();
+                exit(0);
+                break;
+        }
+    }
+    if (optind==argc) {
+        usage();
+        exit(1);
+    }
+
+    struct guppi_dbtap tap;
+    if (guppi_dbtap_open(&tap, argv[optind], direct)!=GUPPI_OK) exit(1);
+
+    /* Use the existing databuf, or make one like the recorded one */
+    struct guppi_databuf *db = guppi_databuf_attach(db_id);
+    if (db==NULL)
+        db = guppi_databuf_create(tap.fh.n_block, tap.fh.block_size, db_id,
+                flags);
+    if (db==NULL) {
+        fprintf(stderr, "Error connecting to databuf %d\n", db_id);
+        exit(1);
+    }
+    if (db->block_size < tap.fh.block_size) {
+        fprintf(stderr, "Databuf %d blocks (%zd) smaller than recorded "
+                "blocks (%llu)\n", db_id, db->block_size,
+                tap.fh.block_size);
+        exit(1);
+    }
+
+    signal(SIGINT, stop_running);
+    signal(SIGTERM, stop_running);
+
+    int rv, curblock=0, iloop=0, first=1;
+    unsigned long long last_seq=0, nblock=0;
+    double t0=0.0, trec0=0.0;
+    const double tstart = now_sec();
+    while (run) {
+
+        rv = guppi_dbtap_read(&tap);
+        if (rv==GUPPI_TIMEOUT) {
+            /* End of file */
+            iloop++;
+            if ((nloop>0 && iloop>=nloop) || tap.nrec==0) break;
+            if (guppi_dbtap_rewind(&tap)!=GUPPI_OK) break;
+            first = 1;
+            continue;
+        }
+        if (rv!=GUPPI_OK) break;
+
+        /* Pace by receive time, or tap time if that wasn't kept */
+        const struct guppi_databuf_info *info = &tap.rec->info;
+        if (realtime) {
+            const double trec = info->rx_time.tv_sec ?
+                ts_sec(&info->rx_time) : ts_sec(&tap.rec->tap_time);
+            if (first) {
+                t0 = now_sec();
+                trec0 = trec;
+            }
+            const double wait = (trec - trec0) - (now_sec() - t0);
+            if (wait>0.0) {
+                struct timespec ts;
+                ts.tv_sec = (time_t)wait;
+                ts.tv_nsec = (long)(1e9*(wait - (double)ts.tv_sec));
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        while ((rv=guppi_databuf_wait_free(db, curblock))==GUPPI_TIMEOUT
+                && run);
+        if (rv!=GUPPI_OK) break;
+
+        /* Header text only needs copying when it changed */
+        const int changed = first || info->hdr_seq==0
+            || info->hdr_seq!=last_seq;
+        last_seq = info->hdr_seq;
+        first = 0;
+        if (guppi_dbtap_fill(&tap, db, curblock, changed)!=GUPPI_OK) break;
+        guppi_databuf_set_filled(db, curblock);
+        nblock++;
+        if (!quiet)
+            printf("block %d pktidx=%lld npkt=%d ndrop=%d\n", curblock,
+                    info->pktidx, info->npkt, info->ndrop);
+
+        curblock = (curblock + 1) % db->n_block;
+    }
+
+    const double t = now_sec() - tstart;
+    printf("Replayed %llu blocks in %.3f s (%.1f MB/s)\n", nblock, t,
+            t>0.0 ? 1e-6*(double)nblock*tap.fh.block_size/t : 0.0);
+    guppi_dbtap_close(&tap);
+    guppi_databuf_detach(db);
+
+    exit(0);
+}
@@ -0,0 +1,154 @@
+/* tap_guppi_databuf.c
+ *
+ * Record every filled block of a databuf (header, info, validity
+ * map and data) to a tap file.  By default the tap joins as an
+ * optional reader, so it never holds up the producer or the other
+ * consumers; blocks it can't keep up with are skipped.  With
+ * --consume it instead acts as the databuf's only consumer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include "guppi_error.h"
+#include "guppi_databuf.h"
+#include "guppi_dbtap.h"
+
+void usage() {
+    fprintf(stderr,
+            "Usage: tap_guppi_databuf [options] tap_file\n"
+            "Options:\n"
+            "  -i n, --id=n       Databuf id (1)\n"
+            "  -n n, --nblock=n   Stop after n blocks (0=until ctrl-c)\n"
+            "  -c, --consume      Act as the only consumer of the databuf\n"
+            "  -d, --direct       Write with O_DIRECT\n"
+            "  -q, --quiet        No per-block output\n"
+            "  -h, --help         This message\n"
+           );
+}
+
+/* control-c handler */
+int run=1;
+void stop_running(int sig) { run=0; }
+
+int main(int argc, char *argv[]) {
+
+    static struct option long_opts[] = {
+        {"help",    0, NULL, 'h'},
+        {"id",      1, NULL, 'i'},
+        {"nblock",  1, NULL, 'n'},
+        {"consume", 0, NULL, 'c'},
+        {"direct",  0, NULL, 'd'},
+        {"quiet",   0, NULL, 'q'},
+        {0,0,0,0}
+    };
+    int opt, opti, db_id=1, nmax=0, consume=0, direct=0, quiet=0;
+    while ((opt=getopt_long(argc,argv,"hi:n:cdq",long_opts,&opti))!=-1) {
+        switch (opt) {
+            case 'i':
+                db_id = atoi(optarg);
+                break;
+            case 'n':
+                nmax = atoi(optarg);
+                break;
+            case 'c':
+                consume = 1;
+                break;
+            case 'd':
+                direct = 1;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+            case 'h':
+                usage();
+                exit(0);
+                break;
+        }
+    }
+    if (optind==argc) {
+        usage();
+        exit(1);
+    }
+
+    struct guppi_databuf *db = guppi_databuf_attach(db_id);
+    if (db==NULL) {
+        fprintf(stderr, "Error attaching to databuf %d (may not exist).\n",
+                db_id);
+        exit(1);
+    }
+
+    int reader = 0;
+    if (!consume) {
+        reader = guppi_databuf_add_reader(db, 1);
+        if (reader<0) {
+            fprintf(stderr, "Can't add a reader to databuf %d "
+                    "(use --consume for semaphore databufs).\n", db_id);
+            exit(1);
+        }
+    }
+
+    struct guppi_dbtap tap;
+    if (guppi_dbtap_create(&tap, argv[optind], db, direct)!=GUPPI_OK) {
+        if (reader) guppi_databuf_remove_reader(db, reader);
+        exit(1);
+    }
+
+    signal(SIGINT, stop_running);
+    signal(SIGTERM, stop_running);
+
+    /* Follow the blocks in order, as the other consumers do */
+    int rv, curblock=0;
+    long long last_pktidx=-1, ngap=0, ntorn=0;
+    const int layout_seq = db->layout_seq;
+    while (run && (nmax==0 || tap.nrec<nmax)) {
+        if (db->layout_seq!=layout_seq) {
+            fprintf(stderr, "Databuf %d was reconfigured, stopping.\n",
+                    db_id);
+            break;
+        }
+        rv = guppi_databuf_wait_filled_reader(db, curblock, reader);
+        if (rv==GUPPI_TIMEOUT) continue;
+        if (rv!=GUPPI_OK) {
+            guppi_error("tap_guppi_databuf", "Error waiting for block");
+            break;
+        }
+
+        /* Only hold the block while copying it out.  As an optional
+         * reader the block can be refilled under us, so drop the
+         * copy if it was.
+         */
+        const unsigned long long gen = guppi_databuf_gen(db, curblock);
+        guppi_dbtap_copy(&tap, db, curblock);
+        const int torn = guppi_databuf_gen_changed(db, curblock, gen);
+        guppi_databuf_set_free_reader(db, curblock, reader);
+        curblock = (curblock + 1) % db->n_block;
+        if (torn) {
+            ntorn++;
+            continue;
+        }
+
+        const struct guppi_databuf_info *info = &tap.rec->info;
+        if (last_pktidx>=0 && info->npkt>0
+                && info->pktidx!=last_pktidx+info->npkt)
+            ngap++;
+        last_pktidx = info->pktidx;
+
+        if (guppi_dbtap_write(&tap)!=GUPPI_OK) break;
+        if (!quiet)
+            printf("block %d pktidx=%lld npkt=%d ndrop=%d\n",
+                    tap.rec->block_id, info->pktidx, info->npkt, 
+                    info->ndrop);
+    }
+
+    unsigned long long nskip = reader ? db->nskip[reader] : 0;
+    if (reader) guppi_databuf_remove_reader(db, reader);
+    guppi_dbtap_close(&tap);
+    printf("Recorded %llu blocks, skipped %llu (%lld while copying), "
+            "%lld gaps in pktidx\n", tap.nrec, nskip, ntorn, ngap);
+
+    exit(0);
+}
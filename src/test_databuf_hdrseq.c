@@ -0,0 +1,157 @@
+/* test_databuf_hdrseq.c
+ *
+ * Check that a steady observation keeps one header version.  A
+ * producer loop updates the status text the way the net thread does
+ * each block (drop and receive counters, thread state, per-stream
+ * counters), refreshes its snapshot with guppi_fitsbuf_update and
+ * copies it into each block with guppi_databuf_header_copy.  The
+ * blocks' hdr_seq must stay the same until an observation parameter
+ * changes, and then move on exactly once.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+
+#include "fitshead.h"
+#include "guppi_error.h"
+#include "guppi_status.h"
+#include "guppi_databuf.h"
+
+void usage() {
+    fprintf(stderr,
+            "Usage: test_databuf_hdrseq [options]\n"
+            "Options:\n"
+            "  -i n, --id=n       Scratch databuf id (9)\n"
+            "  -b n, --blocks=n   Blocks per steady run (100)\n"
+            "  -h, --help         This message\n"
+           );
+}
+
+/* What the receive side writes to the status buffer every block */
+static void put_block_stats(char *buf, int i) {
+    char key[9];
+    int j;
+    hputs(buf, "NETSTAT", i%3 ? "receiving" : "blocked");
+    hputr8(buf, "DROPAVG", 1e-4*(i%7));
+    hputr8(buf, "DROPTOT", 1e-5*i);
+    hputr8(buf, "DROPBLK", 1e-3*(i%5));
+    hputr8(buf, "NETPPSC", 8.0 + 0.1*(i%4));
+    hputi4(buf, "NETMISPR", i%3);
+    hputi4(buf, "NETLATE", i%2);
+    hputr8(buf, "KDROPBLK", 1e-3*(i%2));
+    hputr8(buf, "KDROPTOT", 1e-6*i);
+    hputi4(buf, "NETRXQ", 1024*(i%9));
+    hputr8(buf, "NETCPU", 50.0 + i%11);
+    hputr8(buf, "NETWAKE", 1000.0 + i);
+    for (j=0; j<2; j++) {
+        sprintf(key, "RXPKT%d", j);
+        hputr8(buf, key, 4096.0*i);
+        sprintf(key, "STRDBLK%d", j);
+        hputr8(buf, key, 1e-3*((i+j)%3));
+    }
+    hputi4(buf, "CURBLOCK", i%8);
+    hputs(buf, "DISKSTAT", "writing");
+    hputi4(buf, "STTVALID", 1);
+}
+
+/* hdr_seq of the last block run */
+static unsigned long long last=0;
+
+/* Run n blocks through db.  Returns the number of times hdr_seq
+ * moved on, counting from the last block of the previous run.
+ */
+static int run_blocks(struct guppi_databuf *db, char *st, char *status_buf,
+        int *hdr_changed, int i0, int n) {
+    int i, nseq=0;
+    for (i=i0; i<i0+n; i++) {
+        const int blk = i % db->n_block;
+        put_block_stats(st, i);
+        *hdr_changed |= guppi_fitsbuf_update(status_buf, st);
+        guppi_databuf_header_copy(db, blk, status_buf, *hdr_changed);
+        *hdr_changed = 0;
+        hputi4(guppi_databuf_header(db, blk), "PKTIDX", 4096*i);
+        const unsigned long long seq = guppi_databuf_info(db, blk)->hdr_seq;
+        if (seq!=last) nseq++;
+        last = seq;
+    }
+    return(nseq);
+}
+
+static int check(const char *what, int nseq, int want) {
+    printf("%-32s %3d header changes (want %d) %s\n", what, nseq, want,
+            nseq==want ? "OK" : "FAIL");
+    return(nseq!=want);
+}
+
+int main(int argc, char *argv[]) {
+
+    static struct option long_opts[] = {
+        {"help",   0, NULL, 'h'},
+        {"id",     1, NULL, 'i'},
+        {"blocks", 1, NULL, 'b'},
+        {0,0,0,0}
+    };
+    int opt, opti, db_id=9, nblock=100;
+    while ((opt=getopt_long(argc,argv,"hi:b:",long_opts,&opti))!=-1) {
+        switch (opt) {
+            case 'i':
+                db_id = atoi(optarg);
+                break;
+            case 'b':
+                nblock = atoi(optarg);
+                break;
+            default:
+            case 'h':
+                usage();
+                exit(0);
+                break;
+        }
+    }
+
+    struct guppi_databuf *db = guppi_databuf_create(8, 65536, db_id, 0);
+    if (db==NULL) {
+        fprintf(stderr, "Error creating databuf %d\n", db_id);
+        exit(1);
+    }
+
+    /* Status text as it stands at the start of an observation */
+    char *st = (char *)calloc(GUPPI_STATUS_SIZE, 1);
+    char *status_buf = (char *)calloc(GUPPI_STATUS_SIZE, 1);
+    guppi_fitsbuf_clear(st);
+    guppi_fitsbuf_clear(status_buf);
+    hputs(st, "OBS_MODE", "RAW");
+    hputs(st, "SRC_NAME", "B1937+21");
+    hputr8(st, "OBSFREQ", 1500.0);
+    hputr8(st, "OBSBW", 800.0);
+    hputi4(st, "OBSNCHAN", 2048);
+    hputi4(st, "BLOCSIZE", 65536);
+    hputi4(st, "STT_IMJD", 55000);
+
+    int nfail=0, hdr_changed=1, i=0;
+    nfail += check("Steady observation:",
+            run_blocks(db, st, status_buf, &hdr_changed, i, nblock), 1);
+    i += nblock;
+
+    /* A real parameter change moves the version on once */
+    hputs(st, "SRC_NAME", "J0437-4715");
+    nfail += check("Source changed:",
+            run_blocks(db, st, status_buf, &hdr_changed, i, nblock), 1);
+    i += nblock;
+
+    /* Keywords that only look like monitoring ones still count */
+    hputi4(st, "DROPAVGX", 1);
+    nfail += check("Non-monitoring keyword added:",
+            run_blocks(db, st, status_buf, &hdr_changed, i, nblock), 1);
+
+    free(st);
+    free(status_buf);
+    if (db->semid) semctl(db->semid, 0, IPC_RMID);
+    shmctl(db->shmid, IPC_RMID, NULL);
+    guppi_databuf_detach(db);
+
+    exit(nfail ? 1 : 0);
+}
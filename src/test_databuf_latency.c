@@ -0,0 +1,279 @@
+/* test_databuf_latency.c
+ *
+ * Time block handoff between a producer and a consumer thread
+ * for the SysV semaphore and futex databuf flavours.  Latency is
+ * measured from set_filled in the producer to the return of
+ * wait_filled in the consumer, with one block in flight at a time.
+ * Throughput is blocks per second with all blocks in use.
+ *
+ * A second test times a pass-through stage between two chained
+ * futex databufs, once copying each block's data and once handing
+ * it on with guppi_databuf_forward.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+
+#include "guppi_error.h"
+#include "guppi_databuf.h"
+
+void usage() {
+    fprintf(stderr,
+            "Usage: test_databuf_latency [options]\n"
+            "Options:\n"
+            "  -i n, --id=n       Scratch databuf id (9)\n"
+            "  -n n, --nblock=n   Blocks in databuf (8)\n"
+            "  -b n, --blocks=n   Handoffs per timing run (20000)\n"
+            "  -s n, --size=n     Block size for pass-through test (MB) (32)\n"
+            "  -h, --help         This message\n"
+           );
+}
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long)ts.tv_sec*1000000000LL + ts.tv_nsec);
+}
+
+static void remove_databuf(struct guppi_databuf *d) {
+    guppi_databuf_pool_release(d->databuf_id);
+    if (d->semid) semctl(d->semid, 0, IPC_RMID);
+    shmctl(d->shmid, IPC_RMID, NULL);
+    guppi_databuf_detach(d);
+}
+
+struct run_args {
+    struct guppi_databuf *db;
+    int nhandoff;
+    int pingpong;       /* Wait for each block to come back */
+    long long *lat;     /* Latency of each handoff (ns) */
+};
+
+static void *producer(void *_a) {
+    struct run_args *a = (struct run_args *)_a;
+    int i, blk, rv;
+    for (i=0; i<a->nhandoff; i++) {
+        blk = i % a->db->n_block;
+        while ((rv=guppi_databuf_wait_free(a->db, blk))==GUPPI_TIMEOUT);
+        if (rv!=GUPPI_OK) break;
+        if (a->pingpong && i>0) {
+            int prev = (i-1) % a->db->n_block;
+            while (guppi_databuf_wait_free(a->db, prev)==GUPPI_TIMEOUT);
+        }
+        *(long long *)guppi_databuf_data(a->db, blk) = now_ns();
+        guppi_databuf_set_filled(a->db, blk);
+    }
+    return(NULL);
+}
+
+static void *consumer(void *_a) {
+    struct run_args *a = (struct run_args *)_a;
+    int i, blk, rv;
+    for (i=0; i<a->nhandoff; i++) {
+        blk = i % a->db->n_block;
+        while ((rv=guppi_databuf_wait_filled(a->db, blk))==GUPPI_TIMEOUT);
+        if (rv!=GUPPI_OK) break;
+        a->lat[i] = now_ns() - *(long long *)guppi_databuf_data(a->db, blk);
+        guppi_databuf_set_free(a->db, blk);
+    }
+    return(NULL);
+}
+
+/* Pass-through stage from db to db2, then a sink on db2 */
+struct chain_args {
+    struct guppi_databuf *db, *db2;
+    int nhandoff;
+    int forward;        /* Forward instead of copying */
+    int nbad;           /* Blocks arriving with the wrong data */
+};
+
+static void *chain_stage(void *_a) {
+    struct chain_args *a = (struct chain_args *)_a;
+    int i, blk, rv;
+    for (i=0; i<a->nhandoff; i++) {
+        blk = i % a->db->n_block;
+        while ((rv=guppi_databuf_wait_filled(a->db, blk))==GUPPI_TIMEOUT);
+        if (rv!=GUPPI_OK) break;
+        while ((rv=guppi_databuf_wait_free(a->db2, blk))==GUPPI_TIMEOUT);
+        if (rv!=GUPPI_OK) break;
+        if (a->forward)
+            guppi_databuf_forward(a->db, blk, a->db2, blk);
+        else
+            memcpy(guppi_databuf_data(a->db2, blk), 
+                    guppi_databuf_data(a->db, blk), a->db->block_size);
+        guppi_databuf_set_filled(a->db2, blk);
+        guppi_databuf_set_free(a->db, blk);
+    }
+    return(NULL);
+}
+
+static void *chain_sink(void *_a) {
+    struct chain_args *a = (struct chain_args *)_a;
+    int i, blk, rv;
+    for (i=0; i<a->nhandoff; i++) {
+        blk = i % a->db2->n_block;
+        while ((rv=guppi_databuf_wait_filled(a->db2, blk))==GUPPI_TIMEOUT);
+        if (rv!=GUPPI_OK) break;
+        const char *data = guppi_databuf_data(a->db2, blk);
+        if (*(int *)data!=i 
+                || *(int *)(data + a->db2->block_size - sizeof(int))!=i)
+            a->nbad++;
+        guppi_databuf_set_free(a->db2, blk);
+    }
+    return(NULL);
+}
+
+static double run_chain(struct guppi_databuf *db, struct guppi_databuf *db2,
+        int nhandoff, int forward, int *nbad) {
+    struct chain_args a;
+    pthread_t sid, kid;
+    int i, blk, rv;
+    a.db = db;
+    a.db2 = db2;
+    a.nhandoff = nhandoff;
+    a.forward = forward;
+    a.nbad = 0;
+    guppi_databuf_clear(db);
+    guppi_databuf_clear(db2);
+    long long t0 = now_ns();
+    pthread_create(&kid, NULL, chain_sink, &a);
+    pthread_create(&sid, NULL, chain_stage, &a);
+    for (i=0; i<nhandoff; i++) {
+        blk = i % db->n_block;
+        while ((rv=guppi_databuf_wait_free(db, blk))==GUPPI_TIMEOUT);
+        if (rv!=GUPPI_OK) break;
+        char *data = guppi_databuf_data(db, blk);
+        *(int *)data = i;
+        *(int *)(data + db->block_size - sizeof(int)) = i;
+        guppi_databuf_set_filled(db, blk);
+    }
+    pthread_join(sid, NULL);
+    pthread_join(kid, NULL);
+    *nbad = a.nbad;
+    return(1e-9*(double)(now_ns()-t0));
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    const long long x = *(const long long *)a, y = *(const long long *)b;
+    return((x>y) - (x<y));
+}
+
+static double run(struct guppi_databuf *db, int nhandoff, int pingpong,
+        long long *lat) {
+    struct run_args a;
+    pthread_t pid, cid;
+    a.db = db;
+    a.nhandoff = nhandoff;
+    a.pingpong = pingpong;
+    a.lat = lat;
+    guppi_databuf_clear(db);
+    long long t0 = now_ns();
+    pthread_create(&cid, NULL, consumer, &a);
+    pthread_create(&pid, NULL, producer, &a);
+    pthread_join(pid, NULL);
+    pthread_join(cid, NULL);
+    return(1e-9*(double)(now_ns()-t0));
+}
+
+int main(int argc, char *argv[]) {
+
+    static struct option long_opts[] = {
+        {"help",   0, NULL, 'h'},
+        {"id",     1, NULL, 'i'},
+        {"nblock", 1, NULL, 'n'},
+        {"blocks", 1, NULL, 'b'},
+        {"size",   1, NULL, 's'},
+        {0,0,0,0}
+    };
+    int opt, opti, db_id=9, nblock=8, nhandoff=20000, size_mb=32;
+    while ((opt=getopt_long(argc,argv,"hi:n:b:s:",long_opts,&opti))!=-1) {
+        switch (opt) {
+            case 'i':
+                db_id = atoi(optarg);
+                break;
+            case 'n':
+                nblock = atoi(optarg);
+                break;
+            case 'b':
+                nhandoff = atoi(optarg);
+                break;
+            case 's':
+                size_mb = atoi(optarg);
+                break;
+            default:
+            case 'h':
+                usage();
+                exit(0);
+                break;
+        }
+    }
+
+    long long *lat = (long long *)malloc(sizeof(long long) * nhandoff);
+    const int flavours[2] = {0, GUPPI_DATABUF_FUTEX};
+    const char *names[2] = {"semaphore", "futex"};
+    int f;
+    printf("%-10s %10s %10s %10s %12s\n", "locks", "mean(us)",
+            "median(us)", "99%(us)", "blocks/s");
+    for (f=0; f<2; f++) {
+
+        /* Use a small private databuf, clearing out any leftovers */
+        struct guppi_databuf *db = guppi_databuf_attach(db_id);
+        if (db!=NULL) remove_databuf(db);
+        db = guppi_databuf_create(nblock, 65536, db_id, flavours[f]);
+        if (db==NULL) {
+            fprintf(stderr, "Error creating databuf %d\n", db_id);
+            exit(1);
+        }
+
+        /* One block at a time, for latency */
+        run(db, nhandoff, 1, lat);
+        double mean=0.0;
+        int i;
+        for (i=0; i<nhandoff; i++) mean += lat[i];
+        mean /= nhandoff;
+        qsort(lat, nhandoff, sizeof(long long), cmp_ll);
+        const double median = 1e-3*lat[nhandoff/2];
+        const double p99 = 1e-3*lat[(int)(0.99*nhandoff)];
+
+        /* All blocks in use, for throughput */
+        double t = run(db, nhandoff, 0, lat);
+
+        printf("%-10s %10.2f %10.2f %10.2f %12.0f\n", names[f],
+                1e-3*mean, median, p99, nhandoff/t);
+        remove_databuf(db);
+    }
+    free(lat);
+
+    /* Pass-through stage, copy vs forward */
+    const size_t block_size = (size_t)size_mb << 20;
+    const int nchain = nhandoff / 100 > nblock ? nhandoff / 100 : nblock;
+    struct guppi_databuf *db = guppi_databuf_attach(db_id);
+    if (db!=NULL) remove_databuf(db);
+    struct guppi_databuf *db2 = guppi_databuf_attach(db_id+1);
+    if (db2!=NULL) remove_databuf(db2);
+    db = guppi_databuf_create(nblock, block_size, db_id, 
+            GUPPI_DATABUF_FUTEX);
+    db2 = guppi_databuf_create(nblock, block_size, db_id+1, 
+            GUPPI_DATABUF_FUTEX);
+    if (db==NULL || db2==NULL) {
+        fprintf(stderr, "Error creating databufs %d,%d\n", db_id, db_id+1);
+        exit(1);
+    }
+    printf("\n%-10s %10s %12s %10s\n", "stage", "blocks", "MB/s", "bad");
+    for (f=0; f<2; f++) {
+        int nbad;
+        double t = run_chain(db, db2, nchain, f, &nbad);
+        printf("%-10s %10d %12.0f %10d\n", f ? "forward" : "copy",
+                nchain, nchain * (double)size_mb / t, nbad);
+    }
+    remove_databuf(db);
+    remove_databuf(db2);
+
+    exit(0);
+}
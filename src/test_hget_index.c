@@ -0,0 +1,248 @@
+/* test_hget_index.c
+ *
+ * Check and time the keyword index ksearch uses for hget/hput.
+ * Every keyword in a status-style header, plus some that aren't
+ * there, is looked up with the index off and on and the cards found
+ * compared, before and after the header is changed with hput, hdel,
+ * hchange and a plain copy.  Then the per-block parameter parsing
+ * (guppi_read_subint_params) and the full guppi_read_obs_params are
+ * timed both ways.
+ *
+ * The header is read from a file (e.g. a dump of the status shared
+ * memory) or made up from the keywords guppi_params reads plus
+ * filler cards.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "fitshead.h"
+#include "guppi_error.h"
+#include "guppi_status.h"
+#include "guppi_params.h"
+
+void usage() {
+    fprintf(stderr,
+            "Usage: test_hget_index [options]\n"
+            "Options:\n"
+            "  -f file, --file=file  Read header from file\n"
+            "  -k n, --filler=n      Filler cards in made up header (200)\n"
+            "  -b n, --blocks=n      Blocks per timing run (20000)\n"
+            "  -h, --help            This message\n"
+           );
+}
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long)ts.tv_sec*1000000000LL + ts.tv_nsec);
+}
+
+/* Header with the keywords guppi_params reads, filler cards spread
+ * before and after them.
+ */
+static void make_header(char *buf, int nfill) {
+    int i;
+    char key[16];
+    memset(buf, 0, GUPPI_STATUS_SIZE);
+    memset(buf, ' ', GUPPI_STATUS_CARD);
+    memcpy(buf, "END", 3);
+    for (i=0; i<nfill/2; i++) {
+        sprintf(key, "FILL%04d", i);
+        hputi4(buf, key, i);
+    }
+    hputs(buf, "OBS_MODE", "SEARCH");
+    hputs(buf, "TELESCOP", "GBT");
+    hputs(buf, "OBSERVER", "Test");
+    hputs(buf, "SRC_NAME", "B1937+21");
+    hputs(buf, "FRONTEND", "Rcvr1_2");
+    hputs(buf, "BACKEND", "GUPPI");
+    hputs(buf, "PROJID", "TEST");
+    hputs(buf, "FD_POLN", "LIN");
+    hputs(buf, "POL_TYPE", "AABBCRCI");
+    hputs(buf, "TRK_MODE", "TRACK");
+    hputs(buf, "RA_STR", "19:39:38.56");
+    hputs(buf, "DEC_STR", "+21:34:59.1");
+    hputs(buf, "CAL_MODE", "OFF");
+    hputs(buf, "DATADIR", "/tmp");
+    hputr8(buf, "OBSFREQ", 1500.0);
+    hputr8(buf, "OBSBW", 800.0);
+    hputi4(buf, "OBSNCHAN", 2048);
+    hputi4(buf, "NPOL", 4);
+    hputi4(buf, "NBITS", 8);
+    hputr8(buf, "TBIN", 2.56e-6);
+    hputr8(buf, "CHAN_BW", 0.390625);
+    hputi4(buf, "SCANNUM", 7);
+    hputi4(buf, "STT_IMJD", 55000);
+    hputi4(buf, "STT_SMJD", 3600);
+    hputr8(buf, "STT_OFFS", 0.0);
+    hputi4(buf, "BLOCSIZE", 33554432);
+    hputr8(buf, "AZ", 123.4);
+    hputr8(buf, "ZA", 45.6);
+    hputr8(buf, "RA", 294.9);
+    hputr8(buf, "DEC", 21.58);
+    hputi4(buf, "ACC_LEN", 16);
+    for (; i<nfill; i++) {
+        sprintf(key, "FILL%04d", i);
+        hputi4(buf, key, i);
+    }
+    hputi4(buf, "PKTIDX", 0);
+    hputi4(buf, "PKTSIZE", 8192);
+    hputi4(buf, "NPKT", 4096);
+    hputi4(buf, "NDROP", 0);
+    hputr8(buf, "DROPAVG", 0.0);
+    hputr8(buf, "DROPTOT", 0.0);
+    hputi4(buf, "STTVALID", 1);
+}
+
+/* Compare ksearch with and without the index for every keyword in
+ * the header and a few that aren't.  Returns the number that differ.
+ */
+static int check_header(const char *buf) {
+    static const char *extra[] = { "NOTHERE", "FILL", "FILL00000", "OBS",
+        "obs_mode", "Npol", "END", "A B", "", "TOOLONGKEY", NULL };
+    char key[10], *c0, *c1;
+    int i, j, nbad=0;
+    for (i=0; i<GUPPI_STATUS_SIZE; i+=GUPPI_STATUS_CARD) {
+        if (buf[i]==0) break;
+        for (j=0; j<8 && buf[i+j]!=' ' && buf[i+j]!='='; j++)
+            key[j] = buf[i+j];
+        key[j] = '\0';
+        if (j==0) continue;
+        sethindex(0);
+        c0 = ksearch(buf, key);
+        sethindex(1);
+        c1 = ksearch(buf, key);
+        if (c0!=c1) {
+            printf("  %-8s: card %ld without index, %ld with\n", key,
+                    c0 ? (long)(c0-buf)/GUPPI_STATUS_CARD : -1L,
+                    c1 ? (long)(c1-buf)/GUPPI_STATUS_CARD : -1L);
+            nbad++;
+        }
+        if (strcmp(key, "END")==0) break;
+    }
+    for (i=0; extra[i]!=NULL; i++) {
+        sethindex(0);
+        c0 = ksearch(buf, extra[i]);
+        sethindex(1);
+        c1 = ksearch(buf, extra[i]);
+        if (c0!=c1) {
+            printf("  '%s': differs with index\n", extra[i]);
+            nbad++;
+        }
+    }
+    return(nbad);
+}
+
+/* Time n blocks worth of parameter parsing, us per block */
+static double time_parse(char *buf, int n, int full,
+        struct guppi_params *g, struct psrfits *p) {
+    int i;
+    long long t0 = now_ns();
+    for (i=0; i<n; i++) {
+        hputi4(buf, "PKTIDX", 4096*i);
+        if (full) guppi_read_obs_params(buf, g, p);
+        else guppi_read_subint_params(buf, g, p);
+    }
+    return(1e-3 * (double)(now_ns() - t0) / (double)n);
+}
+
+int main(int argc, char *argv[]) {
+
+    static struct option long_opts[] = {
+        {"help",   0, NULL, 'h'},
+        {"file",   1, NULL, 'f'},
+        {"filler", 1, NULL, 'k'},
+        {"blocks", 1, NULL, 'b'},
+        {0,0,0,0}
+    };
+    int opt, opti, nfill=200, nblock=20000;
+    char *fname=NULL;
+    while ((opt=getopt_long(argc,argv,"hf:k:b:",long_opts,&opti))!=-1) {
+        switch (opt) {
+            case 'f':
+                fname = optarg;
+                break;
+            case 'k':
+                nfill = atoi(optarg);
+                break;
+            case 'b':
+                nblock = atoi(optarg);
+                break;
+            default:
+            case 'h':
+                usage();
+                exit(0);
+                break;
+        }
+    }
+
+    char *buf = (char *)malloc(GUPPI_STATUS_SIZE);
+    char *buf2 = (char *)malloc(GUPPI_STATUS_SIZE);
+    if (fname!=NULL) {
+        FILE *f = fopen(fname, "r");
+        if (f==NULL) {
+            fprintf(stderr, "Error opening %s\n", fname);
+            exit(1);
+        }
+        memset(buf, 0, GUPPI_STATUS_SIZE);
+        size_t n = fread(buf, 1, GUPPI_STATUS_SIZE-1, f);
+        fclose(f);
+        if (n==0 || ksearch(buf, "END")==NULL) {
+            fprintf(stderr, "No FITS header in %s\n", fname);
+            exit(1);
+        }
+    } else {
+        /* Leave room in the status buffer for the other keywords */
+        const int maxfill = GUPPI_STATUS_SIZE/GUPPI_STATUS_CARD - 100;
+        if (nfill>maxfill) nfill = maxfill;
+        make_header(buf, nfill);
+    }
+    printf("Header: %ld cards\n",
+            (long)(ksearch(buf, "END")-buf)/GUPPI_STATUS_CARD + 1);
+
+    /* Lookups agree with the full search, also as the header changes */
+    int nbad = check_header(buf);
+    printf("Unchanged header: %d mismatches\n", nbad);
+    hputi4(buf, "NEWKEY", 1);
+    hputs(buf, "OBS_MODE", "RAW");
+    hputc(buf, "COMMENT", "index test");
+    nbad += check_header(buf);
+    hdel(buf, "NEWKEY");
+    hdel(buf, "OBSBW");
+    nbad += check_header(buf);
+    hchange(buf, "OBSFREQ", "OBSFRQ");
+    hchange(buf, "OBSFRQ", "OBSFREQ");
+    nbad += check_header(buf);
+    hputr8(buf, "OBSBW", 800.0);
+    hputs(buf, "OBS_MODE", "SEARCH");
+    memcpy(buf2, buf, GUPPI_STATUS_SIZE);
+    make_header(buf, nfill/2);
+    nbad += check_header(buf);
+    memcpy(buf, buf2, GUPPI_STATUS_SIZE);
+    nbad += check_header(buf);
+    printf("After changes: %d mismatches\n", nbad);
+
+    /* Parse timing */
+    struct guppi_params *g =
+        (struct guppi_params *)calloc(1, sizeof(struct guppi_params));
+    struct psrfits *p = (struct psrfits *)calloc(1, sizeof(struct psrfits));
+    guppi_read_obs_params(buf, g, p);
+    printf("%-24s %10s %10s %8s\n", "us/block", "no index", "index",
+            "speedup");
+    int full;
+    for (full=0; full<2; full++) {
+        sethindex(0);
+        const double t0 = time_parse(buf, nblock, full, g, p);
+        sethindex(1);
+        const double t1 = time_parse(buf, nblock, full, g, p);
+        printf("%-24s %10.2f %10.2f %7.1fx\n",
+                full ? "guppi_read_obs_params" : "guppi_read_subint_params",
+                t0, t1, t1>0.0 ? t0/t1 : 0.0);
+    }
+    guppi_free_psrfits(p);
+
+    exit(nbad ? 1 : 0);
+}
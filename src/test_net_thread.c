@@ -79,7 +79,8 @@ int main(int argc, char *argv[]) {
     dbuf = guppi_databuf_attach(net_args.output_buffer);
     /* If attach fails, first try to create the databuf */
     if (dbuf==NULL) 
-        dbuf = guppi_databuf_create(24, 32*1024*1024, net_args.output_buffer);
+        dbuf = guppi_databuf_create(24, 32*1024*1024, net_args.output_buffer,
+                0);
     /* If that also fails, exit */
     if (dbuf==NULL) {
         fprintf(stderr, "Error connecting to guppi_databuf\n");
@@ -0,0 +1,150 @@
+/* test_parkes_reorder.c
+ *
+ * Check the Parkes packet reorder kernels against the scalar
+ * version, and time them for a range of channel counts.  Also
+ * times packet sequence number decoding.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/time.h>
+
+#include "guppi_udp.h"
+#include "guppi_parkes.h"
+
+void usage() {
+    fprintf(stderr,
+            "Usage: test_parkes_reorder [options]\n"
+            "Options:\n"
+            "  -n n, --npacket=n  Packets per timing run (10000)\n"
+            "  -h, --help         This message\n"
+           );
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return((double)tv.tv_sec + 1e-6*(double)tv.tv_usec);
+}
+
+/* Original byte-at-a-time version, for comparison */
+static unsigned long long change_endian64_bytes(const unsigned long long *d) {
+    unsigned long long tmp;
+    char *in=(char *)d, *out=(char *)&tmp;
+    int i;
+    for (i=0; i<8; i++) {
+        out[i] = in[7-i];
+    }
+    return(tmp);
+}
+
+int main(int argc, char *argv[]) {
+
+    static struct option long_opts[] = {
+        {"help",    0, NULL, 'h'},
+        {"npacket", 1, NULL, 'n'},
+        {0,0,0,0}
+    };
+    int opt, opti, npacket=10000;
+    while ((opt=getopt_long(argc,argv,"hn:",long_opts,&opti))!=-1) {
+        switch (opt) {
+            case 'n':
+                npacket = atoi(optarg);
+                break;
+            default:
+            case 'h':
+                usage();
+                exit(0);
+                break;
+        }
+    }
+
+    /* Typical channel counts, plus a couple that leave leftovers */
+    const int nchans[] = {64, 128, 256, 512, 1024, 2048, 100, 1000};
+    const int npols[] = {2, 4};
+    const int nnchan = sizeof(nchans)/sizeof(nchans[0]);
+    const int maxsize = 4*2048;
+
+    /* Spread the input over many packets so it is not all in cache */
+    const int nbuf = 256;
+    char *in = (char *)malloc((size_t)nbuf * maxsize);
+    char *ref = (char *)malloc(maxsize);
+    char *out = (char *)malloc((size_t)nbuf * maxsize);
+    int i, j, k, ip, ic, fail=0;
+    for (i=0; i<nbuf*maxsize; i++) in[i] = rand() & 0xff;
+
+    printf("Default kernel: %s\n", parkes_kernel_name());
+    printf("%4s %5s", "npol", "nchan");
+    for (k=0; k<PARKES_NKERNEL; k++) {
+        const struct parkes_kernel *kern = parkes_get_kernel(k);
+        if (kern!=NULL) printf(" %12s", kern->name);
+    }
+    printf("   (MB/s)\n");
+
+    for (ip=0; ip<2; ip++) {
+        for (ic=0; ic<nnchan; ic++) {
+            const int npol = npols[ip], nchan = nchans[ic];
+            const size_t size = npol * nchan;
+            printf("%4d %5d", npol, nchan);
+            for (k=0; k<PARKES_NKERNEL; k++) {
+                const struct parkes_kernel *kern = parkes_get_kernel(k);
+                if (kern==NULL) continue;
+                parkes_reorder_func f = (npol==2) ? kern->npol2 : kern->npol4;
+                const struct parkes_kernel *scalar = 
+                    parkes_get_kernel(PARKES_KERNEL_SCALAR);
+                parkes_reorder_func fs = (npol==2) ? scalar->npol2 
+                    : scalar->npol4;
+
+                /* Check result */
+                for (j=0; j<nbuf; j+=37) {
+                    fs(ref, &in[j*size], nchan);
+                    f(out, &in[j*size], nchan);
+                    if (memcmp(ref, out, size)) {
+                        printf("\n%s output differs (npol=%d nchan=%d)\n",
+                                kern->name, npol, nchan);
+                        fail=1;
+                        break;
+                    }
+                }
+
+                /* Time it */
+                double t0 = now();
+                for (i=0; i<npacket; i++) 
+                    f(&out[(i%nbuf)*size], &in[(i%nbuf)*size], nchan);
+                double t1 = now();
+                printf(" %12.1f", 
+                        (double)npacket*size/(t1-t0)/(1024.0*1024.0));
+            }
+            printf("\n");
+        }
+    }
+
+    /* Sequence number decoding */
+    const int nseq = 100*npacket;
+    unsigned long long sum=0;
+    struct guppi_udp_packet *p = (struct guppi_udp_packet *)
+        malloc(sizeof(struct guppi_udp_packet));
+    p->data = p->buf;
+    p->payload = NULL;
+    double t0 = now();
+    for (i=0; i<nseq; i++) {
+        ((unsigned long long *)p->buf)[0] = i;
+        sum += change_endian64_bytes((unsigned long long *)p->data);
+    }
+    double t1 = now();
+    for (i=0; i<nseq; i++) {
+        ((unsigned long long *)p->buf)[0] = i;
+        sum -= guppi_udp_packet_seq_num(p);
+    }
+    double t2 = now();
+    if (sum!=0) { printf("seq num decode mismatch\n"); fail=1; }
+    printf("seq num decode: bytes %.2f ns, bswap %.2f ns\n",
+            1e9*(t1-t0)/nseq, 1e9*(t2-t1)/nseq);
+
+    free(p);
+    free(in);
+    free(ref);
+    free(out);
+    exit(fail);
+}
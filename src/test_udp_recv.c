@@ -20,6 +20,9 @@ void usage() {
             "Usage: guppi_udp [options] sender_hostname\n"
             "Options:\n"
             "  -p n, --port=n    Port number\n"
+            "  -c, --capture     Use TPACKET capture ring\n"
+            "  -i s, --iface=s   Capture interface (with -c)\n"
+            "  -b n, --busy=n    Busy-poll, n usec SO_BUSY_POLL\n"
             "  -h, --help        This message\n"
            );
 }
@@ -36,16 +39,33 @@ int main(int argc, char *argv[]) {
     static struct option long_opts[] = {
         {"help",   0, NULL, 'h'},
         {"port",   1, NULL, 'p'},
+        {"capture",0, NULL, 'c'},
+        {"iface",  1, NULL, 'i'},
+        {"busy",   1, NULL, 'b'},
         {0,0,0,0}
     };
     int opt, opti;
     p.port = 50000;
     p.packet_size=8200; 
-    while ((opt=getopt_long(argc,argv,"hp:",long_opts,&opti))!=-1) {
+    strcpy(p.capture_mode, "SOCKET");
+    p.iface[0] = '\0';
+    p.reuseport = 0;
+    p.busy_poll = 0;
+    while ((opt=getopt_long(argc,argv,"hp:ci:b:",long_opts,&opti))!=-1) {
         switch (opt) {
             case 'p':
                 p.port = atoi(optarg);
                 break;
+            case 'c':
+                strcpy(p.capture_mode, "TPACKET");
+                break;
+            case 'i':
+                strncpy(p.iface, optarg, 31);
+                p.iface[31] = '\0';
+                break;
+            case 'b':
+                p.busy_poll = atoi(optarg);
+                break;
             default:
             case 'h':
                 usage();
@@ -0,0 +1,363 @@
+/* test_udp_send.c
+ *
+ * Synthetic packet sender, the other half of test_udp_recv.  Sends
+ * GUPPI, 1SFA, FAST4K, SHORT or Parkes format packets of 8-bit
+ * spectra holding noise plus a dispersed periodic pulse, at a given
+ * rate.  Used to load-test guppi_daq_server on loopback and to
+ * check that the fold thread recovers the injected profile.
+ *
+ * Pulse phase 0 is at the start of packet 0, at infinite frequency.
+ * TBIN/OBSNCHAN/NPOL/OBSFREQ/OBSBW in the receiving status buffer
+ * should match the options given here.
+ */
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "guppi_udp.h"
+#include "guppi_pktfmt.h"
+#include "guppi_error.h"
+
+#define NOISE_SIZE (1<<20)  /* Bytes of precomputed noise */
+#define PROF_NBIN_BITS 10   /* log2 of pulse profile bins */
+#define PROF_NBIN (1<<PROF_NBIN_BITS)
+#define DM_CONST 4.148808e3 /* s MHz^2 pc^-1 cm^3 */
+
+void usage() {
+    fprintf(stderr,
+            "Usage: test_udp_send [options] dest_hostname\n"
+            "Options:\n"
+            "  -p n, --port=n       Port number (50000)\n"
+            "  -f s, --format=s     Packet format (GUPPI)\n"
+            "  -r x, --rate=x       Packets/sec, 0 = max (0)\n"
+            "  -n n, --npacket=n    Packets to send, 0 = forever (0)\n"
+            "  -b n, --batch=n      Packets per sendmmsg call (32)\n"
+            "  -c n, --nchan=n      Channels (2048)\n"
+            "  -N n, --npol=n       Polarizations (4)\n"
+            "  -a n, --acclen=n     Accumulation length, Parkes only (16)\n"
+            "  -t x, --tsamp=x      Sample time, sec (40.96e-6)\n"
+            "  -F x, --freq=x       Center freq, MHz (1500.0)\n"
+            "  -B x, --bw=x         Bandwidth, MHz (800.0)\n"
+            "  -P x, --period=x     Pulse period, sec, 0 = no pulse (0.1)\n"
+            "  -D x, --dm=x         Pulse DM (0.0)\n"
+            "  -w x, --width=x      Pulse width, fraction of period (0.02)\n"
+            "  -A x, --amp=x        Pulse amplitude, counts (20.0)\n"
+            "  -m x, --mean=x       Noise mean, counts (64.0)\n"
+            "  -s x, --sigma=x      Noise rms, counts (8.0)\n"
+            "  -h, --help           This message\n"
+           );
+}
+
+/* control-c handler */
+int run=1;
+void stop_running(int sig) { run=0; }
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((double)ts.tv_sec + 1e-9*(double)ts.tv_nsec);
+}
+
+/* Synthetic signal state */
+struct signal_gen {
+    int nchan, npol;
+    double tsamp, period;
+    unsigned char noise[NOISE_SIZE + GUPPI_MAX_PACKET_SIZE];
+    unsigned char prof[PROF_NBIN];  /* Pulse profile, counts */
+    unsigned int *chan_delay;       /* Per-chan DM delay, 2^-32 turns */
+    unsigned int seed;
+};
+
+static void signal_init(struct signal_gen *g, int nchan, int npol,
+        double tsamp, double freq, double bw, double period, double dm,
+        double width, double amp, double mean, double sigma) {
+    int i;
+    g->nchan = nchan;
+    g->npol = npol;
+    g->tsamp = tsamp;
+    g->period = period;
+    g->seed = 1;
+
+    /* Gaussian noise, via Box-Muller */
+    srand(1);
+    for (i=0; i<NOISE_SIZE + GUPPI_MAX_PACKET_SIZE; i++) {
+        double u1 = (rand() + 1.0) / ((double)RAND_MAX + 2.0);
+        double u2 = rand() / ((double)RAND_MAX + 1.0);
+        double v = mean + sigma * sqrt(-2.0*log(u1)) * cos(2.0*M_PI*u2);
+        if (v<0.0) v = 0.0;
+        if (v>255.0) v = 255.0;
+        g->noise[i] = (unsigned char)(v + 0.5);
+    }
+
+    /* Gaussian pulse centered on phase 0 */
+    for (i=0; i<PROF_NBIN; i++) {
+        double ph = (double)i / PROF_NBIN;
+        if (ph>0.5) ph -= 1.0;
+        g->prof[i] = period>0.0 ?
+            (unsigned char)(amp * exp(-0.5*(ph/width)*(ph/width)) + 0.5) : 0;
+    }
+
+    /* Dispersion delay of each channel, as a fraction of a turn */
+    g->chan_delay = (unsigned int *)malloc(sizeof(unsigned int) * nchan);
+    for (i=0; i<nchan; i++) {
+        double f = freq - bw/2.0 + (i+0.5)*bw/nchan;
+        double delay = period>0.0 ? DM_CONST * dm / (f*f) / period : 0.0;
+        g->chan_delay[i] =
+            (unsigned int)(4294967296.0 * (delay - floor(delay)));
+    }
+}
+
+/* Fill out[0..nbyte-1] with data starting at byte offset pos of the
+ * (time, pol, chan) ordered stream of spectra.
+ */
+static void signal_fill(struct signal_gen *g, unsigned char *out,
+        unsigned long long pos, size_t nbyte) {
+    const size_t spec_size = (size_t)g->nchan * g->npol;
+    unsigned long long ispec = pos / spec_size;
+    size_t k = pos % spec_size;
+    int ipol = k / g->nchan, ichan = k % g->nchan;
+    const int npulse_pol = g->npol < 2 ? g->npol : 2;
+    const unsigned char *noise = &g->noise[rand_r(&g->seed) % NOISE_SIZE];
+    unsigned int ph=0;
+    size_t i=0, j, nrun;
+    while (i<nbyte) {
+        /* One run of channels of one pol at a time */
+        if (i==0 || ipol==0) {
+            double turns = g->period>0.0 ? ispec*g->tsamp/g->period : 0.0;
+            ph = (unsigned int)(4294967296.0 * (turns - floor(turns)));
+        }
+        nrun = g->nchan - ichan;
+        if (nrun > nbyte - i) nrun = nbyte - i;
+        if (ipol<npulse_pol) {
+            for (j=0; j<nrun; j++) {
+                unsigned int v = noise[i+j] + g->prof[
+                    (ph - g->chan_delay[ichan+j]) >> (32-PROF_NBIN_BITS)];
+                out[i+j] = v>255 ? 255 : v;
+            }
+        } else
+            memcpy(&out[i], &noise[i], nrun);
+        i += nrun;
+        ichan += nrun;
+        if (ichan==g->nchan) {
+            ichan = 0;
+            if (++ipol==g->npol) { ipol = 0; ispec++; }
+        }
+    }
+}
+
+/* Guppi (pol-major) order to Parkes interleaved order, the
+ * inverse of parkes_reorder().
+ */
+static void guppi_to_parkes(char *out, const char *in, int npol, int nchan) {
+    int i, p;
+    if (npol==2) {
+        for (i=0; i+2<=nchan; i+=2) {
+            *out++ = in[i]; *out++ = in[i+1];
+            *out++ = in[nchan+i]; *out++ = in[nchan+i+1];
+        }
+    } else if (npol==4) {
+        for (i=0; i<nchan; i++)
+            for (p=0; p<4; p++)
+                *out++ = in[p*nchan + i];
+    } else
+        memcpy(out, in, npol*nchan);
+}
+
+int main(int argc, char *argv[]) {
+
+    static struct option long_opts[] = {
+        {"help",    0, NULL, 'h'},
+        {"port",    1, NULL, 'p'},
+        {"format",  1, NULL, 'f'},
+        {"rate",    1, NULL, 'r'},
+        {"npacket", 1, NULL, 'n'},
+        {"batch",   1, NULL, 'b'},
+        {"nchan",   1, NULL, 'c'},
+        {"npol",    1, NULL, 'N'},
+        {"acclen",  1, NULL, 'a'},
+        {"tsamp",   1, NULL, 't'},
+        {"freq",    1, NULL, 'F'},
+        {"bw",      1, NULL, 'B'},
+        {"period",  1, NULL, 'P'},
+        {"dm",      1, NULL, 'D'},
+        {"width",   1, NULL, 'w'},
+        {"amp",     1, NULL, 'A'},
+        {"mean",    1, NULL, 'm'},
+        {"sigma",   1, NULL, 's'},
+        {0,0,0,0}
+    };
+    int opt, opti, port=50000, batch=32, nchan=2048, npol=4, acclen=16;
+    long long npacket=0;
+    double rate=0.0, tsamp=40.96e-6, freq=1500.0, bw=800.0;
+    double period=0.1, dm=0.0, width=0.02, amp=20.0, mean=64.0, sigma=8.0;
+    char format[32] = "GUPPI";
+    while ((opt=getopt_long(argc,argv,"hp:f:r:n:b:c:N:a:t:F:B:P:D:w:A:m:s:",
+                    long_opts,&opti))!=-1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'f':
+                strncpy(format, optarg, 31);
+                format[31] = '\0';
+                break;
+            case 'r': rate = atof(optarg); break;
+            case 'n': npacket = atoll(optarg); break;
+            case 'b': batch = atoi(optarg); break;
+            case 'c': nchan = atoi(optarg); break;
+            case 'N': npol = atoi(optarg); break;
+            case 'a': acclen = atoi(optarg); break;
+            case 't': tsamp = atof(optarg); break;
+            case 'F': freq = atof(optarg); break;
+            case 'B': bw = atof(optarg); break;
+            case 'P': period = atof(optarg); break;
+            case 'D': dm = atof(optarg); break;
+            case 'w': width = atof(optarg); break;
+            case 'A': amp = atof(optarg); break;
+            case 'm': mean = atof(optarg); break;
+            case 's': sigma = atof(optarg); break;
+            default:
+            case 'h':
+                usage();
+                exit(0);
+                break;
+        }
+    }
+    if (optind==argc) {
+        usage();
+        exit(1);
+    }
+    if (batch<1) batch = 1;
+    if (batch>GUPPI_MAX_PACKET_BATCH) batch = GUPPI_MAX_PACKET_BATCH;
+
+    /* Packet format */
+    struct guppi_pktfmt fmt;
+    if (guppi_pktfmt_init(&fmt, format, nchan, npol, acclen)!=GUPPI_OK)
+        exit(1);
+    if (fmt.layout==GUPPI_PKTFMT_PADDED) {
+        fprintf(stderr, "%s format is not supported\n", fmt.name);
+        exit(1);
+    }
+
+    /* Connect to the receiver */
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    char port_str[16];
+    sprintf(port_str, "%d", port);
+    if (getaddrinfo(argv[optind], port_str, &hints, &result)!=0) {
+        fprintf(stderr, "Can't resolve %s\n", argv[optind]);
+        exit(1);
+    }
+    int sock = socket(PF_INET, SOCK_DGRAM, 0);
+    if (sock<0 || connect(sock, result->ai_addr, result->ai_addrlen)<0) {
+        perror("socket");
+        exit(1);
+    }
+    freeaddrinfo(result);
+    int bufsize = 16*1024*1024;
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(int));
+
+    /* Signal generator */
+    struct signal_gen *g = (struct signal_gen *)malloc(
+            sizeof(struct signal_gen));
+    signal_init(g, nchan, npol, tsamp, freq, bw, period, dm, width, amp,
+            mean, sigma);
+
+    /* Packet batch */
+    char (*pkts)[GUPPI_MAX_PACKET_SIZE] = malloc(
+            (size_t)batch * GUPPI_MAX_PACKET_SIZE);
+    struct mmsghdr msgs[GUPPI_MAX_PACKET_BATCH];
+    struct iovec iovs[GUPPI_MAX_PACKET_BATCH];
+    char tmp[GUPPI_MAX_PACKET_SIZE];
+    int i;
+    memset(pkts, 0, (size_t)batch * GUPPI_MAX_PACKET_SIZE);
+    memset(msgs, 0, sizeof(msgs));
+    for (i=0; i<batch; i++) {
+        iovs[i].iov_base = pkts[i];
+        iovs[i].iov_len = fmt.packet_size;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    printf("Sending %s packets (%d bytes) to %s:%d, ", fmt.name,
+            (int)fmt.packet_size, argv[optind], port);
+    if (rate>0.0) printf("%.0f packets/s.\n", rate);
+    else printf("max rate.\n");
+    if (period>0.0)
+        printf("Pulse period %.6f s, DM %.3f, width %.3f, tsamp %.3e s.\n",
+                period, dm, width, tsamp);
+
+    /* Main loop */
+    unsigned long long seq=0, nsent=0, nrefused=0, nsyscall=0;
+    const double t0 = now();
+    signal(SIGINT, stop_running);
+    while (run && (npacket==0 || seq<npacket)) {
+
+        /* Build the next batch */
+        int n = batch;
+        if (npacket && seq + n > npacket) n = npacket - seq;
+        for (i=0; i<n; i++) {
+            unsigned long long idx = seq + i;
+            unsigned long long pos = idx * fmt.block_data_size;
+            char *data = pkts[i] + fmt.header_size;
+            if (fmt.layout==GUPPI_PKTFMT_INTERLEAVED) {
+                signal_fill(g, (unsigned char *)tmp, pos, fmt.data_size);
+                guppi_to_parkes(data, tmp, npol, nchan);
+                idx *= (unsigned long long)(nchan/2) * acclen;
+            } else
+                signal_fill(g, (unsigned char *)data, pos, fmt.data_size);
+            idx = __builtin_bswap64(idx);
+            memcpy(pkts[i], &idx, sizeof(idx));
+        }
+
+        /* Hold to the requested rate */
+        if (rate>0.0) {
+            double wait = t0 + (double)seq / rate - now();
+            if (wait>1e-3) usleep((useconds_t)(wait * 1e6));
+            else while (wait>0.0) wait = t0 + (double)seq / rate - now();
+        }
+
+        /* Send the batch.  Refused packets (nobody listening yet)
+         * are skipped over.
+         */
+        int k=0;
+        while (k<n && run) {
+            int rv = sendmmsg(sock, &msgs[k], n-k, 0);
+            nsyscall++;
+            if (rv<0) {
+                if (errno==ECONNREFUSED) { k++; nrefused++; continue; }
+                if (errno==ENOBUFS || errno==EAGAIN) continue;
+                perror("sendmmsg");
+                run = 0;
+                break;
+            }
+            k += rv;
+            nsent += rv;
+        }
+        seq += n;
+    }
+
+    double elapsed = now() - t0;
+    printf("Sent %lld packets in %.3f s (%.0f packets/s, %.3f Gb/s, "
+            "%.1f packets/call)\n", nsent, elapsed, nsent/elapsed,
+            8e-9*nsent*fmt.packet_size/elapsed,
+            nsyscall ? (double)nsent/nsyscall : 0.0);
+    if (nrefused)
+        printf("%lld packets refused by receiver\n", nrefused);
+
+    close(sock);
+    free(g->chan_delay);
+    free(g);
+    free(pkts);
+    exit(0);
+}